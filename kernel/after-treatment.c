@@ -4,7 +4,11 @@
 #include "param.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "mlist.h"
 #include "after-treatment.h"
+#include "funcid.h"
+
+extern int recovery_mode;
 
 char *syscall_res[7] = {"", "", "Syscall Success", "Syscall Fail", "Syscall Redo", "Reopen & Syscall Fail", "Reopen & Syscall Redo"};
 
@@ -49,3 +53,85 @@ af_return_to_kernel(uint64 sp, uint64 s0, int irq)
   printf_without_pr("end all recovery operations: %d\n", get_ticks());
   kerneltrapret(sp, s0, irq);
 }
+
+_Static_assert(NFUNCID <= 64 * AF_NMASK, "AF_NMASK is too small for the function IDs in funcid.h");
+
+// Build the bitmap of the function IDs which appear in t's rules.
+static void
+af_compile(struct af_table *t)
+{
+  uint64 mask[AF_NMASK];
+  const struct af_rule *r;
+
+  memset(mask, 0, sizeof(mask));
+  for(r = t->rules; r < t->rules + t->nrules; r++)
+    mask[r->fid / 64] |= 1UL << (r->fid % 64);
+
+  // Concurrent recovery handlers may compile the same table, but they store the same mask.
+  memmove(t->mask, mask, sizeof(mask));
+  __sync_synchronize();
+  t->compiled = 1;
+}
+
+// Decide the After-Treatment policy from the call stack's function IDs by the rule table t.
+// Frames are scanned from the innermost one. For each frame, the first rule in t which
+// matches its function, recovery_mode and pid's User Cooperation status is applied.
+// The first AF_STOP rule decides the policy, otherwise the last AF_SET rule does.
+// If no rule matches, ret is returned.
+int
+af_decide(struct af_table *t, int *fids, int pid, uint64 sp, uint64 s0, int ret)
+{
+  uint64 onstack[AF_NMASK], hit = 0;
+  int i, w, fid, coop = -1, trap = -1, res;
+  const struct af_rule *r;
+
+  if(!t->compiled)
+    af_compile(t);
+
+  memset(onstack, 0, sizeof(onstack));
+  for(i = 0; i < DEPTH; i++){
+    if(fids[i] != FN_NONE)
+      onstack[fids[i] / 64] |= 1UL << (fids[i] % 64);
+  }
+  for(w = 0; w < AF_NMASK; w++)
+    hit |= onstack[w] & t->mask[w];
+  if(hit == 0)
+    return ret;  // No rule matches this call stack.
+
+  for(i = 0; i < DEPTH; i++){
+    fid = fids[i];
+    if(fid == FN_NONE || (t->mask[fid / 64] & (1UL << (fid % 64))) == 0)
+      continue;
+
+    for(r = t->rules; r < t->rules + t->nrules; r++){
+      if(r->fid != fid || (r->mode != AF_ANY && r->mode != recovery_mode))
+        continue;
+      if(r->with != FN_NONE && (onstack[r->with / 64] & (1UL << (r->with % 64))) == 0)
+        continue;
+      if(r->coop != AF_ANY){
+        if(coop < 0)
+          coop = is_enable_user_coop(pid);
+        if(r->coop != coop)
+          continue;
+      }
+
+      res = r->ret;
+      if(res == AF_TRAP){
+        if(trap < 0)
+          trap = identify_nmi_occurred_trap(pid, sp, s0);
+        if(trap == USERTRAP)
+          res = RETURN_TO_USER;
+        else if(trap == KERNELTRAP)
+          res = RETURN_TO_KERNEL;
+        else
+          break;  // Not in a trap, this frame decides nothing.
+      }
+      if(r->stop == AF_STOP)
+        return res;
+      ret = res;
+      break;
+    }
+  }
+
+  return ret;
+}
@@ -24,3 +24,32 @@
 // Status of Ev6 User Cooperation.
 #define ENABLE  1
 #define DISABLE 0
+
+/*
+ * After-Treatment rule tables.
+ * Each recovery handler decides its policy from the function IDs on the call stack (funcid.h)
+ * by af_decide() with a table of rules instead of its own if/else ladder.
+ */
+#define AF_ANY  -1  // Match any recovery mode or User Cooperation status.
+#define AF_SET  0   // The policy can be overwritten by the rules matching outer frames.
+#define AF_STOP 1   // The policy is decided at once.
+#define AF_TRAP 0x10  // Return-to-User or Return-to-Kernel depending on the trap which the NMI occurred in.
+#define AF_NMASK 1  // Words of the function ID bitmap (64 IDs per word, checked against NFUNCID at build time).
+
+struct af_rule {
+  int fid;    // Function on the call stack.
+  char mode;  // Recovery mode (AGGRESSIVE, CONSERVATIVE or AF_ANY).
+  char coop;  // User Cooperation status (ENABLE, DISABLE or AF_ANY).
+  char stop;  // AF_SET or AF_STOP.
+  int ret;    // After-Treatment policy or AF_TRAP.
+  int with;   // The rule matches only if this function is also on the call stack (or FN_NONE).
+};
+
+struct af_table {
+  const struct af_rule *rules;
+  int nrules;
+  int compiled;            // mask is ready.
+  uint64 mask[AF_NMASK];   // Function IDs which appear in rules.
+};
+
+#define AF_TABLE(r) {r, NELEM(r), 0, {0}}
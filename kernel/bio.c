@@ -40,6 +40,7 @@ binit(void)
 
   mlist.buf_list->addr = &bcache.head;
   mlist.buf_list->next = mlist.buf_list;
+  mlist.buf_list->prev = mlist.buf_list;
 
   // Create linked list of buffers
   bcache.head.prev = &bcache.head;
@@ -52,8 +53,8 @@ binit(void)
     bcache.head.next->prev = b;
 
     bcache.head.next = b;
-		register_memobj(b, mlist.buf_list); 
   }
+  register_memobj_array(bcache.buf, NBUF, mlist.buf_list);
 }
 
 // Look through buffer cache for block on device dev.
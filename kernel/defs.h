@@ -18,6 +18,8 @@ struct kmem;
 struct mlist_node;
 struct mlist_header;
 struct disk;
+struct af_table;
+struct ptdup_run;
 
 // bio.c
 void            binit(void);
@@ -76,6 +78,9 @@ void*           kalloc(void);
 void            kfree(void *);
 void            kinit();
 void            freerange(void*, void*);
+void            kdup(void*);
+int             krefs(void*);
+int             kfreepages(void);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -125,6 +130,7 @@ int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
 struct proc*    allocproc(void);
 void            freeproc(struct proc*);
+struct proc*    search_proc_from_pid(int);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -190,6 +196,8 @@ void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
+int             uvmcow(pagetable_t, uint64);
+int             uvmlazy(struct proc*, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 
@@ -211,6 +219,11 @@ void            af_return_syscall_result(int);
 void            af_process_kill(void);
 void            af_return_to_user(int, int);
 void            af_return_to_kernel(uint64, uint64, int);
+int             af_decide(struct af_table*, int*, int, uint64, uint64, int);
+
+// func_pointer.c
+int             pc2funcid(uint64);
+void            pcs2funcids(uint64*, int*, int);
 
 // kerneltrapret.c
 int             identify_nmi_occurred_trap(int, uint64, uint64);
@@ -221,54 +234,87 @@ void            mlistinit(void);
 void            init_ptb_list(pagetable_t, int);
 void            register_memobj(void*, struct mlist_node*);
 void            delete_memobj(void*, struct mlist_node*, uint64);
+void            register_memobj_array(void*, int, struct mlist_node*);
+void            update_memobj_array(void*, void*, struct mlist_node*);
 void            delete_locks_from_mlist(uint64, uint64, struct mlist_node*);
 char*           my_kalloc(void*, int);
+int             mlist_lookup(void*, uint64*);
 void            getcallerpcs_top(uint64*, uint64, uint64, int);
 void            getcallerpcs_bottom(uint64*, uint64, uint64, int);
 uint64          get_ticks(void);
 uint64          sys_check_memory_space_overhead(void);
 
+// mlist_index.c
+struct mlist_index;
+struct mlist_index_node;
+int             mlist_index_insert(struct mlist_index*, uint64, uint64, int, void*);
+int             mlist_index_insert_array(struct mlist_index*, uint64, uint64, int, int);
+struct mlist_index_node* mlist_index_container(struct mlist_index*, uint64, int);
+int             mlist_index_delete(struct mlist_index*, uint64, int);
+struct mlist_index_node* mlist_index_find(struct mlist_index*, uint64, int);
+struct mlist_index_node* mlist_index_first(struct mlist_index*, uint64, uint64, int);
+int             mlist_index_lookup(struct mlist_index*, uint64, uint64*);
+void            mlist_index_free(struct mlist_index*);
+
+// mlist_page.c
+struct page_desc;
+struct page_desc* pa2desc(void*);
+void            set_page_state(void*, int);
+
 // mlist_pagetable.c
 void            register_ptb_mlist(int, uint64, int);
 void            delete_ptb_mlist(uint64);
-void            delete_ptb_mlist_all(int);
 
 // mlist_tracker.c
 void            check_and_acquire(struct spinlock*);
 void            check_and_release(struct spinlock*);
 void            mlist_tracker(char*);
+uint            recovery_domains(void*, uint64*, uint64*);
 void            cleanup_unused_procs(int);
 void            check_all_locks(int);
 struct cpu*     search_cpu_from_pid(int);
-struct proc*    search_proc_from_pid(int);
 
 // nmi_handle.c
 int             nmi_handle(char*);
 void	        nmi_imitate(char*);
 void	        nmivec(void);
+void            nmi_queue_init(void);
+int             nmi_queue_pids(int*);
+struct nmi_info* mynmi(void);
+void            nmi_recovery_done(void);
 
 // ptdup.c
+int             ptdup_idx(pagetable_t);
 void            ptdup_init(pagetable_t);
-void            ptdup_create_l1(pagetable_t, pagetable_t, uint64);
+void            ptdup_create_l1(pagetable_t, int, uint64);
 void            ptdup_delete_all(pagetable_t, pagetable_t);
-void            ptdup_update(pagetable_t, pagetable_t, uint64, int);
+void            ptdup_update(pagetable_t, int, uint64, int);
 void            L0_ptes_add(pagetable_t, uint64, int);
 void            L0_ptes_delete(pagetable_t, uint64, int);
 void            L0_ptes_clear_user(pagetable_t, uint64);
+void            ptdup_run_add(pagetable_t, struct ptdup_run*, uint64, uint64, int);
+void            ptdup_run_flush(pagetable_t, struct ptdup_run*);
+int             ptdup_mapped(int, uint64, uint64);
+void            ptdup_clone(pagetable_t, pagetable_t, uint64);
+void            ptdup_add_page(pagetable_t, uint64, uint64, int);
 
 // recovery_locking.c
 void            init_recovery_lock_idx(void);
 void            init_recovery_locks(void);
-void            init_rcs_infos(int);
+void            init_rcs_infos(struct proc*);
 int             check_and_count_procs_in_rcs(int, void*);
 int             check_and_wait_procs_in_rcs_file(void*, void*);
 int             check_and_wait_procs_in_rcs_inode(void*, void*, int);
 int             check_proc_in_log_commit(int);
 void            enter_recovery_critical_section(int, int);
 void            enter_recovery_critical_section_nodes(int, void*);
+int             try_enter_recovery_critical_section_nodes(int, void*);
+void            wait_recovery_nodes(int, void*);
 void            exit_recovery_critical_section(int, int);
 void            exit_recovery_critical_section_nodes(int, void*);
 void            exit_rcs_after_recovery(int, int);
+uint            begin_rcs_read_nodes(int, void*);
+int             retry_rcs_read_nodes(int, void*, uint);
 void            acquire_recovery_lock(int);
 void            acquire_recovery_lock_buf(void*);
 void            acquire_recovery_lock_file(void*);
@@ -277,7 +323,7 @@ void            release_recovery_lock(int);
 void            release_recovery_lock_buf(void*);
 void            release_recovery_lock_file(void*);
 void            release_recovery_lock_inode(void*);
-void            free_rcs_history(int);
+void            free_rcs_history(struct proc*);
 int             search_rcs_history(int, int);
 void            update_recovery_lock_idx(int, void*, void*);
 
@@ -312,9 +358,9 @@ void		    check_pcs(struct proc*);
 
 // trans.c
 void            init_trans_info(void);
-void            register_trans_info(int);
-void            delete_trans_info(int);
-void            enter_trans_log(void);
+void            register_trans_info(struct proc*);
+void            delete_trans_info(struct proc*);
+void            enter_trans_log(int);
 void            exit_trans_log(void);
 void            enter_trans_pagetable(void);
 void            exit_trans_pagetable(void);
@@ -326,7 +372,6 @@ int             check_and_handle_trans_pagetable(int);
 void            check_and_handle_trans_run(int);
 
 // user_coop.c
-void            usercoopinit(void);
 int             is_enable_user_coop(int);
 
 // number of elements in fixed-size array
@@ -27,10 +27,7 @@ fileinit(void)
 {
   initlock(&ftable->lock, "ftable");
 
-  struct file *fp;
-  for(fp = ftable->file; fp < ftable->file + NFILE; fp++){
-    register_memobj(fp, mlist.fil_list);
-  }
+  register_memobj_array(ftable->file, NFILE, mlist.fil_list);
 }
 
 // Allocate a file structure.
@@ -38,20 +35,37 @@ struct file*
 filealloc(void)
 {
   struct file *f;
+  uint seq;
+  int ref;
 
   acquire(&ftable->lock);
+ scan:
   for(f = ftable->file; f < ftable->file + NFILE; f++){
-    enter_recovery_critical_section_nodes(RL_FLAG_FILE, f);
-    if(f->ref == 0){
-
+    seq = begin_rcs_read_nodes(RL_FLAG_FILE, f);  // Only read f until it is chosen.
+    ref = f->ref;
+    if(retry_rcs_read_nodes(RL_FLAG_FILE, f, seq))
+      goto wait;
+    if(ref == 0){
+      if(try_enter_recovery_critical_section_nodes(RL_FLAG_FILE, f) < 0)
+        goto wait;
+      if(f->ref != 0){  // A recovery finished after the read changed f.
+        exit_recovery_critical_section_nodes(RL_FLAG_FILE, f);
+        continue;
+      }
       f->ref = 1;
       release(&ftable->lock);
       return f;
     }
-    exit_recovery_critical_section_nodes(RL_FLAG_FILE, f);
   }
   release(&ftable->lock);
   return 0;
+
+ wait:
+  // f is (or was) under recovery. Wait for it without ftable->lock, and scan again.
+  release(&ftable->lock);
+  wait_recovery_nodes(RL_FLAG_FILE, f);
+  acquire(&ftable->lock);
+  goto scan;
 }
 
 // Increment ref count for file f.
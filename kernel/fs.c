@@ -186,8 +186,8 @@ iinit()
   initlock(&icache->lock, "icache");
   for(i = 0; i < NINODE; i++) {
     initsleeplock(&icache->inode[i].lock, "inode");
-    register_memobj(&icache->inode[i], mlist.ino_list);
   }
+  register_memobj_array(icache->inode, NINODE, mlist.ino_list);
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -247,36 +247,61 @@ static struct inode*
 iget(uint dev, uint inum)
 {
   struct inode *ip, *empty;
+  uint seq;
+  int ref, hit;
 
   acquire(&icache->lock);
 
+ scan:
   // Is the inode already cached?
   empty = 0;
 
   for(ip = &icache->inode[0]; ip < &icache->inode[NINODE]; ip++){
-    enter_recovery_critical_section_nodes(RL_FLAG_INODE, ip);
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&icache->lock);
-      return ip;
+    seq = begin_rcs_read_nodes(RL_FLAG_INODE, ip);  // Only read ip until it is chosen.
+    ref = ip->ref;
+    hit = ref > 0 && ip->dev == dev && ip->inum == inum;
+    if(retry_rcs_read_nodes(RL_FLAG_INODE, ip, seq))
+      goto wait;
+    if(hit){
+      if(try_enter_recovery_critical_section_nodes(RL_FLAG_INODE, ip) < 0)
+        goto wait;
+      if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+        ip->ref++;
+        release(&icache->lock);
+        return ip;
+      }
+      // A recovery finished after the read changed ip, scan again.
+      exit_recovery_critical_section_nodes(RL_FLAG_INODE, ip);
+      goto scan;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
+    if(empty == 0 && ref == 0)    // Remember empty slot.
       empty = ip;
-    exit_recovery_critical_section_nodes(RL_FLAG_INODE, ip);
   }
 
-  enter_recovery_critical_section_nodes(RL_FLAG_INODE, empty);
   // Recycle an inode cache entry.
   if(empty == 0)
     panic("iget: no inodes");
-
   ip = empty;
+  if(try_enter_recovery_critical_section_nodes(RL_FLAG_INODE, ip) < 0)
+    goto wait;
+  if(ip->ref != 0){  // A recovery finished after the read changed ip, scan again.
+    exit_recovery_critical_section_nodes(RL_FLAG_INODE, ip);
+    goto scan;
+  }
+
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
   release(&icache->lock);
   return ip;
+
+ wait:
+  // ip is (or was) under recovery. Wait for it without icache->lock, and scan again.
+  release(&icache->lock);
+  wait_recovery_nodes(RL_FLAG_INODE, ip);
+  acquire(&icache->lock);
+  goto scan;
 }
 
 // Increment reference count for ip.
@@ -0,0 +1,101 @@
+// IDs of kernel functions which recovery handlers find in call stacks.
+// kernel/functable.c (their address ranges sorted by start) is generated
+// from this list and the linked kernel by functable.pl.
+
+#define FUNCIDS(X) \
+  /* bio.c */ \
+  X(bfree) \
+  X(brelse) \
+  /* console.c */ \
+  X(consoleintr) \
+  X(consoleread) \
+  X(consolewrite) \
+  /* exec.c */ \
+  X(exec) \
+  /* file.c */ \
+  X(filealloc) \
+  X(fileclose) \
+  /* fs.c */ \
+  X(dirlink) \
+  X(idup) \
+  X(iput) \
+  X(iupdate) \
+  X(readsb) \
+  X(writei) \
+  X(fsinit) \
+  /* kalloc.c */ \
+  X(kalloc) \
+  X(kfree) \
+  /* log.c */ \
+  X(begin_op) \
+  X(end_op) \
+  X(log_write) \
+  X(write_head) \
+  X(write_log) \
+  X(commit) \
+  X(install_trans) \
+  /* pipe.c */ \
+  X(pipealloc) \
+  X(pipeclose) \
+  X(pipewrite) \
+  X(piperead) \
+  /* printf.c */ \
+  X(printf) \
+  X(panic) \
+  /* proc.c */ \
+  X(allocproc) \
+  X(exit) \
+  X(fork) \
+  X(freeproc) \
+  X(procinit) \
+  /* sleeplock.c */ \
+  X(acquiresleep) \
+  /* spinlock.c */ \
+  X(acquire) \
+  X(holding) \
+  X(release) \
+  /* sysfile.c */ \
+  X(sys_read) \
+  X(sys_write) \
+  X(sys_close) \
+  X(sys_fstat) \
+  X(sys_link) \
+  X(sys_unlink) \
+  X(create) \
+  X(sys_open) \
+  X(sys_chdir) \
+  X(sys_exec) \
+  X(sys_pipe) \
+  /* sysproc.c */ \
+  X(sys_sbrk) \
+  /* trap.c */ \
+  X(clockintr) \
+  X(kerneltrap) \
+  X(usertrap) \
+  X(devintr) \
+  X(kernelvec) \
+  X(nmivec) \
+  /* vm.c */ \
+  X(kvminit) \
+  X(uvmunmap) \
+  X(uvmalloc) \
+  X(uvmcopy) \
+  /* vritio_disk.c */ \
+  X(virtio_disk_intr)
+
+enum funcid {
+#define X(name) FN_##name,
+  FUNCIDS(X)
+#undef X
+  NFUNCID
+};
+
+#define FN_NONE (-1)
+
+// Address range of a function. Its code is [start, end), and a return address
+// into it is in (start, end], which pc2funcid() matches.
+struct funcrange {
+  uint64 start;
+  uint64 end;
+  int id;
+};
@@ -0,0 +1,41 @@
+#!/usr/bin/perl -w
+
+# Generate functable.c, the address ranges of the functions listed in funcid.h,
+# from the output of "nm -S" of the kernel on stdin.
+# Without stdin (-e), generate an empty table for the first link.
+
+use strict;
+
+my ($funcid, $empty) = ($ARGV[0], ($ARGV[1] // "") eq "-e");
+my (@names, %range);
+
+open(my $fh, "<", $funcid) or die "functable.pl: can't open $funcid\n";
+while(<$fh>){
+    push(@names, $1) if /^\s*X\((\w+)\)/;
+}
+close($fh);
+my %listed = map { $_ => 1 } @names;
+
+if(!$empty){
+    while(<STDIN>){
+        # address size type name (size is missing for symbols without .size)
+        next unless /^([0-9a-f]+) ([0-9a-f]+) [tT] (\w+)$/;
+        next unless $listed{$3};
+        die "functable.pl: $3 is defined twice\n" if exists $range{$3};
+        $range{$3} = [hex($1), hex($1) + hex($2)];
+    }
+    for my $name (@names){
+        die "functable.pl: $name is not found or has no size\n" unless exists $range{$name};
+    }
+}
+
+print "// generated by functable.pl - do not edit\n";
+print "#include \"types.h\"\n";
+print "#include \"funcid.h\"\n\n";
+print "const struct funcrange functable[] = {\n";
+for my $name (sort { $range{$a}[0] <=> $range{$b}[0] } keys %range){
+    printf("  {0x%x, 0x%x, FN_%s},\n", $range{$name}[0], $range{$name}[1], $name);
+}
+print "  {0, 0, FN_NONE},\n" if $empty;
+print "};\n\n";
+print "const int nfunctable = ", scalar(keys %range), ";\n";
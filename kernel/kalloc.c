@@ -27,6 +27,8 @@ void
 kinit()
 {
   initlock(&kmem->lock, "kmem");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem->mag[i].lock, "kmag");
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -39,61 +41,192 @@ freerange(void *pa_start, void *pa_end)
     kfree(p);
 }
 
+// Mark the page r as cached by CPU id.
+// The CPU is set before the state, so that the page is never seen in another CPU's cache.
+static void
+mag_mark(struct run *r, int id)
+{
+  struct page_desc *pd = pa2desc(r);
+
+  pd->level = id;
+  pd->ptdup = 0;
+  pd->ref = 0;
+  pd->state = PG_CACHED;
+}
+
+// Move up to KMAG_BATCH pages from the cache of CPU from to the cache m of CPU id.
+// The caller holds both caches' locks.
+static void
+mag_move(struct kmag *from, struct kmag *m, int id)
+{
+  struct run *r;
+
+  for(int i = 0; i < KMAG_BATCH && (r = from->head) != 0x0; i++){
+    from->head = r->next;
+    from->n--;
+    mag_mark(r, id);
+    r->next = m->head;
+    m->head = r;
+    m->n++;
+  }
+}
+
+// Refill the empty cache m of this CPU id with KMAG_BATCH pages from the Free-List,
+// or steal them from the other CPUs' caches if the Free-List is empty too.
+// The caller holds kmem->lock and m->lock, and is in the KMEM R.C.S.
+static void
+mag_refill(struct kmag *m, int id)
+{
+  struct run *r;
+
+  for(int i = 0; i < KMAG_BATCH && (r = kmem->freelist) != 0x0; i++){
+    kmem->freelist = r->next;
+    kmem->nfree--;
+    mag_mark(r, id);
+    r->next = m->head;
+    m->head = r;
+    m->n++;
+  }
+
+  for(int i = 0; i < NCPU && m->head == 0x0; i++){
+    if(i == id)
+      continue;
+    acquire(&kmem->mag[i].lock);
+    mag_move(&kmem->mag[i], m, id);
+    release(&kmem->mag[i].lock);
+  }
+}
+
+// Move KMAG_BATCH pages from this CPU's cache m back to the Free-List.
+// The caller holds kmem->lock and m->lock, and is in the KMEM R.C.S.
+static void
+mag_drain(struct kmag *m)
+{
+  struct run *r;
+
+  for(int i = 0; i < KMAG_BATCH && (r = m->head) != 0x0; i++){
+    m->head = r->next;
+    m->n--;
+    set_page_state(r, PG_FREE);
+    r->next = kmem->freelist;
+    kmem->freelist = r;
+    kmem->nfree++;
+  }
+}
+
 // Free the page of physical memory pointed at by v,
 // which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// The page goes to this CPU's cache, and the cache
+// returns a batch to the Free-List when it overflows.
+// kmem->lock is taken before a cache's lock.
 void
 kfree(void *pa)
 {
   struct run *r;
-  
+  struct kmag *m;
+  struct page_desc *pd;
+
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP){
     panic("kfree");
   }
 
+  // A user page shared by copy-on-write fork() is freed by the last page table mapping it.
+  pd = pa2desc(pa);
+  if(pd->state == PG_USER && pd->ref > 1 && __sync_sub_and_fetch(&pd->ref, 1) > 0)
+    return;
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
   enter_recovery_critical_section(RL_FLAG_KMEM, 0);
-  acquire(&kmem->lock);
+  push_off();
+  m = &kmem->mag[cpuid()];
+  acquire(&m->lock);
   enter_trans_run(r);
-  if(mlist.run_list != 0)
-    register_memobj(r, mlist.run_list);
+  mag_mark(r, cpuid());
 
-  r->next = kmem->freelist;
-  kmem->freelist = r;
+  r->next = m->head;
+  m->head = r;
+  m->n++;
 
   exit_trans_run();
-  release(&kmem->lock);
+  if(m->n > KMAG_MAX){
+    release(&m->lock);
+    acquire(&kmem->lock);
+    acquire(&m->lock);
+    mag_drain(m);
+    release(&kmem->lock);
+  }
+  release(&m->lock);
+  pop_off();
   exit_recovery_critical_section(RL_FLAG_KMEM, 0);
 }
 
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
+// The page comes from this CPU's cache, which is
+// refilled by a batch from the Free-List when empty.
 void *
 kalloc(void)
 {
   struct run *r;
+  struct kmag *m;
 
   enter_recovery_critical_section(RL_FLAG_KMEM, 0);
+  push_off();
+  m = &kmem->mag[cpuid()];
+  acquire(&m->lock);
+  if(m->head == 0x0){
+    release(&m->lock);
+    acquire(&kmem->lock);
+    acquire(&m->lock);
+    mag_refill(m, cpuid());  // m is still empty, since other CPUs only steal from it.
+    release(&kmem->lock);
+  }
 
-  acquire(&kmem->lock);
-
-  r = kmem->freelist;
+  r = m->head;
   if(r){
-    kmem->freelist = r->next;
+    m->head = r->next;
+    m->n--;
+    set_page_state(r, PG_KOBJ);
   }
-
-  if(r && mlist.run_list != 0)
-    delete_memobj(r, mlist.run_list, 0x0);
-  release(&kmem->lock);
+  release(&m->lock);
+  pop_off();
   exit_recovery_critical_section(RL_FLAG_KMEM, 0);
 
   if(r)
     memset((char*)r, 5, PGSIZE); // fill with junk
   return (void*)r;
 }
+
+// Share the user page pa with one more page table (copy-on-write fork()).
+// ref is changed atomically instead of under a lock.
+void
+kdup(void *pa)
+{
+  __sync_fetch_and_add(&pa2desc(pa)->ref, 1);
+}
+
+// Number of page tables mapping the user page pa.
+int
+krefs(void *pa)
+{
+  return pa2desc(pa)->ref;
+}
+
+// Number of free pages, in the Free-List and the per-CPU page caches.
+// The caches are read without their CPUs, so this is an estimate.
+int
+kfreepages(void)
+{
+  int n = kmem->nfree;
+
+  for(int i = 0; i < NCPU; i++)
+    n += kmem->mag[i].n;
+  return n;
+}
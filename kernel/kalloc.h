@@ -1,8 +1,21 @@
+#define KMAG_MAX   64  // Capacity of a per-CPU page cache
+#define KMAG_BATCH 32  // Pages moved between a per-CPU page cache and the Free-List at once
+
 struct run {
   struct run *next;
 };
 
+// Per-CPU page cache (magazine) of free pages.
+// Its pages are PG_CACHED with the CPU in page_desc's level, so that recovery can rebuild it.
+struct kmag {
+  struct spinlock lock;  // Taken by other CPUs only to steal pages (see kalloc.c).
+  struct run *head;
+  int n;
+} __attribute__((aligned(64)));
+
 struct kmem{
   struct spinlock lock;
   struct run *freelist;
+  int nfree;              // Number of pages in freelist.
+  struct kmag mag[NCPU];
 };
@@ -8,19 +8,11 @@
 #include "proc.h"
 #include "nmi.h"
 #include "after-treatment.h"
+#include "funcid.h"
 
 extern int recovery_mode;
 extern struct mlist_header mlist;
 
-extern uint64 clockintr_start, clockintr_end;
-extern uint64 consoleintr_start, consoleintr_end;
-extern uint64 devintr_start, devintr_end;
-extern uint64 exit_start, exit_end;
-extern uint64 kerneltrap_start, kerneltrap_end;
-extern uint64 kernelvec_start, kernelvec_end;
-extern uint64 nmivec_start, nmivec_end;
-extern uint64 usertrap_start, usertrap_end;
-
 void kernelret();
 
 // Extract the contents of some general registers which are stored in recovery process's stack.
@@ -28,8 +20,8 @@ static void
 getregs_from_stack(uint64 *regs, uint64 sp, uint64 s0)
 {
   int is_devintr = 0, is_kerneltrap = 0;
-  int i = 0;
-  uint64 m_sp = sp, m_s0 = s0, ra;
+  int i = 0, fid;
+  uint64 m_sp = sp, m_s0 = s0;
   uint64 depth, *stack, endline;
   uint64 tmp_regs[DEPTH][4];
 
@@ -44,7 +36,6 @@ getregs_from_stack(uint64 *regs, uint64 sp, uint64 s0)
     depth = (m_s0 - m_sp) / 8;
     m_sp  = m_s0;            // Save next stack's top address.
     m_s0  = stack[depth-2];  // Pick up s0 from stack's second from the bottom.
-    ra    = stack[depth-1];
 
     tmp_regs[i][0] = m_s0;  // Store s0.
     tmp_regs[i][1] = stack[depth-3];  // Store value that may be s1.
@@ -60,24 +51,24 @@ getregs_from_stack(uint64 *regs, uint64 sp, uint64 s0)
 
   // Search temporary buffer and find appropriate values.
   for(int j = 0; j < i-1; j++){
-    ra = tmp_regs[j][3];
+    fid = pc2funcid(tmp_regs[j][3]);  // ra
 
-    if(ISINSIDE(ra, consoleintr_start, consoleintr_end)){  // In the kernelvec's stack contents.
+    if(fid == FN_consoleintr){  // In the kernelvec's stack contents.
       regs[2] = tmp_regs[j+1][2];  // sepc (from s2 register).
     }
-    else if(ISINSIDE(ra, devintr_start, devintr_end)){  // In the uartintr()'s stack content.
+    else if(fid == FN_devintr){  // In the uartintr()'s stack content.
       if(is_devintr == 1){  // Hardware intr's devintr().
         regs[1] = tmp_regs[j+1][1];  // sstatus (from s1 register).
       }
       is_devintr++;
     }
-    else if(ISINSIDE(ra, kerneltrap_start, kerneltrap_end)){  // In the devintr()'s stack content.
+    else if(fid == FN_kerneltrap){  // In the devintr()'s stack content.
       if(is_kerneltrap == 1){  // Hardware intr's kerneltrap().
         regs[0] = tmp_regs[j][0];  // sp (from s0 register)
       }
       is_kerneltrap++;
     }
-    else if(ISINSIDE(ra, clockintr_start, clockintr_end)){  // In the acquire()/release() of tickslock.
+    else if(fid == FN_clockintr){  // In the acquire()/release() of tickslock.
       regs[2] = tmp_regs[j][2];  // sepc (from s2 register).
     }
   }
@@ -110,6 +101,7 @@ identify_nmi_occurred_trap(int pid, uint64 sp, uint64 s0)
 {
   int is_kernelvec = 0;
   uint64 pcs[DEPTH];
+  int fids[DEPTH];
 
   if(sp == 0x0 || s0 - sp > PGSIZE){  // In the case of invalid s0 or sp is passed.
     struct proc *p = search_proc_from_pid(pid);
@@ -117,16 +109,17 @@ identify_nmi_occurred_trap(int pid, uint64 sp, uint64 s0)
   } else {
     getcallerpcs_top(pcs, sp, s0, DEPTH);
   }
+  pcs2funcids(pcs, fids, DEPTH);
 
   for(int i = 0; i < DEPTH; i++){
-    if(ISINSIDE(pcs[i], kernelvec_start, kernelvec_end) || ISINSIDE(pcs[i], nmivec_start, nmivec_end)){
+    if(fids[i] == FN_kernelvec || fids[i] == FN_nmivec){
       is_kernelvec = 1;
     }
     else if(is_kernelvec == 1){
-      if(ISINSIDE(pcs[i], usertrap_start, usertrap_end)){
+      if(fids[i] == FN_usertrap){
         return USERTRAP;  // usertrap (console intr) -> kerneltrap (NMI)
       }
-      else if(ISINSIDE(pcs[i], kerneltrap_start, kerneltrap_end)){
+      else if(fids[i] == FN_kerneltrap){
         return KERNELTRAP;  // usertrap (other intrs) -> kerneltrap (console intr) -> kerneltrap (NMI)
       }
     }
@@ -89,7 +89,7 @@ read_head(void)
   struct logheader *lh = (struct logheader *) (buf->data);
   int i;
 
-  enter_trans_log();
+  enter_trans_log(-1);  // Restoring n rolls all the slots back.
 
   log->lh.n = lh->n;
   dup_lhdr.n = lh->n;
@@ -254,7 +254,7 @@ log_write(struct buf *b)
       break;
   }
 
-  enter_trans_log();
+  enter_trans_log(i);
   log->lh.block[i]  = b->blockno;
 	dup_lhdr.block[i] = b->blockno;
   if (i == log->lh.n) {  // Add new block to log?
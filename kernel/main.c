@@ -20,7 +20,6 @@ main()
     init_trans_info();  // Ev6 transaction
     kinit();         // physical page allocator
     mlistinit();     // Ev6 M-List
-    usercoopinit();  // Ev6 userland cooperation
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     procinit();      // process table
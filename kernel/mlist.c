@@ -22,9 +22,8 @@
 #include "recovery_locking.h"
 #include "trans.h"
 #include "usercoop.h"
-
-#define AL_ARRAY_SIZE (PGSIZE / sizeof(struct mlist_node))
-#define EMPTY 0x101010101010101  // Indicate empty addrlist's page entry.
+#include "pipe.h"
+#include "funcid.h"
 
 struct mlist_header mlist;
 struct logheader dup_lhdr;  // For duplicate logheader for recovering struct log/logheader.
@@ -34,17 +33,15 @@ int mem_overhead_sum = 0;  // byte
 
 extern char end[];     // first address after kernel loaded from ELF file
                        // defined by the kernel linker script in kernel.ld
+extern char etext[];   // kernel.ld sets this to end of kernel code.
 extern int recovery_mode;
 extern struct cons *cons;
 extern struct devsw *devsw;
 extern struct kmem *kmem;
 extern struct pr *pr;
-extern struct recovered_addr_node recovered_list[];
 extern struct spinlock idx_lock;
-extern struct spinlock nmi_queue_lock;
 extern struct spinlock *tickslock;
 
-void init_run_list(void);  // Set up run's address list.
 void register_memobj(void*, struct mlist_node*);
 void delete_memobj(void*, struct mlist_node*, uint64);
 char* my_kalloc(void*, int);
@@ -55,62 +52,45 @@ void getcallerpcs_bottom(uint64*, uint64, uint64, int);
 void mlistinit(void){
   char *message;
 
+  // Every list is a circular list from its header node in mlist.head[].
+  for(int i = 0; i < MLT_NTYPES; i++){
+    mlist.head[i].next = mlist.head[i].prev = &mlist.head[i];
+    initlock(&mlist.lock[i], "M-List");
+  }
+  initlock(&mlist.index.lock, "M-List index");
   // FS
-  struct mlist_node *buf_head = (struct mlist_node*)kalloc();
-  struct mlist_node *fil_head = (struct mlist_node*)kalloc();
-  struct mlist_node *ino_head = (struct mlist_node*)kalloc();
-  struct mlist_node *log_head = (struct mlist_node*)kalloc();
-  struct mlist_node *lhd_head = (struct mlist_node*)kalloc();
-  struct mlist_node *pip_head = (struct mlist_node*)kalloc();
-  struct mlist_node *slp_head = (struct mlist_node*)kalloc();
-  struct mlist_node *spn_head = (struct mlist_node*)kalloc();
-  // Console
-  struct mlist_node *con_head = (struct mlist_node*)kalloc();
-  struct mlist_node *dev_head = (struct mlist_node*)kalloc();
-  struct mlist_node *pr_head  = (struct mlist_node*)kalloc();
-  // Memory Allocation
-  struct mlist_node *kmm_head = (struct mlist_node*)kalloc();
-  struct mlist_node *run_head = (struct mlist_node*)kalloc();
-  pagetable_t ptb_head = (pagetable_t)kalloc();
-
-  // FS
-  buf_head->next = mlist.buf_list = buf_head;
-  fil_head->next = mlist.fil_list = fil_head;
-  ino_head->next = mlist.ino_list = ino_head;
-  log_head->next = mlist.log_list = log_head;
-  lhd_head->next = mlist.lhd_list = lhd_head;
-  pip_head->next = mlist.pip_list = pip_head;
-  slp_head->next = mlist.slp_list = slp_head;
-  spn_head->next = mlist.spn_list = spn_head;
+  mlist.buf_list = &mlist.head[MLT_BUF];
+  mlist.fil_list = &mlist.head[MLT_FIL];
+  mlist.ino_list = &mlist.head[MLT_INO];
+  mlist.log_list = &mlist.head[MLT_LOG];
+  mlist.lhd_list = &mlist.head[MLT_LHD];
+  mlist.pip_list = &mlist.head[MLT_PIP];
+  mlist.slp_list = &mlist.head[MLT_SLP];
+  mlist.spn_list = &mlist.head[MLT_SPN];
   // Console
-  con_head->next = mlist.con_list = con_head;
-  dev_head->next = mlist.dev_list = dev_head;
-  pr_head->next  = mlist.pr_list  = pr_head;
+  mlist.con_list = &mlist.head[MLT_CON];
+  mlist.dev_list = &mlist.head[MLT_DEV];
+  mlist.pr_list  = &mlist.head[MLT_PR];
   // Memory Allocation
-  kmm_head->next = mlist.kmm_list = kmm_head;
-  run_head->next = mlist.run_list = run_head;
-  mlist.ptb_list = ptb_head;
-  ptb_head[511]  = (uint64)mlist.ptb_list;
+  mlist.kmm_list = &mlist.head[MLT_KMM];
+  mlist.pgd_list = &mlist.head[MLT_PGD];
 
-  initlock(&mlist.giant_lock, "M-List");
-  initlock(&mlist.ptb_lock, "M-List(page table)");
+  // The locks initialized before spn_list is set are registered here.
+  for(int i = 0; i < MLT_NTYPES; i++)
+    register_memobj(&mlist.lock[i], mlist.spn_list);
+  register_memobj(&mlist.index.lock, mlist.spn_list);
   initlock(&idx_lock, "idx_ptdup");
-  initlock(&nmi_queue_lock, "NMI_Queue");
+  nmi_queue_init();
 
   // Register memobj which is defined before allheadersinit().
   register_memobj(kmem, mlist.kmm_list);
   register_memobj(&kmem->lock, mlist.spn_list);
-  init_run_list();
   register_memobj(devsw, mlist.dev_list);
   register_memobj(cons, mlist.con_list);
   register_memobj(&cons->lock, mlist.spn_list);
   register_memobj(pr, mlist.pr_list);
   register_memobj(&pr->lock, mlist.spn_list);
 
-  for(int i = 0; i < 5; i++){
-    recovered_list[i].start = (void*)0x0;
-    recovered_list[i].end   = (void*)0x0;
-  }
   init_recovery_lock_idx();
 
   if(recovery_mode == AGGRESSIVE)
@@ -123,123 +103,295 @@ void mlistinit(void){
 }
 
 
-// Set up run's address list.
-void init_run_list(void){
-  struct mlist_node *rnode, *brnode = mlist.run_list, *nrnode;
-  struct run *r;
-  int i;
-  
-  rnode = brnode + 1;  // "++" can't use here.
-  for(i = 1, r = kmem->freelist; r->next != 0; r = r->next, rnode++, i++, brnode = brnode->next){
-    // When we reach last node of this page, 
-    // use the node as next page's address keeper for registering.
-    if(i == AL_ARRAY_SIZE-1){
-      nrnode = (struct mlist_node*)kalloc();
-      nrnode->addr = (void*)0x1010101;
-      rnode->addr = (void*)0;  // addr == 0 means that this node is the last node.
-      rnode->next = nrnode;
-      rnode = nrnode;
-      i = 0;  // Reset address list node's counter.
+// Size of memobjs in each list.
+static const uint64 objsize[MLT_NTYPES] = {
+[MLT_BUF] sizeof(struct buf),
+[MLT_FIL] sizeof(struct file),
+[MLT_INO] sizeof(struct inode),
+[MLT_LOG] sizeof(struct log),
+[MLT_LHD] sizeof(struct logheader),
+[MLT_PIP] sizeof(struct pipe),
+[MLT_SLP] sizeof(struct sleeplock),
+[MLT_SPN] sizeof(struct spinlock),
+[MLT_CON] sizeof(struct cons),
+[MLT_DEV] sizeof(struct devsw) * NDEV,
+[MLT_PR]  sizeof(struct pr),
+[MLT_KMM] sizeof(struct kmem),
+[MLT_PGD] PGSIZE,
+};
+
+// Identify the type tag of memobjs in the list of given header.
+static int
+header2type(struct mlist_node *header)
+{
+  if(header < mlist.head || header >= &mlist.head[MLT_NTYPES])
+    panic("header2type: unknown M-List header");
+  return header - mlist.head;
+}
+
+
+/* Slots are freed in two steps for the lock-free readers (see check_all_locks()).
+ * A deleted node is retired first and stamped with mlist.epoch,
+ * which a writer advances by one only when it sees no reader after reading the epoch.
+ * The check of the first advance after the stamp may precede the unlinking, but not the second.
+ * So once the epoch is 2 past the stamp, every reader which could stand on the node has left,
+ * and the node is returned to its page, to be reused (or freed with the page).
+ */
+static void
+retire_slot(int type, struct mlist_node *node)
+{
+  node->addr = (void*)EMPTY;  // node->next is kept for lock-free readers.
+  node->prev = mlist.retired[type];
+  mlist.retired[type] = node;
+  __sync_synchronize();  // The node is unlinked before we look at the readers.
+  mlist.retired_epoch[type] = mlist.epoch;
+}
+
+// Return the retired slots of the list to their pages if no reader can stand on them.
+// If reclaim, the pages which become empty are returned (linked through next) to be freed by the caller.
+static struct mlist_page*
+reclaim_slots(int type, int reclaim)
+{
+  struct mlist_page *pg, *empty = 0x0;
+  struct mlist_node *node;
+  uint epoch = mlist.epoch;
+
+  __sync_synchronize();
+  if(mlist.readers == 0)
+    __sync_bool_compare_and_swap(&mlist.epoch, epoch, epoch + 1);
+  if(mlist.retired[type] == 0x0 || mlist.epoch - mlist.retired_epoch[type] < 2)
+    return 0x0;
+
+  while((node = mlist.retired[type]) != 0x0){
+    mlist.retired[type] = node->prev;
+    pg = (struct mlist_page*)PGROUNDDOWN((uint64)node);
+    node->prev = pg->freeslot;
+    pg->freeslot = node;
+
+    if(pg->nused-- == SLOTS_PER_PAGE){  // This page has a free slot again.
+      pg->prev = 0x0;
+      pg->next = mlist.partial[type];
+      if(pg->next)
+        pg->next->prev = pg;
+      mlist.partial[type] = pg;
+    }
+
+    if(reclaim && pg->nused == 0){
+      if(pg->prev)
+        pg->prev->next = pg->next;
+      else
+        mlist.partial[type] = pg->next;
+      if(pg->next)
+        pg->next->prev = pg->prev;
+      pg->next = empty;
+      empty = pg;
+      __sync_fetch_and_sub(&mem_overhead_sum, PGSIZE);
     }
-    rnode->addr = (void*)r;
-    rnode->next = brnode->next;
-    brnode->next = rnode;
   }
-  return;
+  return empty;
 }
 
 
+// Take a free slot from the list's node pages.
+// If no page has a free slot, allocate a new page (not avoid_addr).
+static struct mlist_node*
+alloc_slot(int type, void *avoid_addr)
+{
+  struct mlist_page *pg;
+  struct mlist_node *node;
+
+  reclaim_slots(type, 0);
+  if((pg = mlist.partial[type]) == 0x0){
+    if((pg = (struct mlist_page*)my_kalloc(avoid_addr, 0)) == 0x0)
+      return 0x0;
+    pg->freeslot = 0x0;
+    for(node = &pg->slot[SLOTS_PER_PAGE-1]; node >= pg->slot; node--){
+      node->addr = (void*)EMPTY;
+      node->next = 0x0;
+      node->prev = pg->freeslot;
+      pg->freeslot = node;
+    }
+    pg->nused = 0;
+    pg->prev = 0x0;
+    pg->next = 0x0;
+    mlist.partial[type] = pg;
+    __sync_fetch_and_add(&mem_overhead_sum, PGSIZE);
+  }
+
+  node = pg->freeslot;
+  pg->freeslot = node->prev;
+  if(++pg->nused == SLOTS_PER_PAGE){  // This page becomes full.
+    mlist.partial[type] = pg->next;
+    if(pg->next)
+      pg->next->prev = 0x0;
+  }
+  return node;
+}
+
 void register_memobj(void *address, struct mlist_node *header){
   // Note that header must not be NULL (0x0).
-  struct mlist_node *rnode, *next_page;
-  // Register address page at first.
-  // Check for empty entries.
-  
-  acquire(&mlist.giant_lock);
-  for(rnode = header + 1;; rnode++){
-    if(rnode->addr == (void*)0x0)
-      rnode = rnode->next;
-    // In the case of reaching the last entry of this page.
-    if(((uint64)rnode & 0xfff) == 0xff0){
-      next_page = (struct mlist_node*)my_kalloc(address, 0);
-      next_page->addr = (void*)EMPTY;
-      rnode->addr = (void*)0x0;  // addr == 0x0 means this node is the last entry.
-      rnode->next = next_page;
-      rnode = next_page;
-      break;
-    }
-    else if(rnode->addr == (void*)EMPTY || rnode->addr == (void*)0x0505050505050505)
-      break;
-    else if(rnode->addr == address){  // Already exists.
-      release(&mlist.giant_lock);
-      return;
-    }
+  struct mlist_node *rnode;
+  int found, type = header2type(header);
+
+  acquire(&mlist.lock[type]);
+  // Writers of the other types may be rotating the index, so find it with the index's lock.
+  // No one else inserts this type until we release the list's lock.
+  acquire(&mlist.index.lock);
+  found = mlist_index_find(&mlist.index, (uint64)address, type) != 0x0;
+  release(&mlist.index.lock);
+  if(found){  // Already exists.
+    release(&mlist.lock[type]);
+    return;
   }
 
-  // Next, register the address to M-List.
-  if(rnode->addr == (void*)EMPTY || rnode->addr == (void*)0x0505050505050505){
-    rnode->addr  = address;
-    rnode->next  = header->next;
-    header->next = rnode;
-    release(&mlist.giant_lock);
+  if((rnode = alloc_slot(type, address)) == 0x0){
+    release(&mlist.lock[type]);
+    printf("register_memobj: fail to register %p\n", address);
     return;
   }
-  release(&mlist.giant_lock);
-  printf("register_memobj: fail to register %p\n", address);
+
+  rnode->addr  = address;
+  rnode->next  = header->next;
+  rnode->prev  = header;
+  __sync_synchronize();  // Publish the node before linking it for lock-free readers.
+  header->next->prev = rnode;
+  header->next = rnode;
+  acquire(&mlist.index.lock);
+  mlist_index_insert(&mlist.index, (uint64)address, objsize[type], type, rnode);
+  release(&mlist.index.lock);
+  release(&mlist.lock[type]);
   return;
 }
 
 
-/* Just delete the address from mlist and address page.
- * We don't free all empty address page in this function.
- * If mlist.giant_lock is already locked by register_memobj(),
- * we don't lock & release mlist.giant_lock in this function.
+/* Register an array of count memobjs from base as one array descriptor.
+ * The elements have no M-List nodes, and lookups resolve the element arithmetically.
+ */
+void register_memobj_array(void *base, int count, struct mlist_node *header){
+  int type = header2type(header);
+
+  acquire(&mlist.lock[type]);
+  acquire(&mlist.index.lock);
+  if(mlist_index_find(&mlist.index, (uint64)base, type) == 0x0)
+    mlist_index_insert_array(&mlist.index, (uint64)base, objsize[type], count, type);
+  release(&mlist.index.lock);
+  release(&mlist.lock[type]);
+}
+
+
+// Move the array descriptor from old to new (e.g. a new ftable is swapped in).
+void update_memobj_array(void *old, void *new, struct mlist_node *header){
+  struct mlist_index_node *in;
+  int type = header2type(header), count;
+
+  acquire(&mlist.lock[type]);
+  acquire(&mlist.index.lock);
+  in = mlist_index_find(&mlist.index, (uint64)old, type);
+  if(in != 0x0 && in->stride != 0){
+    count = (in->end - in->start) / in->stride;
+    mlist_index_delete(&mlist.index, (uint64)old, type);
+    mlist_index_insert_array(&mlist.index, (uint64)new, objsize[type], count, type);
+  }
+  release(&mlist.index.lock);
+  release(&mlist.lock[type]);
+}
+
+
+// Delete one element from an array descriptor by splitting it around the element.
+// The caller holds the list's lock and the index's lock.
+static void
+delete_array_element(int type, void *address)
+{
+  struct mlist_index_node *in = mlist_index_container(&mlist.index, (uint64)address, type);
+  uint64 base, end, stride;
+
+  if(in == 0x0 || in->stride == 0 || ((uint64)address - in->start) % in->stride != 0)
+    return;
+  base = in->start;
+  end = in->end;
+  stride = in->stride;
+
+  mlist_index_delete(&mlist.index, base, type);
+  if(base < (uint64)address)
+    mlist_index_insert_array(&mlist.index, base, stride, ((uint64)address - base) / stride, type);
+  if((uint64)address + stride < end)
+    mlist_index_insert_array(&mlist.index, (uint64)address + stride, stride, (end - (uint64)address - stride) / stride, type);
+}
+
+
+/* Delete the address from mlist and its node page.
+ * If size == 0, delete the memobj at address.
+ * If size > 0, delete the first memobj in [address, address+size].
+ * If address is an element of an array descriptor, the element is cut out of it.
+ * If the list's lock is already held by the caller,
+ * we don't lock & release it (and don't free an empty node page) in this function.
+ * The deleted node keeps its next pointer, so that a lock-free reader
+ * standing on the node can go on to the end of the list.
  */
 void delete_memobj(void *address, struct mlist_node *header, uint64 size){
   // Note that header must not be 0x0.
-  struct mlist_node *dnode, *bdnode = header;
-  int is_need_release = 0;
+  struct mlist_index_node *in;
+  struct mlist_node *dnode;
+  struct mlist_page *pg, *empty = 0x0;
+  int is_need_release = 0, type = header2type(header);
 
-  if(!holding(&mlist.giant_lock)){
-    acquire(&mlist.giant_lock);
+  if(!holding(&mlist.lock[type])){
+    acquire(&mlist.lock[type]);
     is_need_release = 1;
   }
 
-  // Given address equals to the broken address.
-  if(size == 0){
-    for(; bdnode->next != header; bdnode = bdnode->next){
-      if(bdnode->next->addr == address){
-        dnode = bdnode->next;
-        bdnode->next = dnode->next;
-        dnode->addr = (void*)EMPTY;
-        dnode->next = (void*)EMPTY;
-        if(holding(&mlist.giant_lock) && is_need_release)
-          release(&mlist.giant_lock);
-        return;
-      }
-    }
+  acquire(&mlist.index.lock);
+  if(size == 0)
+    in = mlist_index_find(&mlist.index, (uint64)address, type);
+  else
+    in = mlist_index_first(&mlist.index, (uint64)address, (uint64)address + size, type);
+
+  if(in != 0x0){
+    dnode = (struct mlist_node*)in->data;
+    mlist_index_delete(&mlist.index, in->start, type);
+    release(&mlist.index.lock);
+    dnode->prev->next = dnode->next;
+    dnode->next->prev = dnode->prev;
+    retire_slot(type, dnode);
+    empty = reclaim_slots(type, is_need_release);
+  } else {
+    if(size == 0)
+      delete_array_element(type, address);
+    release(&mlist.index.lock);
   }
 
-  // Given address includes the broken address.
-  else if(size > 0){
-    for(; bdnode->next != header; bdnode = bdnode->next){
-      if(address <= bdnode->next->addr && bdnode->next->addr <= (void*)((uint64)address + size)){
-        dnode = bdnode->next;
-        bdnode->next = dnode->next;
-        dnode->addr = (void*)EMPTY;
-        dnode->next = (void*)EMPTY;
-        if(holding(&mlist.giant_lock) && is_need_release)
-          release(&mlist.giant_lock);
-        return;
-      }
+  if(is_need_release){
+    release(&mlist.lock[type]);
+    while(empty){
+      pg = empty;
+      empty = pg->next;
+      kfree((void*)pg);
     }
   }
-  if(holding(&mlist.giant_lock) && is_need_release)
-    release(&mlist.giant_lock);
   return;
 }
 
 
+
+// Report the memory space overhead of the M-List (byte).
+uint64 sys_check_memory_space_overhead(void){
+  uint64 nodes = mem_overhead_sum, index = (uint64)mlist.index.npages * PGSIZE;
+  uint64 descs = NPAGEDESC * sizeof(struct page_desc);
+
+  printf("M-List overhead: nodes %d, index %d, page descriptors %d (byte)\n", nodes, index, descs);
+  return nodes + index + descs;
+}
+
+
+// Look up memobjs of every type which include target by one lookup of the index.
+// This is lock-free unless writers keep racing with it, so it can be called from the NMI side.
+int mlist_lookup(void *target, uint64 *hits){
+  for(int i = 0; i < MLT_NTYPES; i++)
+    hits[i] = 0x0;
+  return mlist_index_lookup(&mlist.index, (uint64)target, hits);
+}
+
+
 // A function to allocate kernel page without using normal kalloc() 
 // to avoid allocating deleting page in kfree() by calling register_memobj().
 // I'll add the function of multiple (more than 3 pages) page allocation soon.
@@ -275,7 +427,7 @@ char* my_kalloc(void *avoid_addr, int multi){
   // Or only one page is needed.
   else {
     r = kmem->freelist;
-    if((void*)r == avoid_addr){  // If r shouldn't allocate, reallocate.
+    if(r && (void*)r == avoid_addr){  // If r shouldn't allocate, reallocate.
       r = kmem->freelist->next;
       if(r)
         kmem->freelist->next = r->next;
@@ -284,86 +436,108 @@ char* my_kalloc(void *avoid_addr, int multi){
       kmem->freelist = r->next;
   }
 
+  if(r)
+    kmem->nfree -= (multi > 1 ? multi : 1);
   if(holding(&kmem->lock))
     release(&kmem->lock);
-  if(r && mlist.run_list != 0)
-    delete_memobj((void*)r, mlist.run_list, 0x0);
+  for(i = 0; r && i < (multi > 1 ? multi : 1); i++)
+    set_page_state((char*)r + i*PGSIZE, PG_KOBJ);
   return (char*)r;
 }
 
 
-#define FILTER  0xFFFFFFFFFFFFF000  // filter for extracting upper 13 bits.
-#define NOVALUE 0x0505050505050505  // Not meaningful value.
+#define TRAPREGS_S0 7  // Index of s0 in the registers which kernelvec/nmivec save (56(sp)).
+#define TRAPREGS_SIZE 256
+
+// Is x an address in the kernel text?
+static int
+is_text(uint64 x)
+{
+  return KERNBASE < x && x < (uint64)etext;
+}
+
+/* Follow the frame chain from fp inside the kernel stack (lo, hi], and store the return addresses to pcs[].
+ * Each frame has ra at fp-8 and the caller's s0 at fp-16. The frame whose ra is in kernelvec or nmivec
+ * is kerneltrap()'s, and its fp points to the registers saved by the trap, so the trapped function's s0
+ * is taken from them. The walk stops at the stack's top, at the first invalid frame, or when pcs[] is full.
+ * Return the number of stored pcs, and set the last visited fp to *last.
+ */
+static int
+unwind(uint64 *pcs, uint64 fp, uint64 lo, uint64 hi, int size, uint64 *last)
+{
+  int n = 0, fid;
+  uint64 ra, next, *frame;
+
+  *last = 0;
+  while(n < size && lo < fp && fp <= hi && fp % 8 == 0){
+    *last = fp;
+    frame = (uint64*)fp;
+    ra = frame[-1];
+    if(!is_text(ra))
+      break;  // e.g. usertrap() at the top has the user's ra.
+    pcs[n++] = ra;
+
+    next = frame[-2];
+    fid = pc2funcid(ra);
+    if(fid == FN_kernelvec || fid == FN_nmivec){
+      if(fp + TRAPREGS_SIZE > hi)
+        break;
+      next = frame[TRAPREGS_S0];
+    }
+    if(next <= fp)
+      break;  // Callers' frames are always above.
+    fp = next;
+  }
+  return n;
+}
 
 // To check call stack(kstack) from top of stack and extract return addresses
 // to identify caller functions.
 void getcallerpcs_top(uint64 *pcs, uint64 sp, uint64 s0, int size){
-  uint64 m_sp = sp, m_s0 = s0, depth, *stack, endline;
-  int i = 0;
+  int i;
+  uint64 last;
 
   if(sp == 0x0 || s0 - sp > PGSIZE){
     panic("getcallerpcs_top: Invalid sp/s0 was passed");
   }
-  endline = (sp & FILTER) + 0x1000;
-
-  stack = (uint64*)sp;
-  while(m_s0 < endline && i < size){
-    depth  = (m_s0 - m_sp) / 8;
-    m_sp   = m_s0;            // Save next stack's top address.
-    m_s0   = stack[depth-2];  // Pick up s0 from stack's second from the bottom.
-    pcs[i] = stack[depth-1];  // Pick up ra from stack's first from the bottom.
-    i++;
-
-    if(m_sp == endline || m_s0 == endline)
-      break;
-    stack = (uint64*)m_sp;  // Update stack to see next stacked contents.
-  }
 
+  i = unwind(pcs, s0, sp, PGROUNDDOWN(sp) + PGSIZE, size, &last);
   for(; i < size; i++)
     pcs[i] = 0;
-
-  // To confirm the contents of pcs[] (for debug).
-  for(i = 0; i < size && pcs[i] != 0x0; i++)
-    printf("getcallerpcs_bottom: pcs[%d] = %p\n", i, pcs[i]);
-  return;
 }
 
-
-#define TEXT_TOP 0x80000000  // The top of section .text.
-#define TEXT_END 0x8000a10e  // The end of section .text.
-
 /* To check call stack (kstack) from bottom of stack and extract return addresses
  * to identify caller functions.
- * When xv6 calls kernelvec(), getcallerpcs_top() can't track under a chunk of contents because of trap,
- * so search stack from bottom.
- */ 
+ * This is used when s0 isn't valid, so find the lowest frame above endline whose chain reaches
+ * the top of the stack (or fills pcs[]), and follow it.
+ * If there is no such frame, fall back to collecting the words which look like return addresses.
+ */
 void getcallerpcs_bottom(uint64 *pcs, uint64 endline, uint64 bottom, int size){
   int i = 0;
-  uint64 tmp[DEPTH];
-  uint64 *stack = (uint64*)(bottom + 0xff8);
+  uint64 fp, last, top = bottom + PGSIZE;
+  uint64 *stack;
 
   if(endline == 0x0)
     panic("getcallerpcs_bottom: Invalid sp was passed");
-  for(; stack > (uint64*)endline; stack -= 0x1){  // 0x1 means 1 byte
-    if(TEXT_TOP < *stack && *stack < TEXT_END){
-      tmp[i] = *stack;
-      i++;
-    }
-    if(i > size)
+
+  for(fp = (endline + 16 + 7) & ~7L; fp <= top; fp += 8){
+    if(!is_text(((uint64*)fp)[-1]) || ((uint64*)fp)[-2] <= fp)
+      continue;
+    i = unwind(pcs, fp, endline, top, size, &last);
+    if(last == top || i == size)
       break;
+    i = 0;
   }
-  for(; i < size; i++)
-    tmp[i] = 0;
 
-  // Reorder pcs from "bottom to top" to "top to bottom".
-  for(i = 0; i < size; i++){
-    pcs[i] = tmp[DEPTH-1-i];
+  if(i == 0){
+    for(stack = (uint64*)endline; stack < (uint64*)top && i < size; stack++){
+      if(is_text(*stack))
+        pcs[i++] = *stack;
+    }
   }
 
-  // To confirm the contents of pcs[] (for debug).
-  for(i = 0; i < size && pcs[i] != 0x0; i++)
-    printf("getcallerpcs_bottom: pcs[%d] = %p\n", i, pcs[i]);
-  return;
+  for(; i < size; i++)
+    pcs[i] = 0;
 }
 
 // Get the ticks now.
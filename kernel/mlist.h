@@ -8,11 +8,71 @@
 #define REG 0  // Register to the M-List
 #define DEL 1  // Delete from the M-List
 #define DEPTH 30  // The depth of kernel stack searching.
+#define CACHELINE 64  // Granularity of coalescing NMIs on unknown memobjs.
+#define NRECOVERED 32  // Capacity of the recovered list.
 
 // Content of M-List for keeping memory objects addresses.
 struct mlist_node {
   void  *addr;
   struct mlist_node *next;
+  struct mlist_node *prev;  // Previous node in the list, or next free slot in the page
+};
+
+// Page of M-List nodes.
+// Pages which have free slots are linked from mlist.partial[] of the list.
+struct mlist_page {
+  struct mlist_page *next;
+  struct mlist_page *prev;
+  struct mlist_node *freeslot;  // Free slots in this page (linked through prev)
+  int nused;                    // The number of used slots
+  struct mlist_node slot[];
+};
+
+#define SLOTS_PER_PAGE ((PGSIZE - sizeof(struct mlist_page)) / sizeof(struct mlist_node))
+
+// Type tags of memory objects in the M-List index.
+#define MLT_BUF 0   // buf
+#define MLT_FIL 1   // file
+#define MLT_INO 2   // inode
+#define MLT_LOG 3   // log
+#define MLT_LHD 4   // logheader
+#define MLT_PIP 5   // pipe
+#define MLT_SLP 6   // sleeplock
+#define MLT_SPN 7   // spinlock
+#define MLT_CON 8   // cons
+#define MLT_DEV 9   // devsw
+#define MLT_PR  10  // pr
+#define MLT_KMM 11  // kmem
+#define MLT_PGD 12  // page directory
+#define MLT_NTYPES 13
+
+#define EMPTY 0x101010101010101  // Indicate empty addrlist's page entry.
+
+// Node of the address-ordered M-List index.
+// The index is an AVL interval tree keyed on (start, type),
+// and each node keeps the largest end address in its subtree.
+// A node is either one memobj or an array descriptor of memobjs
+// (e.g. ftable->file[]), which has no node in the M-List.
+struct mlist_index_node {
+  uint64 start;
+  uint64 end;      // start + size of the memobj (exclusive)
+  uint64 max_end;  // The largest end in this subtree
+  struct mlist_index_node *left;
+  struct mlist_index_node *right;
+  uint64 stride;   // Element size of an array descriptor (0 for a single memobj)
+  void *data;      // M-List node of the memobj (0x0 for an array descriptor)
+  int type;        // MLT_*
+  int height;
+};
+
+struct mlist_index {
+  struct spinlock lock;               // Writers' lock (taken inside the list's lock)
+  uint   seq;                         // Odd while a writer is updating the tree
+  struct mlist_index_node *root;
+  struct mlist_index_node *freelist;  // Free nodes in the node pages
+  uint64 *pages;                      // Node pages, linked through their first word
+  int npages;
+  int nnodes;
 };
 
 // The all address lists header node
@@ -35,14 +95,50 @@ struct mlist_header {
   // Memory Allocator's memory objects.
   struct mlist_node *kmm_list;  // kmem
   struct mlist_node *pgd_list;  // page directory (not struct, includes kpgdir)
-  struct mlist_node *run_list;  // run
-  uint64           *ptb_list;  // page table / page directory (not struct)
+  // Free pages (run) and page tables are kept in page_descs[] instead of lists.
 
-  // M-List locks.
-  struct spinlock  giant_lock;  // Giant lock on the whole M-List
-  struct spinlock  ptb_lock;    // Fine-grained M-List lock for page table
+  // Header nodes and node pages of each list above.
+  struct mlist_node  head[MLT_NTYPES];
+  struct mlist_page *partial[MLT_NTYPES];  // Pages which have free slots (header cursor)
+  int readers;  // Lock-free readers of the lists
+  uint epoch;   // Advanced when a writer sees no reader (see retire_slot() in mlist.c)
+  struct mlist_node *retired[MLT_NTYPES];  // Deleted nodes not reusable yet (linked through prev)
+  uint retired_epoch[MLT_NTYPES];          // mlist.epoch when the last node was retired
+
+  // Address-ordered index of the memobjs of all lists above.
+  struct mlist_index index;
+
+  // M-List locks for writers of each list.
+  // Readers traverse the lists and the indexes without locks.
+  struct spinlock  lock[MLT_NTYPES];
 };
 
+// States of physical pages in page_descs[].
+#define PG_UNTRACKED 0  // Kernel text/data, or not passed to kfree() yet
+#define PG_FREE      1  // In kmem->freelist (struct run is at the top of the page)
+#define PG_KOBJ      2  // Allocated by kalloc() for kernel objects
+#define PG_USER      3  // User memory
+#define PG_PTB       4  // Page table of process pid (level is in level)
+#define PG_PIPE      5  // struct pipe
+#define PG_ISOLATED  6  // Broken page which is never used again
+#define PG_CACHED    7  // In the per-CPU page cache of CPU level (struct run is at the top of the page)
+
+#define PG_RUN(state) ((state) == PG_FREE || (state) == PG_CACHED)  // The page holds a struct run
+
+// Descriptor of a physical page, indexed by PFN over KERNBASE..PHYSTOP.
+struct page_desc {
+  uchar  state;  // PG_*
+  uchar  level;  // Page table level (PG_PTB), or CPU of the page cache (PG_CACHED)
+  ushort ptdup;  // Index of the PTDUP head (level-2 PG_PTB, see ptdup.c)
+  union {
+    int  pid;    // Owner process (PG_PTB)
+    int  ref;    // Number of page tables mapping it (PG_USER, changed atomically, see kalloc.c)
+  };
+};
+
+#define NPAGEDESC ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PA2PD(pa) (&page_descs[((uint64)(pa) - KERNBASE) / PGSIZE])
+
 // Record recovered memobj's address
 struct recovered_addr_node {
   char *start;
@@ -53,11 +149,14 @@ struct recovered_addr_node {
   // In Ev6, this case may happen in file and inode.
   int pid;
   int rcs_flag;
+  uint stamp;  // Recorded order, the oldest one is evicted when the list is full.
+};
+
+// Recovered memobjs sorted by start, without overlaps (a newer record replaces overlapped ones).
+struct recovered_map {
+  int lock;   // Recoveries on other harts may record and search at the same time.
+  int n;
+  uint stamp;
+  struct recovered_addr_node node[NRECOVERED];
 };
 
-// Process content to add it to M-List node (for pagetable)
-#define PID2MLNODE(pid) (pid << 2)
-// Extract content from M-List node (for pagetable)
-#define MLNODE2PA(node) (node & ~0xFFF)
-#define MLNODE2PID(node) ((node & 0xFFD) >> 2)
-#define MLNODE2LEVEL(node) (node & 0x3)
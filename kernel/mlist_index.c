@@ -0,0 +1,472 @@
+/* Address-ordered index over the M-List.
+ * Every memobj registered to the type lists is also inserted into an AVL
+ * interval tree keyed on [addr, addr+size), so that mlist_tracker() can
+ * specify a broken memobj by O(log n) lookups instead of walking
+ * every type list in turn.
+ *
+ * One index holds the memobjs of all types, so a lookup stabs it once.
+ * Writers hold idx->lock and make idx->seq odd while updating.
+ * Readers take no lock: they retry when idx->seq was changed during the lookup,
+ * and take idx->lock at last if writers keep racing with them.
+ * Node pages of an index are not freed until mlist_index_free(),
+ * so a reader racing with a writer never follows a pointer out of the nodes.
+ */
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "proc.h"
+#include "mlist.h"
+
+#define NODES_PER_PAGE ((PGSIZE - sizeof(uint64)) / sizeof(struct mlist_index_node))
+#define LOOKUP_RETRY   100   // Retries of a lock-free lookup racing with writers.
+#define LOOKUP_VISIT   4096  // Max nodes visited in one lookup.
+
+static volatile uint64 bench_sink;  // Keep the benchmark loops from being optimized out.
+
+
+// Carve a new page into free nodes.
+static int
+index_refill(struct mlist_index *idx)
+{
+  struct mlist_index_node *n;
+  uint64 *page;
+
+  if((page = (uint64*)my_kalloc(0x0, 0)) == 0x0)
+    return -1;
+  page[0] = (uint64)idx->pages;
+  idx->pages = page;
+  idx->npages++;
+
+  n = (struct mlist_index_node*)(page + 1);
+  for(int i = 0; i < NODES_PER_PAGE; i++, n++){
+    n->left = idx->freelist;
+    idx->freelist = n;
+  }
+  return 0;
+}
+
+static int
+height(struct mlist_index_node *n)
+{
+  return n ? n->height : 0;
+}
+
+static void
+update(struct mlist_index_node *n)
+{
+  int hl = height(n->left), hr = height(n->right);
+
+  n->height = (hl > hr ? hl : hr) + 1;
+  n->max_end = n->end;
+  if(n->left && n->left->max_end > n->max_end)
+    n->max_end = n->left->max_end;
+  if(n->right && n->right->max_end > n->max_end)
+    n->max_end = n->right->max_end;
+}
+
+static struct mlist_index_node*
+rotate_right(struct mlist_index_node *n)
+{
+  struct mlist_index_node *l = n->left;
+
+  n->left = l->right;
+  l->right = n;
+  update(n);
+  update(l);
+  return l;
+}
+
+static struct mlist_index_node*
+rotate_left(struct mlist_index_node *n)
+{
+  struct mlist_index_node *r = n->right;
+
+  n->right = r->left;
+  r->left = n;
+  update(n);
+  update(r);
+  return r;
+}
+
+static struct mlist_index_node*
+rebalance(struct mlist_index_node *n)
+{
+  int balance;
+
+  update(n);
+  balance = height(n->left) - height(n->right);
+  if(balance > 1){
+    if(height(n->left->left) < height(n->left->right))
+      n->left = rotate_left(n->left);
+    return rotate_right(n);
+  }
+  if(balance < -1){
+    if(height(n->right->right) < height(n->right->left))
+      n->right = rotate_right(n->right);
+    return rotate_left(n);
+  }
+  return n;
+}
+
+// Compare key (start, type) with node n.
+static int
+keycmp(uint64 start, int type, struct mlist_index_node *n)
+{
+  if(start != n->start)
+    return start < n->start ? -1 : 1;
+  if(type != n->type)
+    return type < n->type ? -1 : 1;
+  return 0;
+}
+
+static struct mlist_index_node*
+node_insert(struct mlist_index_node *t, struct mlist_index_node *n, int *dup)
+{
+  int c;
+
+  if(t == 0x0)
+    return n;
+  if((c = keycmp(n->start, n->type, t)) == 0){
+    *dup = 1;
+    return t;
+  }
+  if(c < 0)
+    t->left = node_insert(t->left, n, dup);
+  else
+    t->right = node_insert(t->right, n, dup);
+  return rebalance(t);
+}
+
+static struct mlist_index_node*
+remove_min(struct mlist_index_node *t, struct mlist_index_node **min)
+{
+  if(t->left == 0x0){
+    *min = t;
+    return t->right;
+  }
+  t->left = remove_min(t->left, min);
+  return rebalance(t);
+}
+
+static struct mlist_index_node*
+node_remove(struct mlist_index_node *t, uint64 start, int type, struct mlist_index_node **found)
+{
+  struct mlist_index_node *min;
+  int c;
+
+  if(t == 0x0)
+    return 0x0;
+  if((c = keycmp(start, type, t)) < 0)
+    t->left = node_remove(t->left, start, type, found);
+  else if(c > 0)
+    t->right = node_remove(t->right, start, type, found);
+  else {
+    *found = t;
+    if(t->left == 0x0)
+      return t->right;
+    if(t->right == 0x0)
+      return t->left;
+    t->right = remove_min(t->right, &min);
+    min->left = t->left;
+    min->right = t->right;
+    t = min;
+  }
+  return rebalance(t);
+}
+
+// Collect every interval which includes target.
+// budget bounds the walk over a tree which a writer is rotating.
+static void
+stab(struct mlist_index_node *t, uint64 target, uint64 *hits, int *nhits, int *budget)
+{
+  while(t && target < t->max_end && (*budget)-- > 0){
+    stab(t->left, target, hits, nhits, budget);
+    if(target < t->start)
+      return;
+    if(target < t->end && t->type < MLT_NTYPES){
+      // For an array descriptor, the element index is resolved arithmetically.
+      hits[t->type] = t->stride ? t->start + (target - t->start) / t->stride * t->stride : t->start;
+      (*nhits)++;
+    }
+    t = t->right;
+  }
+}
+
+static void
+begin_write(struct mlist_index *idx)
+{
+  idx->seq++;
+  __sync_synchronize();
+}
+
+static void
+end_write(struct mlist_index *idx)
+{
+  __sync_synchronize();
+  idx->seq++;
+}
+
+
+static int
+index_insert(struct mlist_index *idx, uint64 start, uint64 end, uint64 stride, int type, void *data)
+{
+  struct mlist_index_node *n;
+  int dup = 0;
+
+  if(idx->freelist == 0x0 && index_refill(idx) < 0){
+    printf("mlist_index_insert: no page for index node\n");
+    return -1;
+  }
+  n = idx->freelist;
+  idx->freelist = n->left;
+
+  n->start = start;
+  n->end = end;
+  n->max_end = n->end;
+  n->left = n->right = 0x0;
+  n->stride = stride;
+  n->data = data;
+  n->type = type;
+  n->height = 1;
+
+  begin_write(idx);
+  idx->root = node_insert(idx->root, n, &dup);
+  end_write(idx);
+  if(dup){  // Already exists.
+    n->left = idx->freelist;
+    idx->freelist = n;
+    return -1;
+  }
+  idx->nnodes++;
+  return 0;
+}
+
+// Insert memobj [start, start+size) of given type.
+int
+mlist_index_insert(struct mlist_index *idx, uint64 start, uint64 size, int type, void *data)
+{
+  return index_insert(idx, start, start + size, 0, type, data);
+}
+
+// Insert an array descriptor of count memobjs of stride bytes from base.
+int
+mlist_index_insert_array(struct mlist_index *idx, uint64 base, uint64 stride, int count, int type)
+{
+  return index_insert(idx, base, base + stride * count, stride, type, 0x0);
+}
+
+// Delete memobj which starts at start.
+int
+mlist_index_delete(struct mlist_index *idx, uint64 start, int type)
+{
+  struct mlist_index_node *found = 0x0;
+
+  begin_write(idx);
+  idx->root = node_remove(idx->root, start, type, &found);
+  end_write(idx);
+  if(found == 0x0)
+    return -1;
+  found->left = idx->freelist;
+  idx->freelist = found;
+  idx->nnodes--;
+  return 0;
+}
+
+// Find memobj of given type which starts at start.
+struct mlist_index_node*
+mlist_index_find(struct mlist_index *idx, uint64 start, int type)
+{
+  struct mlist_index_node *t = idx->root;
+  int c;
+
+  while(t){
+    if((c = keycmp(start, type, t)) == 0)
+      return t;
+    t = c < 0 ? t->left : t->right;
+  }
+  return 0x0;
+}
+
+static struct mlist_index_node*
+container(struct mlist_index_node *t, uint64 target, int type)
+{
+  struct mlist_index_node *n;
+
+  if(t == 0x0 || target >= t->max_end)
+    return 0x0;
+  if((n = container(t->left, target, type)) != 0x0)
+    return n;
+  if(target < t->start)
+    return 0x0;
+  if(target < t->end && t->type == type)
+    return t;
+  return container(t->right, target, type);
+}
+
+// Find the memobj or array descriptor of given type which includes target (with the writer's lock).
+struct mlist_index_node*
+mlist_index_container(struct mlist_index *idx, uint64 target, int type)
+{
+  return container(idx->root, target, type);
+}
+
+// Find the lowest memobj which starts in [lo, hi] in the index of given type.
+struct mlist_index_node*
+mlist_index_first(struct mlist_index *idx, uint64 lo, uint64 hi, int type)
+{
+  struct mlist_index_node *t = idx->root, *ret = 0x0;
+
+  while(t){
+    if(keycmp(lo, type, t) <= 0){
+      if(t->type == type)
+        ret = t;
+      t = t->left;
+    } else
+      t = t->right;
+  }
+  return (ret && ret->start <= hi) ? ret : 0x0;
+}
+
+/* Look up all memobjs which include target without locks.
+ * hits[MLT_*] is set to the start address of the memobj of each type found,
+ * other entries are left as they are (the caller clears them).
+ * Memobjs nest (e.g. a spinlock in a pipe), so the caller decides priority.
+ */
+int
+mlist_index_lookup(struct mlist_index *idx, uint64 target, uint64 *hits)
+{
+  uint64 found[MLT_NTYPES];
+  uint seq;
+  int nhits, budget, retry;
+
+  for(retry = 0;; retry++){
+    for(int i = 0; i < MLT_NTYPES; i++)
+      found[i] = 0x0;
+    nhits = 0;
+    budget = LOOKUP_VISIT;
+
+    if(retry == LOOKUP_RETRY){
+      // Writers keep racing with us, so stab the tree with their lock.
+      // If this hart was stopped in the middle of a write, the lock is never released,
+      // so return the best-effort result of the tree as it is.
+      if(holding(&idx->lock)){
+        stab(idx->root, target, found, &nhits, &budget);
+        break;
+      }
+      acquire(&idx->lock);
+      stab(idx->root, target, found, &nhits, &budget);
+      release(&idx->lock);
+      break;
+    }
+
+    seq = idx->seq;
+    __sync_synchronize();
+    if(seq & 1)
+      continue;
+    stab(idx->root, target, found, &nhits, &budget);
+    __sync_synchronize();
+    if(idx->seq == seq)
+      break;
+  }
+
+  for(int i = 0; i < MLT_NTYPES; i++)
+    if(found[i])
+      hits[i] = found[i];
+  return nhits;
+}
+
+// Release all node pages of a private index.
+void
+mlist_index_free(struct mlist_index *idx)
+{
+  uint64 *page;
+
+  while((page = idx->pages) != 0x0){
+    idx->pages = (uint64*)page[0];
+    kfree((void*)page);
+  }
+  idx->root = idx->freelist = 0x0;
+  idx->npages = idx->nnodes = 0;
+}
+
+
+#define BENCH_MAX     4096  // Max number of memobjs in the benchmark.
+#define BENCH_LOOKUP  1000  // Number of lookups per measurement.
+#define BENCH_BASE    0x90000000L
+#define BENCH_STRIDE  64
+#define BENCH_SIZE    48
+#define LIST_PER_PAGE (PGSIZE / sizeof(struct mlist_node))
+#define LIST_PAGES(n) (((n) + LIST_PER_PAGE - 1) / LIST_PER_PAGE)  // Pages for the M-List of n memobjs.
+
+/* Microbenchmark of the M-List index.
+ * Build a private index and an equivalent M-List of n synthetic memobjs,
+ * and copy out the time of BENCH_LOOKUP lookups by each (in timer cycles).
+ * The synthetic addresses are never dereferenced.
+ */
+uint64
+sys_mlistbench(void)
+{
+  int n, i, nlpages;
+  uint64 uaddr, t[2], target, start, seed = 1, hits[MLT_NTYPES];
+  struct mlist_index bidx = {0};
+  struct mlist_node *lpages[LIST_PAGES(BENCH_MAX)], *node, head;
+
+  if(argint(0, &n) < 0 || argaddr(1, &uaddr) < 0)
+    return -1;
+  if(n <= 0 || n > BENCH_MAX)
+    return -1;
+
+  initlock(&bidx.lock, "mlistbench");
+  nlpages = LIST_PAGES(n);
+  for(i = 0; i < nlpages; i++){
+    if((lpages[i] = (struct mlist_node*)kalloc()) == 0x0){
+      while(--i >= 0)
+        kfree((void*)lpages[i]);
+      return -1;
+    }
+  }
+
+  // Build the list and the index with the same memobjs.
+  head.next = &head;
+  for(i = 0; i < n; i++){
+    node = &lpages[i / LIST_PER_PAGE][i % LIST_PER_PAGE];
+    node->addr = (void*)(BENCH_BASE + (uint64)i * BENCH_STRIDE);
+    node->next = head.next;
+    head.next = node;
+    if(mlist_index_insert(&bidx, (uint64)node->addr, BENCH_SIZE, i % MLT_NTYPES, node) < 0)
+      break;
+  }
+
+  // Sequential M-List walk (as search_mlist() did).
+  start = *(volatile uint64*)CLINT_MTIME;
+  for(i = 0; i < BENCH_LOOKUP; i++){
+    seed = seed * 6364136223846793005L + 1442695040888963407L;
+    target = BENCH_BASE + ((seed >> 33) % n) * BENCH_STRIDE + BENCH_SIZE / 2;
+    for(node = head.next; node != &head; node = node->next)
+      if((uint64)node->addr <= target && target < (uint64)node->addr + BENCH_SIZE)
+        break;
+    bench_sink = (uint64)node;
+  }
+  t[1] = *(volatile uint64*)CLINT_MTIME - start;
+
+  // Index lookup with the same targets.
+  seed = 1;
+  start = *(volatile uint64*)CLINT_MTIME;
+  for(i = 0; i < BENCH_LOOKUP; i++){
+    seed = seed * 6364136223846793005L + 1442695040888963407L;
+    target = BENCH_BASE + ((seed >> 33) % n) * BENCH_STRIDE + BENCH_SIZE / 2;
+    bench_sink = mlist_index_lookup(&bidx, target, hits);
+  }
+  t[0] = *(volatile uint64*)CLINT_MTIME - start;
+
+  mlist_index_free(&bidx);
+  for(i = 0; i < nlpages; i++)
+    kfree((void*)lpages[i]);
+
+  if(copyout(myproc()->pagetable, uaddr, (char*)t, sizeof(t)) < 0)
+    return -1;
+  return 0;
+}
@@ -0,0 +1,38 @@
+/* Manage per-physical-page descriptors (page_descs[]).
+ * Free pages (struct run) and page tables are not kept in M-List nodes,
+ * but their state is recorded in the descriptor of each page,
+ * so that kalloc()/kfree() update and mlist_tracker() classify a page in O(1).
+ */
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "mlist.h"
+
+struct page_desc page_descs[NPAGEDESC];
+
+
+// Return the descriptor of the page which includes pa, or 0x0 if pa is out of RAM.
+struct page_desc*
+pa2desc(void *pa)
+{
+  if((uint64)pa < KERNBASE || (uint64)pa >= PHYSTOP)
+    return 0x0;
+  return PA2PD(pa);
+}
+
+// Set the state of the page which includes pa.
+void
+set_page_state(void *pa, int state)
+{
+  struct page_desc *pd = pa2desc(pa);
+
+  if(pd == 0x0)
+    panic("set_page_state");
+  pd->level = 0;
+  pd->ptdup = 0;
+  pd->ref = (state == PG_USER) ? 1 : 0;  // Also clears pid.
+  pd->state = state;
+}
@@ -20,6 +20,7 @@
 #include "pipe.h"
 #include "recovery_locking.h"
 #include "after-treatment.h"
+#include "funcid.h"
 
 
 extern int dup_outstanding;
@@ -38,24 +39,11 @@ extern struct pr *pr;
 extern struct proc *initproc;
 extern struct spinlock *pid_lock;
 extern struct spinlock *tickslock;
-extern struct nmi_info *nmi_queue;
-extern struct spinlock nmi_queue_lock;
 extern struct spinlock nmi_lock;
 extern struct spinlock idx_lock;
 extern void   (*handler_for_mem_fault)(char*);  // Function which is called from NMI handler.
 
-extern uint64 brelse_start, brelse_end;
-extern uint64 end_op_start, end_op_end;
-extern uint64 exit_start, exit_end;
-extern uint64 fileclose_start, fileclose_end;
-extern uint64 freeproc_start, freeproc_end;
-extern uint64 kvminit_start, kvminit_end;
-extern uint64 procinit_start, procinit_end;
-extern uint64 sys_chdir_start, sys_chdir_end;
-extern uint64 sys_open_start, sys_open_end;
-extern uint64 uvmunmap_start, uvmunmap_end;
-
-struct recovered_addr_node recovered_list[DEPTH];
+struct recovered_map recovered_list;
 int recovery_mode = CONSERVATIVE;  // AGGRESSIVE or CONSERVATIVE
 
 void
@@ -74,119 +62,82 @@ check_and_release(struct spinlock *lk)
   }
 }
 
-// Find a struct proc from given pid.
-struct proc*
-search_proc_from_pid(int target_pid)
+
+
+static void
+recovered_lock(void)
 {
-  struct proc *p;
-  for (p = proc; p < &proc[NPROC]; p++) {
-    if (p->pid == target_pid) {
-      return p;
-    }
-  }
-  return 0x0;
+  while(__sync_lock_test_and_set(&recovered_list.lock, 1))
+    ;
 }
 
-// Function to judge that the M-List has target address or not.
-static uint64
-search_mlist(void *target, struct mlist_node* header, uint64 size)
+static void
+recovered_unlock(void)
 {
-  struct mlist_node *node;
-  uint64 ret = 0x0;
-
-  acquire(&mlist.giant_lock);
-
-  for(node = header->next; node != header; node = node->next){
-    if(node->addr <= target && target < (void*)((uint64)node->addr + size)){
-      ret = (uint64)node->addr;
-      break;
-    }
-  }
-
-  release(&mlist.giant_lock);
-  return ret;
+  __sync_lock_release(&recovered_list.lock);
 }
 
-// M-List search function for pagetable list.
-static uint64
-search_ptb_mlist(void *target)
+// Index of the last record whose start <= target, or -1. The caller holds the lock.
+static int
+recovered_floor(char *target)
 {
-  uint64 *page = mlist.ptb_list, ret = 0x0;
-
-  acquire(&mlist.giant_lock);
+  int lo = 0, hi = recovered_list.n - 1, mid, ret = -1;
 
-  for(int i = 0; i < ENTRY_SIZE; i++){
-    if(MLNODE2PA(page[i]) <= (uint64)target && (uint64)target < MLNODE2PA(page[i])+PGSIZE){
-      ret = page[i];  // found
-      break;
-    }
-    else if(i == ENTRY_SIZE-1){
-      if(page[i] == (uint64)mlist.ptb_list){
-        break;   // not found
-      }
-      page = (uint64*)page[i];  // Move to the next M-List page.
-      i = 0;
+  while(lo <= hi){
+    mid = (lo + hi) / 2;
+    if(recovered_list.node[mid].start <= target){
+      ret = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
     }
   }
-
-  release(&mlist.giant_lock);
-  return ret;  // If target entry isn't found, return 0x0.
+  return ret;
 }
 
-// Delete recovered broken address from NMI Queue and return next broken address.
-void*
-ret_and_search_nmiqueue(int terminate_status, int irq)
+static void
+recovered_remove(int i)
 {
-  int i;
-
-  acquire(&nmi_queue_lock);
-  nmi_queue[0].sp = terminate_status;
-  nmi_queue[0].s0 = irq;
-  release(&nmi_queue_lock);
-
-  // Wait other process which is waiting for this process finish recovery.
-  if(nmi_queue[0].pid != myproc()->pid){
-    while(1){
-      acquire(&nmi_queue_lock);
-      if(nmi_queue[0].addr == (char*)0x0){  // Following process finished.
-        release(&nmi_queue_lock);
-        break;
-      }
-      release(&nmi_queue_lock);
-    }
-  }
-
-  acquire(&nmi_queue_lock);
-  for(i = 0; i < NMI_QUEUE_SIZE-1; i++){
-    nmi_queue[i].addr = nmi_queue[i+1].addr;
-    nmi_queue[i].pid  = nmi_queue[i+1].pid;
-    nmi_queue[i].sp   = nmi_queue[i+1].sp;
-    nmi_queue[i].s0   = nmi_queue[i+1].s0;
-
-    if(nmi_queue[i+1].addr == 0x0 && nmi_queue[i+1].pid == 0x0){
-      break;
-    }
-  }
-  release(&nmi_queue_lock);
-
-  return nmi_queue[0].addr;
+  memmove(&recovered_list.node[i], &recovered_list.node[i+1], (recovered_list.n - i - 1) * sizeof(struct recovered_addr_node));
+  recovered_list.n--;
 }
 
-
 // Record address of finish recoverying memory object.
 static void
 record_recovered_memobj(char *start, char *end, int res, int pid, int rcs_flag)
 {
-  for(int i = 0; i < DEPTH; i++){
-    if(recovered_list[i].start == (void*)0x0 && recovered_list[i].end == (void*)0x0){
-      recovered_list[i].start = start;
-      recovered_list[i].end = end;
-      recovered_list[i].terminate_flag = res;
-      recovered_list[i].pid = pid;
-      recovered_list[i].rcs_flag = rcs_flag;
-      break;
-    }
-  }
+  struct recovered_addr_node *rn;
+  int i, oldest;
+
+  recovered_lock();
+  // Drop the records which the new one overlaps.
+  i = recovered_floor(end);
+  while(i >= 0 && recovered_list.node[i].end >= start){
+    recovered_remove(i);
+    i--;
+  }
+
+  // Evict the oldest record if full.
+  if(recovered_list.n == NRECOVERED){
+    oldest = 0;
+    for(i = 1; i < recovered_list.n; i++){
+      if(recovered_list.node[i].stamp < recovered_list.node[oldest].stamp)
+        oldest = i;
+    }
+    recovered_remove(oldest);
+  }
+
+  i = recovered_floor(start) + 1;
+  memmove(&recovered_list.node[i+1], &recovered_list.node[i], (recovered_list.n - i) * sizeof(struct recovered_addr_node));
+  recovered_list.n++;
+  rn = &recovered_list.node[i];
+  rn->start = start;
+  rn->end = end;
+  rn->terminate_flag = res;
+  rn->pid = pid;
+  rn->rcs_flag = rcs_flag;
+  rn->stamp = recovered_list.stamp++;
+  recovered_unlock();
 }
 
 
@@ -194,15 +145,14 @@ record_recovered_memobj(char *start, char *end, int res, int pid, int rcs_flag)
 static int
 search_recovered_addr(char *broken)
 {
-  int ret = -1;
+  int i, ret = -1;
   char* target = (char*)((uint64)broken & 0xFFFFFFFF);
 
-  for(int i = 0; i < DEPTH; i++){
-    if(recovered_list[i].start <= target && target <= recovered_list[i].end){
-      ret = recovered_list[i].terminate_flag;  // Found
-      break;
-    }
-  }
+  recovered_lock();
+  i = recovered_floor(target);
+  if(i >= 0 && target <= recovered_list.node[i].end)
+    ret = recovered_list.node[i].terminate_flag;  // Found
+  recovered_unlock();
 
   return ret;  // Not Found
 }
@@ -211,12 +161,17 @@ int
 is_in_old_rcs(int r_pid, int m_pid)
 {
   int flag = 0;
+  uint stamp = 0;
 
-  for(int i = 0; i < DEPTH; i++){
-    if(recovered_list[i].pid == r_pid){
-      flag = recovered_list[i].rcs_flag;
+  // Use the latest record of r_pid.
+  recovered_lock();
+  for(int i = 0; i < recovered_list.n; i++){
+    if(recovered_list.node[i].pid == r_pid && recovered_list.node[i].stamp >= stamp){
+      flag = recovered_list.node[i].rcs_flag;
+      stamp = recovered_list.node[i].stamp;
     }
   }
+  recovered_unlock();
 
   // If RL_FLAG is valid, search the first recovery proc's R.C.S history.
   if(flag != 0 && search_rcs_history(r_pid, flag) && search_rcs_history(m_pid, flag)){
@@ -230,22 +185,21 @@ static void
 search_and_delete_isolated_ptdup(int pid)
 {
   struct proc *p;
-  uint64 entry;
+  struct page_desc *pd;
 
   if(pid == 0){
-    for(int i = 1; i <= NPROC; i++){
+    for(int i = 1; i < PTDUP_SIZE; i++){
       if(idx_ptdup[i] == 0x0){
         continue;
       }
 
       acquire(&idx_lock);
-      for(p = proc; p < &proc[NPROC]; p++){
-        if(idx_ptdup[i] == (uint64*)p->pagetable){
-          break;
-        }
+      if((pd = pa2desc(idx_ptdup[i])) == 0x0){  // Freed meanwhile, or not a RAM page.
+        release(&idx_lock);
+        continue;
       }
-
-      if(p == &proc[NPROC] && idx_ptdup[i] != p->pagetable){
+      p = search_proc_from_pid(pd->pid);  // The L2 page records its owner.
+      if(p == 0x0 || idx_ptdup[i] != p->pagetable){
         release(&idx_lock);
         ptdup_delete_all(idx_ptdup[i], 0x0);
         acquire(&idx_lock);
@@ -255,14 +209,17 @@ search_and_delete_isolated_ptdup(int pid)
   } else {  // For memory errors in exec().
     p = search_proc_from_pid(pid);
 
-    for(int i = 1; i <= NPROC; i++){
+    for(int i = 1; i < PTDUP_SIZE; i++){
       if(idx_ptdup[i] == 0x0){
         continue;
       }
 
       acquire(&idx_lock);
-      entry = search_ptb_mlist(idx_ptdup[i]);
-      if(pid == MLNODE2PID(entry) && (uint64)p->pagetable != MLNODE2PA(entry)){
+      if((pd = pa2desc(idx_ptdup[i])) == 0x0){
+        release(&idx_lock);
+        continue;
+      }
+      if(pd->state == PG_PTB && pd->pid == pid && p->pagetable != idx_ptdup[i]){
         release(&idx_lock);
         ptdup_delete_all(idx_ptdup[i], 0x0);
         acquire(&idx_lock);
@@ -300,14 +257,13 @@ iundup(struct inode *ip)
 void
 cleanup_unused_procs(int epid)
 {
-  struct proc *p, *exit_proc = 0x0;
+  static int cleaning = 0;  // Recoveries on other harts may clean up at the same time.
+  struct proc *p, *exit_proc;
 
-  for(p = proc; p < &proc[NPROC]; p++){
-    if(p->pid == epid){
-      exit_proc = p;
-      break;
-    }
-  }
+  while(__sync_lock_test_and_set(&cleaning, 1))
+    ;
+
+  exit_proc = search_proc_from_pid(epid);
 
   for(p = proc; p < &proc[NPROC]; p++){
     if(p->pid == 0)
@@ -355,6 +311,7 @@ cleanup_unused_procs(int epid)
   if(holding(&exit_proc->lock)){
     release(&exit_proc->lock);
   }
+  __sync_lock_release(&cleaning);
 }
 
 // Cleanup NMI queue and process state etc after recovery, in SYSCALL_FAIL, PROCESS_KILL.
@@ -363,8 +320,6 @@ cleanup_after_recovery(void)
 {
   struct proc *p = myproc();
 
-  handler_for_mem_fault = mlist_tracker;
-
   if(!holding(&p->lock))
     acquire(&p->lock);
 
@@ -373,9 +328,7 @@ cleanup_after_recovery(void)
   if(holding(&p->lock))
     release(&p->lock);
 
-  acquire(&nmi_queue_lock);
-  nmi_queue = 0x0;  // Avoid NULL unvalid reference & NMI mechanism goes wrong.
-  release(&nmi_queue_lock);
+  nmi_recovery_done();  // Let the NMIs conflicting with this recovery start.
 }
 
 struct cpu*
@@ -402,9 +355,12 @@ check_all_locks(int pid)
   struct sleeplock *sllk;
 
   // Check sleeplocks.
-  acquire(&mlist.giant_lock);
+  // The lists are traversed without locks, and a deleted node may still be passed.
+  __sync_fetch_and_add(&mlist.readers, 1);
   for(node = mlist.slp_list->next; node != mlist.slp_list; node = node->next){
     sllk = (struct sleeplock*)node->addr;
+    if(sllk == (void*)EMPTY)
+      continue;
     if(sllk->locked && sllk->pid == pid){
       releasesleep(sllk);
     }
@@ -414,7 +370,8 @@ check_all_locks(int pid)
   for(node = mlist.spn_list->next; node != mlist.spn_list; node = node->next){
     splk = (struct spinlock*)node->addr;
 
-    if(splk == &nmi_queue_lock || splk == &mlist.giant_lock || splk == &nmi_lock)
+    if(splk == (void*)EMPTY || splk == &nmi_lock
+    || (&mlist.lock[0] <= splk && splk < &mlist.lock[MLT_NTYPES]) || splk == &mlist.index.lock)
       continue;
 
     if(splk->locked && splk->cpu == c){
@@ -435,15 +392,27 @@ check_all_locks(int pid)
       release(splk);
     }
   }
-  release(&mlist.giant_lock);
+  __sync_fetch_and_sub(&mlist.readers, 1);
 }
 
+// Call stacks in which any memobj can't be recovered.
+static const struct af_rule fail_stop_rules[] = {
+  {FN_end_op,   AF_ANY, AF_ANY, AF_STOP, FAIL_STOP, FN_sys_chdir},
+  {FN_brelse,   AF_ANY, AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+  {FN_freeproc, AF_ANY, AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+  {FN_kvminit,  AF_ANY, AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+  {FN_procinit, AF_ANY, AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+  {FN_sys_open, AF_ANY, AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+  {FN_uvmunmap, AF_ANY, AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+};
+static struct af_table fail_stop_af = AF_TABLE(fail_stop_rules);
+
 static int
 scan_function_call_history(uint64 sp, uint64 s0, int pid)
 {
-  int is_chdir = 0, is_end_op = 0;
   struct proc *p;
   uint64 pcs[DEPTH];
+  int fids[DEPTH];
 
   if(s0 - sp > PGSIZE){
     p = search_proc_from_pid(pid);
@@ -451,32 +420,82 @@ scan_function_call_history(uint64 sp, uint64 s0, int pid)
   } else {
     getcallerpcs_top(pcs, sp, s0, DEPTH);
   }
+  pcs2funcids(pcs, fids, DEPTH);
 
   // Check Fail-Stop cases which Ev6 should do it even if in Aggressive mode.
-  for(int i = 0; i < DEPTH; i++){
-    if(ISINSIDE(pcs[i], end_op_start, end_op_end)){
-      is_end_op = 1;
-    }
-    else if(ISINSIDE(pcs[i], sys_chdir_start, sys_chdir_end)){
-      is_chdir = 1;
-    }
-
-    if(is_chdir && is_end_op){
-      return 0;
-    }
-    else if(ISINSIDE(pcs[i], brelse_start, brelse_end)
-         || ISINSIDE(pcs[i], freeproc_start, freeproc_end)
-         || ISINSIDE(pcs[i], kvminit_start, kvminit_end)
-         || ISINSIDE(pcs[i], procinit_start, procinit_end)
-         || ISINSIDE(pcs[i], sys_open_start, sys_open_end)
-         || ISINSIDE(pcs[i], uvmunmap_start, uvmunmap_end)){
-      return 0;
-    }
-  }
+  if(af_decide(&fail_stop_af, fids, pid, sp, s0, 0) == FAIL_STOP)
+    return 0;
 
   return 1;
 }
 
+// Classify the broken address and return the recovery domains which its recovery handler touches.
+// The broken memobj's range (or the cache line if it is unknown) is stored to [*start, *end).
+// This follows the order of the checks in mlist_tracker().
+uint
+recovery_domains(void *broken, uint64 *start, uint64 *end)
+{
+  uint64 hits[MLT_NTYPES], page = PGROUNDDOWN((uint64)broken);
+  struct page_desc *pd = pa2desc(broken);
+  uint domains;
+
+  mlist_lookup(broken, hits);
+
+#define RANGE(s, size) (*start = (uint64)(s), *end = (uint64)(s) + (size))
+  if(hits[MLT_KMM] != 0){
+    RANGE(hits[MLT_KMM], sizeof(struct kmem));
+    return RL_DOMAIN_ALL;
+  }
+  if(pd != 0x0 && PG_RUN(pd->state) && (uint64)broken < page + sizeof(struct run)){
+    RANGE(page, sizeof(struct run));
+    return RL_DOMAIN_ALL;
+  }
+  if(pd != 0x0 && pd->state == PG_PTB){
+    RANGE(page, PGSIZE);
+    return RL_DOMAIN_PROC;
+  }
+  if(hits[MLT_PR] != 0){
+    RANGE(hits[MLT_PR], sizeof(struct pr));
+    return RL_DOMAIN(RL_FLAG_PR) | RL_DOMAIN(RL_FLAG_CONS);
+  }
+  if(hits[MLT_BUF] != 0){
+    RANGE(hits[MLT_BUF], sizeof(struct buf));
+    return RL_DOMAIN(RL_FLAG_BUF) | RL_DOMAIN(RL_FLAG_BCACHE) | RL_DOMAIN(RL_FLAG_LOG);
+  }
+  if((void*)ftable <= broken && broken < (void*)((uint64)ftable + sizeof(struct ftable)) && hits[MLT_FIL] != 0){
+    RANGE(ftable, sizeof(struct ftable));  // The whole ftable is replaced.
+    return RL_DOMAIN(RL_FLAG_FTABLE) | RL_DOMAIN(RL_FLAG_FILE) | RL_DOMAIN(RL_FLAG_ICACHE) | RL_DOMAIN(RL_FLAG_INODE);
+  }
+  if((void*)icache <= broken && broken < (void*)((uint64)icache + sizeof(struct icache)) && hits[MLT_INO] != 0){
+    RANGE(icache, sizeof(struct icache));  // The whole icache is replaced.
+    return RL_DOMAIN(RL_FLAG_ICACHE) | RL_DOMAIN(RL_FLAG_INODE) | RL_DOMAIN(RL_FLAG_FTABLE) | RL_DOMAIN(RL_FLAG_FILE)
+         | RL_DOMAIN(RL_FLAG_BCACHE) | RL_DOMAIN(RL_FLAG_LOG);
+  }
+
+  domains = RL_DOMAIN_ALL;
+  if(hits[MLT_DEV] != 0){
+    RANGE(hits[MLT_DEV], sizeof(struct devsw));
+  } else if(hits[MLT_LOG] != 0){
+    RANGE(hits[MLT_LOG], sizeof(struct log));
+    domains = RL_DOMAIN(RL_FLAG_LOG) | RL_DOMAIN(RL_FLAG_BCACHE) | RL_DOMAIN(RL_FLAG_BUF);
+  } else if(hits[MLT_CON] != 0){
+    RANGE(hits[MLT_CON], sizeof(struct cons));
+    domains = RL_DOMAIN(RL_FLAG_CONS) | RL_DOMAIN(RL_FLAG_PR);
+  } else if(hits[MLT_PIP] != 0){
+    RANGE(hits[MLT_PIP], sizeof(struct pipe));
+    domains = RL_DOMAIN(RL_FLAG_PIPE) | RL_DOMAIN(RL_FLAG_FTABLE) | RL_DOMAIN(RL_FLAG_FILE);
+  } else if(hits[MLT_SPN] != 0){
+    RANGE(hits[MLT_SPN], sizeof(struct spinlock));
+    if(hits[MLT_SPN] == (uint64)tickslock || hits[MLT_SPN] == (uint64)pid_lock)
+      domains = RL_DOMAIN_PROC;
+  } else {
+    // Already recovered memobjs (these may fix up the log) and the others.
+    RANGE((uint64)broken & ~(uint64)(CACHELINE - 1), CACHELINE);
+  }
+#undef RANGE
+  return domains;
+}
+
 // A function to receive broken address and specify the memobj which it's data on the address,
 // then call moderate recovery handler.
 void
@@ -488,22 +507,31 @@ mlist_tracker(char *address)
   int idx, pid, irq = 0;
   int r_pid;  // First recovery proc's pid.
   struct proc *p;
-  uint64 sp, s0, baddr, pcs[DEPTH];
+  uint64 sp, s0, baddr, pcs[DEPTH], hits[MLT_NTYPES];
+  int fids[DEPTH];
+  struct page_desc *pd;
+  struct nmi_info *ni = mynmi();
   void* broken;
 
-next_nmi_continue:
-  broken = nmi_queue[0].addr;
-  pid    = nmi_queue[0].pid;
-  sp     = nmi_queue[0].sp;
-  s0     = nmi_queue[0].s0;
+  broken = ni->addr;
+  pid    = ni->pid;
+  sp     = ni->sp;
+  s0     = ni->s0;
   idx = 0;
 
-  handler_for_mem_fault = panic;  // In preparation for NMI on NMI.
   intr_off();  // Disable software interrupt(Supervisor).
 
+  // The broken memobj was recovered by the preceding NMI which this one is coalesced with.
+  if(ni->coalesced && search_recovered_addr(broken) != -1)
+    goto already_recovered;
+
+  // Specify all memobjs which include the broken address at once (without locks).
+  mlist_lookup(broken, hits);
+  pd = pa2desc(broken);  // Free pages (run) and pagetables are classified by the page descriptor.
+
   // At first, check memobjs related memory allocation(kmem, kpgdir, run, kmap).
   // struct kmem
-  baddr = search_mlist(broken, mlist.kmm_list, sizeof(struct kmem));
+  baddr = hits[MLT_KMM];
   if(baddr != 0){
     res = recovery_handler_kmem((void*)baddr, pid, sp, s0);
     switch(res){
@@ -523,8 +551,8 @@ next_nmi_continue:
   }
 
   // struct run
-  baddr = search_mlist(broken, mlist.run_list, sizeof(struct run));
-  if(baddr != 0){
+  baddr = PGROUNDDOWN((uint64)broken);
+  if(pd != 0x0 && PG_RUN(pd->state) && (uint64)broken < baddr + sizeof(struct run)){
     res = recovery_handler_run((void*)baddr, pid, sp, s0);
     switch(res){
       case SYSCALL_FAIL:
@@ -542,29 +570,20 @@ next_nmi_continue:
   }
 
   // Next, search large and complex memobj's M-List(pagetable, buf, inode, file).
-  uint64 b_ptb = search_ptb_mlist(broken);
-  if(b_ptb){
+  if(pd != 0x0 && pd->state == PG_PTB){
+    // One of pagetables is broken.
+    uint64 b_ptb = PGROUNDDOWN((uint64)broken);
     pagetable_t L2_pagetable = 0x0;
-    // If b_ptb != 0, one of pagetables is broken.
-    for(p = proc; p < &proc[NPROC]; p++){  // Identify a process which have broken pagetable.
-      if(p->pid == MLNODE2PID(b_ptb)){
-        //printf_without_pr("mlist_tracker: matched. p->pid = %d\n", p->pid);
-        L2_pagetable = p->pagetable;
-        break;
-      }
-    }
-    //if((uint64)kernel_pagetable == MLNODE2PA(b_ptb))
-    if(p->pid == 0 || L2_pagetable == 0x0){
+    p = search_proc_from_pid(pd->pid);  // Identify a process which have broken pagetable.
+    if(p != 0x0)
+      L2_pagetable = p->pagetable;
+    if(p == 0x0 || L2_pagetable == 0x0){
       goto fail_stop;  // Broken page table is included in kernel_pagetable and it can't recover.
     }
 
-    for(idx = 0; idx <= NPROC; idx++){  // Identify pagetable duplication index.
-      if(L2_pagetable == idx_ptdup[idx])
-        break;
-      else if(MLNODE2PA(b_ptb) == (uint64)idx_ptdup[idx])
-        break;
-    }
-    res = recovery_handler_pagetable(MLNODE2LEVEL(b_ptb), idx, p, (void*)MLNODE2PA(b_ptb), sp, s0);
+    if((idx = ptdup_idx(L2_pagetable)) < 0)  // Identify pagetable duplication index.
+      goto fail_stop;
+    res = recovery_handler_pagetable(pd->level, idx, p, (void*)b_ptb, sp, s0);
     switch(res){
       case SYSCALL_FAIL:
       case SYSCALL_SUCCESS:
@@ -584,7 +603,7 @@ next_nmi_continue:
   }
 
   // struct pr
-  baddr = search_mlist(broken, mlist.pr_list, sizeof(struct pr));
+  baddr = hits[MLT_PR];
   if(baddr != 0){
     // If baddr != 0, one of bcache.buf[] is broken.
     res = recovery_handler_pr((void*)pr, pid, sp, s0);
@@ -606,7 +625,7 @@ next_nmi_continue:
   }
 
   // struct buf
-  baddr = search_mlist(broken, mlist.buf_list, sizeof(struct buf));
+  baddr = hits[MLT_BUF];
   if(baddr != 0){
     // If baddr != 0, one of bcache.buf[] is broken.
     res = recovery_handler_buf((void*)baddr, pid, sp, s0);
@@ -632,7 +651,7 @@ next_nmi_continue:
 
   // ftable/file
   if((void*)ftable <= broken && broken < (void*)((uint64)ftable + sizeof(struct ftable))){
-    baddr = search_mlist(broken, mlist.fil_list, sizeof(struct file));
+    baddr = hits[MLT_FIL];
     if(baddr != 0){
       // If baddr != 0, one of ftable.file[] is broken.
       char* ftable_addr = (char*)ftable;
@@ -656,7 +675,7 @@ next_nmi_continue:
 
   // icache/inode
   if((void*)icache <= broken && broken < (void*)((uint64)icache + sizeof(struct icache))){
-    baddr = search_mlist(broken, mlist.ino_list, sizeof(struct inode));
+    baddr = hits[MLT_INO];
     if(baddr != 0){
       char* icache_addr = (char*)icache;
       // If baddr != 0, one of ftable.file[] is broken.
@@ -681,7 +700,7 @@ next_nmi_continue:
 
   // Finally check other memobj's address lists.
   // devsw
-  baddr = search_mlist(broken, mlist.dev_list, sizeof(struct devsw) * NDEV);
+  baddr = hits[MLT_DEV];
   if(baddr != 0){
     res = recovery_handler_devsw((void*)baddr, pid);
     switch(res){
@@ -701,7 +720,7 @@ next_nmi_continue:
   }
 
   // struct log / logheader
-  baddr = search_mlist(broken, mlist.log_list, sizeof(struct log));
+  baddr = hits[MLT_LOG];
   if(baddr != 0){
     res = recovery_handler_log((void*)baddr, pid, sp, s0);
     switch(res){
@@ -720,7 +739,7 @@ next_nmi_continue:
   }
 
   // cons
-  baddr = search_mlist(broken, mlist.con_list, sizeof(struct cons));
+  baddr = hits[MLT_CON];
   if(baddr != 0){
     res = recovery_handler_cons((void*)baddr, pid, sp, s0);
     switch(res){
@@ -742,7 +761,7 @@ next_nmi_continue:
   }
 
   // pipe
-  baddr = search_mlist(broken, mlist.pip_list, sizeof(struct pipe));
+  baddr = hits[MLT_PIP];
   if(baddr != 0){
     res = recovery_handler_pipe(broken, pid, sp, s0);
     switch(res){
@@ -761,7 +780,7 @@ next_nmi_continue:
   }
 
   // locks
-  baddr = search_mlist(broken, mlist.spn_list, sizeof(struct spinlock));
+  baddr = hits[MLT_SPN];
   if(baddr != 0x0){
     if(baddr == (uint64)tickslock){
       res = recovery_handler_tickslock((void*)baddr, pid, sp, s0);
@@ -788,6 +807,7 @@ next_nmi_continue:
   }
 
   // If reach here, we can't specify broken memobj or broken address is out of memobj's area.
+already_recovered:
   switch((res = search_recovered_addr(broken))){
     case PIPE:
       p = search_proc_from_pid(pid);
@@ -797,9 +817,10 @@ next_nmi_continue:
       } else {
         getcallerpcs_top(pcs, sp, s0, DEPTH);
       }
+      pcs2funcids(pcs, fids, DEPTH);
       res = SYSCALL_FAIL;
       for(int i = 0; i < DEPTH; i++){
-        if(exit_start < pcs[i] && pcs[i] < exit_end){
+        if(fids[i] == FN_exit){
           res = PROCESS_KILL;
           for (int j = 0; j < NOFILE; j++) {
             if (p->ofile[j] != 0x0 && p->ofile[j]->pipe == broken) {
@@ -824,7 +845,7 @@ next_nmi_continue:
   }
 
   // struct spinlock (out of other memobjs)
-  baddr = search_mlist(broken, mlist.spn_list, sizeof(struct spinlock));
+  baddr = hits[MLT_SPN];
   // If baddr != NULL, one of spinlock (maybe idelock) is broken.
   if(baddr != 0){
     message = "mlist_tracker: unrecoverable spinlock is broken";
@@ -837,10 +858,8 @@ recovery_success:  // Recovery is succeeded and finish by SYSCALL_FAIL or PROCES
   check_all_locks(pid);  // Is this needed?
 
 recovery_success_intr:  // Recovery is succeeded and finish by RETURN_TO_USER or RETURN_TO_KERNEL.
-  if(nmi_queue[0].pid == myproc()->pid){
-    terminate_status = res;  // Record the first NMI process will terminate by exit().
-    r_pid = pid;
-  }
+  terminate_status = res;  // Record the NMI process will terminate by exit().
+  r_pid = pid;
 
   // In the case of the hardware intr came from already recovered object's R.C.S.
   if(terminate_status == RETURN_TO_KERNEL && is_in_old_rcs(r_pid, pid)){
@@ -850,11 +869,6 @@ recovery_success_intr:  // Recovery is succeeded and finish by RETURN_TO_USER or
       goto fail_stop;
   }
 
-  if((broken = ret_and_search_nmiqueue(res, irq)) != 0x0){
-    printf_without_pr("mlist_tracker: other NMI (%p) is pending.\n", broken);
-    goto next_nmi_continue;
-  }
-
   cleanup_after_recovery();
 
   switch(terminate_status){
@@ -6,6 +6,8 @@ struct nmi_info{
   int pid;     // Process ID which noticed memory error.
   uint64 sp;   // Contents of $sp register of pid process.
   uint64 s0;   // Contents of $s0 register of pid process.
+  int cpu;     // CPU which noticed the memory error and recovers it.
+  int coalesced;  // The broken memobj is being recovered by a preceding NMI.
 };
 
 #define ISINSIDE(addr, start, end) ((start) <= (addr) && (addr) <= (end))
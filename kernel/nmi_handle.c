@@ -20,15 +20,261 @@ void nmi_imitate(char*);  // Original NMI imitator
 
 void (*mem_nmi_handle_next)(char*) = mem_nmi_handle_first;  // Next calling NMI handler because of memory error
 void (*handler_for_mem_fault)(char*) = mlist_tracker;  // Next calling function pointer
-struct nmi_info *nmi_queue = 0x0;  // NMI Queue's top
-struct spinlock nmi_queue_lock;  // Spinlock to protect NMI Queue
 struct spinlock nmi_lock;  // Spinlock to protect nmi handling function pointers
 
+#if (NMI_QUEUE_SIZE & (NMI_QUEUE_SIZE - 1)) != 0 || NMI_QUEUE_SIZE < NCPU
+#error "NMI_QUEUE_SIZE must be a power of 2 and not less than NCPU"
+#endif
+
+/* NMI Queue
+ * A multi-producer single-consumer ring. Harts which noticed memory errors enqueue without locks,
+ * and the scheduling hart (the one holding nmi_scheduling) dequeues them.
+ * A slot is free for the enqueuer at position pos if seq == pos, and filled if seq == pos+1.
+ * Every waiting hart has at most one entry, so the ring never gets full while NMI_QUEUE_SIZE >= NCPU.
+ */
+struct nmi_slot {
+  uint64 seq;
+  struct nmi_info info;
+} __attribute__((aligned(64)));
+
+struct {
+  uint64 head __attribute__((aligned(64)));  // Next position to dequeue (only the scheduling hart).
+  uint64 tail __attribute__((aligned(64)));  // Next position to enqueue.
+  struct nmi_slot slot[NMI_QUEUE_SIZE];
+} nmi_queue;
+
+/* Completion
+ * The scheduler posts it when the waiting hart may start its recovery, and the waiting hart
+ * (interrupts are off) polls done with bounded exponential backoff, so that it doesn't keep
+ * hitting the line the scheduler writes.
+ */
+struct completion {
+  int done;
+};
+
+#define BACKOFF_MAX 4096  // Max delay loops between polls of a completion.
+
+// NMI state of each hart.
+#define NMI_IDLE    0
+#define NMI_WAITING 1  // In the NMI Queue or deferred by a conflict of recovery domains.
+#define NMI_RUNNING 2  // Recovering its own NMI.
+
+struct nmi_cpu {
+  struct completion run;  // Posted when the recovery domains are reserved for this hart.
+  struct nmi_info info;   // NMI which this hart noticed.
+  uint domains;           // Recovery domains which the recovery touches.
+  uint64 start, end;      // Broken memobj (or cache line) classified for the NMI.
+  int state;
+} __attribute__((aligned(64)));
+
+/* Recovery Scheduler
+ * Each NMI is recovered on the hart which noticed it. Its recovery domains (see recovery_domains())
+ * are reserved in nmi_busy before the hart starts, so recoveries with disjoint domains run in parallel
+ * and conflicting ones are deferred in FIFO order until the running one finishes.
+ * An NMI on a memobj which a running or waiting NMI already covers is coalesced with it: it takes
+ * the same domains without being classified again, and finds the memobj in the recovered list.
+ */
+struct nmi_cpu nmi_cpus[NCPU];
+uint nmi_busy = 0;            // Recovery domains being recovered now.
+int nmi_scheduling = 0;       // 1 while a hart dequeues and dispatches NMIs.
+int nmi_deferred[NCPU];       // CPUs whose NMIs wait for conflicting recoveries (only the scheduling hart).
+int nmi_ndeferred = 0;
+
 extern struct proc proc[];
 extern int panicked;
 extern struct ftable *ftable;
 
 
+void nmi_queue_init(void){
+  nmi_queue.head = nmi_queue.tail = 0;
+  for(int i = 0; i < NMI_QUEUE_SIZE; i++)
+    nmi_queue.slot[i].seq = i;
+}
+
+
+// Enqueue an NMI. The caller spins while the ring is full.
+static void nmi_queue_push(struct nmi_info *ni){
+  struct nmi_slot *s;
+  uint64 pos = __atomic_load_n(&nmi_queue.tail, __ATOMIC_RELAXED), seq;
+
+  while(1){
+    s = &nmi_queue.slot[pos & (NMI_QUEUE_SIZE - 1)];
+    seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+    if(seq == pos && __atomic_compare_exchange_n(&nmi_queue.tail, &pos, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      break;
+    if(seq != pos)
+      pos = __atomic_load_n(&nmi_queue.tail, __ATOMIC_RELAXED);
+  }
+  s->info = *ni;
+  __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+
+// Dequeue an NMI to ni. Only the scheduling hart calls this.
+static int nmi_queue_pop(struct nmi_info *ni){
+  uint64 pos = nmi_queue.head;
+  struct nmi_slot *s = &nmi_queue.slot[pos & (NMI_QUEUE_SIZE - 1)];
+
+  if(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != pos + 1)
+    return 0;
+  *ni = s->info;
+  __atomic_store_n(&s->seq, pos + NMI_QUEUE_SIZE, __ATOMIC_RELEASE);
+  nmi_queue.head = pos + 1;
+  return 1;
+}
+
+
+static int nmi_queue_pending(void){
+  uint64 pos = __atomic_load_n(&nmi_queue.head, __ATOMIC_ACQUIRE);
+  return __atomic_load_n(&nmi_queue.slot[pos & (NMI_QUEUE_SIZE - 1)].seq, __ATOMIC_ACQUIRE) == pos + 1;
+}
+
+
+static void init_completion(struct completion *c){
+  c->done = 0;
+}
+
+
+static void complete(struct completion *c){
+  __atomic_store_n(&c->done, 1, __ATOMIC_RELEASE);
+}
+
+
+// Wait until c is completed. This is safe with interrupts off.
+static void wait_for_completion(struct completion *c){
+  int delay = 1;
+
+  while(!__atomic_load_n(&c->done, __ATOMIC_ACQUIRE)){
+    for(volatile int i = 0; i < delay; i++)
+      ;
+    if(delay < BACKOFF_MAX)
+      delay <<= 1;
+  }
+}
+
+
+// Reserve the domains and let the hart start its recovery.
+static void dispatch(int cpu, uint domains){
+  __sync_fetch_and_or(&nmi_busy, domains);
+  nmi_cpus[cpu].state = NMI_RUNNING;
+  complete(&nmi_cpus[cpu].run);
+}
+
+
+// Whether a deferred NMI can be dispatched now.
+static int deferred_runnable(void){
+  uint busy = __atomic_load_n(&nmi_busy, __ATOMIC_SEQ_CST), blocked = 0, m;
+
+  for(int i = 0; i < nmi_ndeferred; i++){
+    m = nmi_cpus[nmi_deferred[i]].domains;
+    if((m & (busy | blocked)) == 0)
+      return 1;
+    blocked |= m;
+  }
+  return 0;
+}
+
+
+// Find the running or waiting NMI whose classified memobj includes addr.
+static struct nmi_cpu* coalesce(char *addr){
+  struct nmi_cpu *c;
+
+  for(c = nmi_cpus; c < &nmi_cpus[NCPU]; c++){
+    if(c->state != NMI_IDLE && c->start <= (uint64)addr && (uint64)addr < c->end)
+      return c;
+  }
+  return 0x0;
+}
+
+
+/* Dispatch deferred and queued NMIs whose domains don't conflict with running recoveries
+ * or with earlier deferred ones. Whoever enqueues an NMI or finishes a recovery calls this after
+ * publishing it. The scheduling hart checks again after clearing nmi_scheduling, so no NMI is left
+ * without a scheduler.
+ */
+static void nmi_schedule(void){
+  struct nmi_info ni;
+  struct nmi_cpu *c, *leader;
+  uint busy, blocked, m;
+  int n, cpu;
+
+  while(__sync_bool_compare_and_swap(&nmi_scheduling, 0, 1)){
+    busy = __atomic_load_n(&nmi_busy, __ATOMIC_SEQ_CST);
+    blocked = 0;
+    for(int i = n = 0; i < nmi_ndeferred; i++){
+      cpu = nmi_deferred[i];
+      m = nmi_cpus[cpu].domains;
+      if((m & (busy | blocked)) == 0){
+        dispatch(cpu, m);
+        busy |= m;
+      } else {
+        blocked |= m;
+        nmi_deferred[n++] = cpu;
+      }
+    }
+    nmi_ndeferred = n;
+
+    while(nmi_queue_pop(&ni)){
+      c = &nmi_cpus[ni.cpu];
+      if((leader = coalesce(ni.addr)) != 0x0){
+        c->domains = leader->domains;
+        c->start = leader->start;
+        c->end = leader->end;
+        c->info.coalesced = 1;
+      } else {
+        c->domains = recovery_domains(ni.addr, &c->start, &c->end);
+      }
+      m = c->domains;
+      if((m & (busy | blocked)) == 0){
+        dispatch(ni.cpu, m);
+        busy |= m;
+      } else {
+        blocked |= m;
+        nmi_deferred[nmi_ndeferred++] = ni.cpu;
+      }
+    }
+
+    __atomic_store_n(&nmi_scheduling, 0, __ATOMIC_SEQ_CST);
+    __sync_synchronize();
+    if(!nmi_queue_pending() && !deferred_runnable())
+      return;
+  }
+}
+
+
+// NMI which this hart recovers.
+struct nmi_info*
+mynmi(void)
+{
+  return &nmi_cpus[cpuid()].info;
+}
+
+
+// Release the recovery domains of this hart and dispatch the NMIs waiting for them.
+void nmi_recovery_done(void){
+  struct nmi_cpu *c = &nmi_cpus[cpuid()];
+
+  c->info.addr = 0x0;
+  c->start = c->end = 0;
+  c->state = NMI_IDLE;
+  __sync_fetch_and_and(&nmi_busy, ~c->domains);
+  __sync_synchronize();
+  nmi_schedule();
+}
+
+
+// Store pids of the running and waiting NMIs of all harts to pids, and return the number of them.
+int nmi_queue_pids(int *pids){
+  int n = 0;
+
+  for(int i = 0; i < NCPU; i++){
+    if(__atomic_load_n(&nmi_cpus[i].state, __ATOMIC_ACQUIRE) != NMI_IDLE)
+      pids[n++] = nmi_cpus[i].info.pid;
+  }
+  return n;
+}
+
+
 /* Shadow NMI handler
  * When NMI occurs, this function is called at first,
  * setting function pointer to panic(), and start searching M-List.
@@ -50,7 +296,7 @@ int nmi_handle(char *argument){
 
     if(!holding(&p->lock))
       acquire(&p->lock);
-    if(p->state == RECOVERING || nmi_queue != 0x0){
+    if(p->state == RECOVERING || nmi_busy != 0){
       acquire(&nmi_lock);     
       if(__sync_lock_test_and_set(&mem_nmi_handle_next, mem_nmi_handle_follow));
       mem_nmi_handle_next = mem_nmi_handle_follow;
@@ -74,128 +320,66 @@ int nmi_handle(char *argument){
 }
 
 
-// NMI handler because of memory error (at the first time)
-void mem_nmi_handle_first(char *broken_addr){
-  acquire(&nmi_lock);
-  mem_nmi_handle_next = panic;
-  release(&nmi_lock);
-
-  char *argument = broken_addr;
-  struct nmi_info queue[NMI_QUEUE_SIZE];  // Get local area in kstack for NMI Queue.
+// Enqueue the broken address with the registers of the NMI process, and schedule it.
+static void enqueue_nmi(char *broken_addr, uint64 sp, uint64 s0){
+  struct nmi_cpu *c = &nmi_cpus[cpuid()];
   struct proc *p = myproc();
 
-  acquire(&nmi_queue_lock);
-  if(nmi_queue != 0x0){  // In the case of multiple process enter this function.
-    release(&nmi_queue_lock);
-    mem_nmi_handle_follow(broken_addr);
-  }
-
-  for(int i = 0; i < NMI_QUEUE_SIZE; i++){
-    queue[i].addr = (char*)0x0;
-    queue[i].pid  = 0;
-    queue[i].sp   = 0;
-    queue[i].s0   = 0;
-  }
+  if(c->state != NMI_IDLE)
+    panic_without_pr("Fail-Stop: NMI on NMI, this hart is already waiting for or running a recovery.");
 
-  nmi_queue = queue;
-  nmi_queue[0].addr = broken_addr;
-  nmi_queue[0].pid  = p->pid;
-  nmi_queue[0].sp   = r_sp();
-  nmi_queue[0].s0   = r_s0();
-  release(&nmi_queue_lock);
+  c->info.addr = broken_addr;
+  c->info.pid  = p->pid;
+  c->info.sp   = sp;
+  c->info.s0   = s0;
+  c->info.cpu  = cpuid();
+  c->info.coalesced = 0;
+  c->start = c->end = 0;
+  init_completion(&c->run);
+  c->state = NMI_WAITING;
 
   acquire(&p->lock);
   p->state = RECOVERING;
   release(&p->lock);
+
+  nmi_queue_push(&c->info);
+  __sync_synchronize();  // Publish the entry before checking nmi_scheduling.
+  nmi_schedule();
+}
+
+
+// Wait until the recovery domains are reserved for this hart's NMI, and recover it.
+static void wait_and_recover(void){
+  struct nmi_cpu *c = &nmi_cpus[cpuid()];
+
+  wait_for_completion(&c->run);
+  (*handler_for_mem_fault)(c->info.addr);
+}
+
+
+// NMI handler because of memory error (at the first time)
+void mem_nmi_handle_first(char *broken_addr){
+  acquire(&nmi_lock);
+  mem_nmi_handle_next = panic;
+  release(&nmi_lock);
+
+  enqueue_nmi(broken_addr, r_sp(), r_s0());
+
   acquire(&nmi_lock);
   mem_nmi_handle_next = mem_nmi_handle_first;
   release(&nmi_lock);
 
-  if(handler_for_mem_fault == panic)
-    argument = "Fail-Stop: Multiple processes try to enter recovery handlers in parallel.";
-  (*handler_for_mem_fault)(argument);
+  wait_and_recover();
   return;
 }
 
 
 // NMI handler because of memory error (follow the second time)
 void mem_nmi_handle_follow(char *broken_addr){
-  int i, prev_state, irq = 0, term_status = 0;
-  struct proc *p = myproc();
-  uint64 m_sp = 0x0, m_s0 = 0x0;
-
-  // Store broken address to NMI Queue in NMI process's kstack.
-  acquire(&nmi_queue_lock);
-  if(nmi_queue == 0x0){  // In the case of first NMI process is about to finish recovery.
-    release(&nmi_queue_lock);
-    mem_nmi_handle_first(broken_addr);
-  }
-
-  for(i = 1; i < NMI_QUEUE_SIZE; i++){
-    if(nmi_queue[i].addr == 0x0){
-      nmi_queue[i].addr = broken_addr;
-      nmi_queue[i].pid  = p->pid;
-      nmi_queue[i].sp   = m_sp = r_sp();
-      nmi_queue[i].s0   = m_s0 = r_s0();
-      break;
-    }
-  }
-
-  if(i == NMI_QUEUE_SIZE && nmi_queue[i-1].addr != broken_addr)
-    panic_without_pr("Fail-Stop: Too many NMIs occuer");
-  release(&nmi_queue_lock);
-
-  acquire(&p->lock);
-  prev_state = p->state;
-  p->state = RECOVERING;
-  release(&p->lock);
-
-  // Then, this process waits NMI process to finish recovery by polling and receive recovery handler's termination status.
-  while(1){
-    acquire(&nmi_queue_lock);
-    if(nmi_queue == 0x0)
-      mem_nmi_handle_first(broken_addr);
-    // Recovery result is put in sp.
-    if(nmi_queue[0].pid == p->pid && SYSCALL_SUCCESS <= nmi_queue[0].sp && nmi_queue[0].sp <= RETURN_TO_KERNEL){
-      term_status = nmi_queue[0].sp;
-      irq = nmi_queue[0].s0;
-      release(&nmi_queue_lock);
-      break;
-    }
-    release(&nmi_queue_lock);
-  }
-  
-  acquire(&nmi_queue_lock);
-  nmi_queue[0].addr = (char*)0x0;
-  nmi_queue[0].pid  = 0;
-  nmi_queue[0].sp   = 0x0;
-  nmi_queue[0].s0   = 0x0;
-  release(&nmi_queue_lock);
-  while(mycpu()->noff > 0)
-    pop_off();
-
-  switch(term_status){
-    case SYSCALL_SUCCESS:
-    case SYSCALL_FAIL:
-    case SYSCALL_REDO:
-    case REOPEN_SYSCALL_FAIL:
-    case REOPEN_SYSCALL_REDO:
-      p->state = prev_state;
-      af_return_syscall_result(term_status);
-
-    case PROCESS_KILL:
-      cleanup_unused_procs(p->pid);
-      af_process_kill();
-
-    case RETURN_TO_USER:
-      af_return_to_user(p->pid, irq);
-
-    case RETURN_TO_KERNEL:
-      af_return_to_kernel(m_sp, m_s0, irq);
-
-    default:
-      panic("Fail-Stop: Invalid recovery result is passed");
-  }
+  // Store broken address to NMI Queue, then this process waits the preceding recoveries
+  // which conflict with it to finish.
+  enqueue_nmi(broken_addr, r_sp(), r_s0());
+  wait_and_recover();
   return;
 }
 
@@ -1,4 +1,4 @@
-#define NPROC        64  // maximum number of processes
+#define NPROC       256  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
@@ -12,5 +12,5 @@
 #define FSSIZE       1500  // size of file system in blocks (modified 1000 -> 1500)
 #define MAXPATH      128   // maximum file path name
 
-#define NMI_QUEUE_SIZE 5  // size of NMI Queue
+#define NMI_QUEUE_SIZE 16  // size of NMI Queue (power of 2, >= NCPU)
 
@@ -24,6 +24,7 @@ pipealloc(struct file **f0, struct file **f1)
     goto bad;
   if((pi = (struct pipe*)kalloc()) == 0)
     goto bad;
+  set_page_state(pi, PG_PIPE);
 
   register_memobj((void*)pi, mlist.pip_list);
   register_memobj((void*)&pi->lock, mlist.spn_list);
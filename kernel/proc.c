@@ -20,6 +20,13 @@ int nextpid = 1;
 struct spinlock _pid_lock;
 struct spinlock *pid_lock = &_pid_lock;
 
+// Live procs chained by pid and unused procs, both protected by pid_lock,
+// so that allocproc() and search_proc_from_pid() don't scan proc[].
+#define NPIDHASH NPROC
+#define PIDHASH(pid) ((pid) % NPIDHASH)
+struct proc *pidhash[NPIDHASH];
+struct proc *freeprocs;
+
 extern void forkret(void);
 void wakeup1(struct proc *chan);
 
@@ -45,6 +52,10 @@ procinit(void)
     kvmmap(va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
     p->kstack = va;
   }
+  for(p = &proc[NPROC-1]; p >= proc; p--){  // proc[0] is allocated first.
+    p->freenext = freeprocs;
+    freeprocs = p;
+  }
   kvminithart();
 }
 
@@ -89,7 +100,55 @@ allocpid() {
   return pid;
 }
 
-// Look in the process table for an UNUSED proc.
+// Add p to its pid hash chain.
+// p->pidnext is set before p is published, for the lock-free readers.
+static void
+pidhash_add(struct proc *p)
+{
+  acquire(pid_lock);
+  p->pidnext = pidhash[PIDHASH(p->pid)];
+  __sync_synchronize();
+  pidhash[PIDHASH(p->pid)] = p;
+  release(pid_lock);
+}
+
+// Remove p from its pid hash chain and return it to freeprocs.
+// p->pidnext is left as it is, so that a reader standing on p can go on.
+static void
+pidhash_del(struct proc *p)
+{
+  struct proc **pp;
+
+  acquire(pid_lock);
+  for(pp = &pidhash[PIDHASH(p->pid)]; *pp != 0; pp = &(*pp)->pidnext){
+    if(*pp == p){
+      *pp = p->pidnext;
+      break;
+    }
+  }
+  p->freenext = freeprocs;
+  freeprocs = p;
+  release(pid_lock);
+}
+
+// Find a struct proc from given pid.
+// The recovery side calls this on any hart, possibly one interrupted
+// while holding pid_lock, so the chain is walked without the lock.
+struct proc*
+search_proc_from_pid(int target_pid)
+{
+  struct proc *p;
+
+  if(target_pid <= 0)
+    return 0x0;
+  for(p = pidhash[PIDHASH(target_pid)]; p != 0; p = p->pidnext){
+    if(p->pid == target_pid)
+      return p;
+  }
+  return 0x0;
+}
+
+// Take an UNUSED proc from freeprocs.
 // If found, initialize state required to run in the kernel,
 // and return with p->lock held.
 // If there are no free procs, return 0.
@@ -98,21 +157,22 @@ struct proc*
 allocproc(void)
 {
   struct proc *p;
- 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == UNUSED) {
-      goto found;
-    } else {
-      release(&p->lock);
-    }
-  }
-  return 0;
 
-found:
+  acquire(pid_lock);
+  if((p = freeprocs) != 0)
+    freeprocs = p->freenext;
+  release(pid_lock);
+  if(p == 0)
+    return 0;
+
+  acquire(&p->lock);
+  if(p->state != UNUSED)
+    panic("allocproc: used proc in freeprocs");
   p->pid = allocpid();
+  pidhash_add(p);
   // Allocate a trapframe page.
   if((p->tf = (struct trapframe *)kalloc()) == 0){
+    freeproc(p);
     release(&p->lock);
     return 0;
   }
@@ -127,7 +187,9 @@ found:
   p->context.ra = (uint64)forkret;
   p->context.sp = p->kstack + PGSIZE;
 
-  init_rcs_infos(p->pid);  // Initialize Recovery Critical Section history.
+  init_rcs_infos(p);  // Initialize Recovery Critical Section history.
+  register_trans_info(p);
+  p->user_coop = 0;
   return p;
 }
 
@@ -141,13 +203,15 @@ freeproc(struct proc *p)
   if(p->tf)
     kfree((void*)p->tf);
   p->tf = 0;
-  if(p->pagetable){
-    proc_freepagetable(p->pagetable, p->sz);
-    delete_ptb_mlist_all(p->pid);  // Delete all pagetable's M-List
-  }
+  if(p->pagetable)
+    proc_freepagetable(p->pagetable, p->sz);  // freewalk() deletes all pagetables from the M-List.
+
+  delete_trans_info(p);
+  free_rcs_history(p);   // Free the R.C.S history.
+  p->user_coop = 0;
 
-  delete_trans_info(p->pid);
-  free_rcs_history(p->pid);   // Free the R.C.S history.
+  if(p->pid != 0)  // Only allocated procs are in pidhash[], the others are in freeprocs.
+    pidhash_del(p);
 
   p->pagetable = 0;
   p->sz = 0;
@@ -224,7 +288,6 @@ userinit(void)
 
   p = allocproc();
   initproc = p;
-  register_trans_info(1);  // For initproc.
   
   // allocate one user page and copy init's instructions
   // and data into it.
@@ -246,17 +309,19 @@ userinit(void)
 }
 
 // Grow or shrink user memory by n bytes.
+// Growing memory is mapped lazily (see uvmlazy()),
+// but no more than the free pages can be reserved at once.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
-  uint sz;
+  uint64 sz;
   struct proc *p = myproc();
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    if(sz + n >= TRAPFRAME || (PGROUNDUP(sz + n) - PGROUNDUP(sz)) / PGSIZE > kfreepages())
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
@@ -314,7 +379,6 @@ fork(void)
   pid = np->pid;
 
   np->state = RUNNABLE;
-  register_trans_info(pid);
   release(&np->lock);
 
   return pid;
@@ -635,20 +699,20 @@ kill(int pid)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++){
-    acquire(&p->lock);
-    if(p->pid == pid){
-      p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
-      return 0;
-    }
+  if((p = search_proc_from_pid(pid)) == 0)
+    return -1;
+  acquire(&p->lock);
+  if(p->pid != pid){  // p has been freed since the lookup.
     release(&p->lock);
+    return -1;
+  }
+  p->killed = 1;
+  if(p->state == SLEEPING){
+    // Wake process from sleep().
+    p->state = RUNNABLE;
   }
-  return -1;
+  release(&p->lock);
+  return 0;
 }
 
 // Copy to either a user address, or kernel address,
@@ -82,6 +82,20 @@ struct trapframe {
 
 enum procstate { UNUSED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE, RECOVERING };
 
+// Ev6: Recovery Critical Section nesting history of a process (recovery_locking.c).
+#define RCS_INFO_HISTORY_SIZE 5
+struct proc_rcs_info{
+  int history_idx[RCS_INFO_HISTORY_SIZE];  // R.C.S nesting history recording RL_FLAG.
+};
+
+// Ev6: the flags for judging in/out of transaction codes (trans.c).
+struct trans_info{
+  int pagetable_ntrans;  // Depth of transaction nesting.
+  int log_ntrans;
+  int run_ntrans;
+  struct run *log_run;  // Logging run pointer.
+};
+
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -94,6 +108,10 @@ struct proc {
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
 
+  // pid_lock must be held when updating these:
+  struct proc *pidnext;        // Next proc in the same pidhash[] chain
+  struct proc *freenext;       // Next proc in freeprocs
+
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Bottom of kernel stack for this process
   uint64 sz;                   // Size of process memory (bytes)
@@ -103,4 +121,9 @@ struct proc {
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+
+  // Ev6 per-process states. The recovery side finds them by search_proc_from_pid().
+  struct proc_rcs_info rcs;    // R.C.S nesting history
+  struct trans_info trans;     // Transaction nesting
+  int user_coop;               // User Cooperation status (1: Enable, 0: Disable)
 };
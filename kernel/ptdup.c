@@ -6,114 +6,104 @@
 #include "riscv.h"
 #include "proc.h"
 #include "defs.h"
+#include "mlist.h"
 #include "ptdup.h"
 
-#define PTDUP_SIZE NPROC+2  // NPROC + extra space
-                            // The extra space is in the case of run recovery when kfree() in exec().
-                            // The case, it is difficult to identify and delete only the old pagetable in exec() in current implementation.
-                            // There may be some sophisticated way, but currently handle the case by this way.
-
 struct ptdup_head ptdup_head[PTDUP_SIZE];  // headers to manage duplications of all pagetables.
 pagetable_t idx_ptdup[PTDUP_SIZE];  // Correspondence L2_pagetable to index of ptdup_head.
                                     // Array's contents is L2_pagetable address of ptdup_head[index] manages.
-struct spinlock idx_lock;  // spinlock for idx_ptdup.
+struct spinlock idx_lock;  // spinlock for allocating and freeing idx_ptdup entries.
+static int idx_freed[PTDUP_SIZE];  // Stack of the indexes freed by ptdup_delete_all().
+static int nidx_freed;
+static int idx_next;  // Indexes from idx_next have never been used.
+
+static uint64* list_alloc(void);
+static void list_free(uint64*);
+
+
+// Index of ptdup_head for L2_pagetable, or -1 if it has no PTDUP.
+// ptdup_init() records the index in the L2 page's descriptor, so neither
+// idx_ptdup[] is scanned nor idx_lock is taken on page table updates.
+int ptdup_idx(pagetable_t L2_pagetable){
+  struct page_desc *pd = pa2desc(L2_pagetable);
+
+  if(pd == 0x0 || PTDUP_SIZE <= pd->ptdup || idx_ptdup[pd->ptdup] != L2_pagetable)
+    return -1;
+  return pd->ptdup;
+}
 
 
 // Create new user's pagetable duplications and initialize them.
 // When this ptdup_init() is called, L2 pagetable must not hold any page directory.
 void ptdup_init(pagetable_t L2_pagetable){
-  int i, idx = -1;
-  uint64 *ptds_page, *indv_page; 
+  int idx = -1;
 
+  // Reuse a freed index first, then take a never-used one.
   acquire(&idx_lock);
-  for(i = 0; i < PTDUP_SIZE; i++){
-    if(idx_ptdup[i] == 0){
-      idx = i;
-      idx_ptdup[i] = L2_pagetable;
-      break;
-    }  
-  }
+  if(nidx_freed > 0)
+    idx = idx_freed[--nidx_freed];
+  else if(idx_next < PTDUP_SIZE)
+    idx = idx_next++;
+  if(idx >= 0)
+    idx_ptdup[idx] = L2_pagetable;
   release(&idx_lock);
 
   if(idx < 0)
     panic("ptdup_init: No empty index for new process");
   if(L2_pagetable == 0x0)
     panic("ptdup_init: NULL pagetable");
+  pa2desc(L2_pagetable)->ptdup = idx;
 
   initlock(&ptdup_head[idx].lock, "ptdup_lock");
   acquire(&ptdup_head[idx].lock);
 
+#ifndef PTDUP_EXTENT
   // Allocate new entry to ptdup_headers, it must correspond to L2_pagetable.
   ptdup_head[idx].l2 = (pagetable_t)kalloc();
   ptdup_head[idx].l2 = memset(ptdup_head[idx].l2, 0, PGSIZE);  
   ptdup_head[idx].l1 = (pagetable_t*)kalloc();
   ptdup_head[idx].l1 = memset(ptdup_head[idx].l1, 0, PGSIZE); 
+#endif
   
-  ptds_page = ptdup_head[idx].l0_ptds = (pagetable_t)kalloc();
-  indv_page = ptdup_head[idx].l0_pted = (pagetable_t)kalloc(); 
-
-  // Get ready for L0_pagetables pagetable data segment and other pages.
-  // Set pointer to header to each page's last entries.
-  ptds_page[ENTRY_SIZE-1] = (uint64)ptdup_head[idx].l0_ptds;
-  indv_page[ENTRY_SIZE-1] = (uint64)ptdup_head[idx].l0_pted;
+  // Get ready for the PTDS and PTED lists of L0_pagetables.
+  ptdup_head[idx].l0_ptds = list_alloc();
+  ptdup_head[idx].l0_pted = list_alloc();
   release(&ptdup_head[idx].lock);
 
   return;
 }
 
 
-// Create a new pagetable duplication for L1.
+// Create a new pagetable duplication for the L1 pagetable at index in L2_pagetable.
 // L2_pagetable duplication need not be updated before calling this function.
-void ptdup_create_l1(pagetable_t L2_pagetable, pagetable_t L1_pagetable, uint64 pde_content){
-  int i, idx = -1;
-
-  acquire(&idx_lock);
-  for(i = 0; i < PTDUP_SIZE; i++){
-    if(idx_ptdup[i] == L2_pagetable){
-      idx = i;
-      break; 
-    }
-  }
-  release(&idx_lock);
+void ptdup_create_l1(pagetable_t L2_pagetable, int index, uint64 pde_content){
+  int idx, is_locked = 1;
 
+  idx = ptdup_idx(L2_pagetable);
   if(idx < 0)
     panic("ptdup_create_l1: No index corresponting pagetable");
-  else if(L1_pagetable == 0x0)
-    panic("ptdup_create_l1: NULL pagetable");
-
-  // Calc L1_pagetable's index in L2_pagetable.
-  for(i = 0; i < ENTRY_SIZE; i++){
-    if((uint64)L1_pagetable == PTE2PA(L2_pagetable[i])){
-      acquire(&ptdup_head[idx].lock);
-      ptdup_head[idx].l1[i] = (pagetable_t)kalloc();
-      if(ptdup_head[idx].l1[i] == 0)
-        panic("ptdup_create_l1: kalloc failed");
-      
-      ptdup_head[idx].l1[i] = memset(ptdup_head[idx].l1[i], 0, PGSIZE);
-      ptdup_head[idx].l2[i] = pde_content;
-      release(&ptdup_head[idx].lock);
-      break;
-    }
+  if(!holding(&ptdup_head[idx].lock)){
+    acquire(&ptdup_head[idx].lock);
+    is_locked = 0;
   }
+
+  ptdup_head[idx].l1[index] = (pagetable_t)kalloc();
+  if(ptdup_head[idx].l1[index] == 0)
+    panic("ptdup_create_l1: kalloc failed");
+  ptdup_head[idx].l1[index] = memset(ptdup_head[idx].l1[index], 0, PGSIZE);
+  ptdup_head[idx].l2[index] = pde_content;
+
+  if(!is_locked)
+    release(&ptdup_head[idx].lock);
   return;
 }
 
 
 // Delete all of old pagetable duplications.
 void ptdup_delete_all(pagetable_t L2_pagetable, pagetable_t pagetable){
-  int i, idx = -1;
-  pagetable_t target = 0x0;
-  uint64 *next;
- 
-  acquire(&idx_lock);
-  for(i = 0; i < PTDUP_SIZE; i++){
-    if(idx_ptdup[i] == L2_pagetable){
-      idx = i;
-      break;
-    }
-  }
-  release(&idx_lock);
+  int i, idx;
 
+  idx = ptdup_idx(L2_pagetable);
   if(idx < 0){
     printf("ptdup_delete_all: No corresponding PTDUP.");
     return;
@@ -137,32 +127,16 @@ void ptdup_delete_all(pagetable_t L2_pagetable, pagetable_t pagetable){
   ptdup_head[idx].l2 = 0x0;
   ptdup_head[idx].l1 = 0x0;
 
-  // Delete all PTDS pages.
-  target = ptdup_head[idx].l0_ptds;
-  if(target != 0x0){
-    next = (uint64*)target[ENTRY_SIZE-1];
-    do {
-      kfree(target);
-      target = next;
-      next = (uint64*)target[ENTRY_SIZE-1];
-    } while(target != ptdup_head[idx].l0_ptds);
-  }
+  // Delete all PTDS and PTED pages.
+  if(ptdup_head[idx].l0_ptds != 0x0)
+    list_free(ptdup_head[idx].l0_ptds);
   ptdup_head[idx].l0_ptds = 0x0;
-
-  // Delete all individual pte pages.
-  target = ptdup_head[idx].l0_pted;
-  if(target != 0x0){
-    next = (uint64*)target[ENTRY_SIZE-1];
-    do {
-      kfree(target);
-      target = next;
-      next = (uint64*)target[ENTRY_SIZE-1];
-    } while(target != ptdup_head[idx].l0_pted);
-  }
-
+  if(ptdup_head[idx].l0_pted != 0x0)
+    list_free(ptdup_head[idx].l0_pted);
   ptdup_head[idx].l0_pted = 0x0;
   acquire(&idx_lock);
   idx_ptdup[idx] = 0;
+  idx_freed[nidx_freed++] = idx;
   release(&idx_lock);
   release(&ptdup_head[idx].lock);
 
@@ -171,84 +145,202 @@ void ptdup_delete_all(pagetable_t L2_pagetable, pagetable_t pagetable){
 
 
 // Update existing L1 pagetable duplication's single entry.
+// The L1 pagetable is at l2_index in L2_pagetable, and the entry is at index in it.
 // L2 pagetable entry updating is written in create() and delete().
-void ptdup_update(pagetable_t L2_pagetable, pagetable_t L1_pagetable, uint64 pde_content, int index){
-  int i, idx = -1;
-  pagetable_t target = 0x0;
-
-  acquire(&idx_lock);
-  for(i = 0; i < PTDUP_SIZE; i++){
-    if(idx_ptdup[i] == L2_pagetable){
-      idx = i;
-      break;
-    }
-  }
-  release(&idx_lock);
+void ptdup_update(pagetable_t L2_pagetable, int l2_index, uint64 pde_content, int index){
+  int idx, is_locked = 1;
+  pagetable_t target;
 
+  idx = ptdup_idx(L2_pagetable);
   if(idx < 0){
     panic("ptdup_update: No index corresponding L2_pagetable");
   }
 
-  if(L1_pagetable == 0x0)
-    panic("ptdup_update: NULL pagetable");
-  
-  // Search corresponding L1 duplication address.
-  for(i = 0; i < ENTRY_SIZE; i++){
-    if((uint64)L1_pagetable == PTE2PA(ptdup_head[idx].l2[i])){
-      target = ptdup_head[idx].l1[i];
-      break;
-    }
-  }
+  target = ptdup_head[idx].l1[l2_index];
   if(target == 0x0)
     panic("ptdup_update: No pagetable in PTDUP");
 
-  acquire(&ptdup_head[idx].lock);
+  if(!holding(&ptdup_head[idx].lock)){
+    acquire(&ptdup_head[idx].lock);
+    is_locked = 0;
+  }
   target[index] = pde_content;
-  release(&ptdup_head[idx].lock);
+  if(!is_locked)
+    release(&ptdup_head[idx].lock);
   return;
 }
 
 
-// Add a new PTDS/PTED entry.
-static void PTDS_PTED_add(int idx, uint64* header, uint64 content, int is_locked){
-  for(uint64 *p = header; ; p = (uint64*)p[ENTRY_SIZE-1]){
-    for(int i = 0; i < ENTRY_SIZE; i++){
-      if(p[i] == 0x0 || p[i] == 0x0505050505050505){
-        p[i] = content;
-        if(!is_locked)
-          release(&ptdup_head[idx].lock);
-        return;
-      }
-      if(p[i] == (uint64)header){
-        uint64* next = (uint64*)kalloc();
-        if(next == 0x0)
-          panic("PTDS_PTED_add: kalloc failed");
-        next[i] = (uint64)header;
-        p[i] = (uint64)next;
-        p[0] = content;
-        if(!is_locked)
-          release(&ptdup_head[idx].lock);
-        return;
-      }
-    }
+/*
+ * PTDS/PTED lists
+ */
+#define ENT2VA(entry) PTDS2VA(entry)  // PTDS and PTED hold the VA in the same bits.
+
+// Allocate an empty page of a PTDS/PTED list.
+static uint64* list_alloc(void){
+  uint64 *pg = (uint64*)kalloc();
+
+  if(pg == 0x0)
+    panic("list_alloc: kalloc failed");
+  return memset(pg, 0, PGSIZE);
+}
+
+// Free a PTDS/PTED list.
+static void list_free(uint64 *dir){
+  for(int pi = 0; pi < (int)PTDUP_NUM(dir); pi++)
+    kfree((void*)dir[pi]);
+  kfree(dir);
+}
+
+// Find the first entry whose VA is va or higher, as the index of its page in the directory (*pi)
+// and its slot (*si). If there is no such entry, the position is the end of the last page.
+static void list_search(uint64 *dir, uint64 va, int *pi, int *si){
+  int lo = 0, hi = (int)PTDUP_NUM(dir) - 1, mid;
+  uint64 *pg;
+
+  *pi = *si = 0;
+  if(hi < 0)
+    return;
+  while(lo < hi){  // The first page whose last entry is va or higher.
+    mid = (lo + hi) / 2;
+    pg = (uint64*)dir[mid];
+    if(ENT2VA(pg[PTDUP_NUM(pg)-1]) < va)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  *pi = lo;
+  pg = (uint64*)dir[lo];
+  for(lo = 0, hi = (int)PTDUP_NUM(pg); lo < hi; ){
+    mid = (lo + hi) / 2;
+    if(ENT2VA(pg[mid]) < va)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
+  *si = lo;
 }
 
+// The entry at (pi, si), or 0x0 at the end of the list.
+static uint64* list_at(uint64 *dir, int pi, int si){
+  uint64 *pg;
+
+  if(pi >= (int)PTDUP_NUM(dir))
+    return 0x0;
+  pg = (uint64*)dir[pi];
+  if(si < (int)PTDUP_NUM(pg))
+    return &pg[si];
+  if(pi + 1 < (int)PTDUP_NUM(dir))
+    return &((uint64*)dir[pi+1])[0];
+  return 0x0;
+}
 
-// Duplicate L0_pagetable's PTDS or PTED.
-void L0_ptes_add(pagetable_t L2_pagetable, uint64 content, int flag){
-  int i, idx = -1, is_locked = 1;
-  uint64 *header;
+// The entry before (pi, si), or 0x0 at the beginning of the list.
+static uint64* list_prev(uint64 *dir, int pi, int si){
+  uint64 *pg;
 
-  acquire(&idx_lock);
-  for(i = 0; i < PTDUP_SIZE; i++){
-    if(idx_ptdup[i] == L2_pagetable){
-      idx = i;
-      break;
+  if(si > 0)
+    return &((uint64*)dir[pi])[si-1];
+  if(pi > 0){
+    pg = (uint64*)dir[pi-1];
+    return &pg[PTDUP_NUM(pg)-1];
+  }
+  return 0x0;
+}
+
+// Insert content keeping the entries sorted by VA.
+// Mappings are usually added in VA order (growing heaps, fork() and exec()),
+// so the position next to the last inserted entry is tried before searching.
+static void list_insert(uint64 *dir, uint64 content){
+  uint64 va = ENT2VA(content), *pg, *new, *prev, *next;
+  int np = (int)PTDUP_NUM(dir), pi, si, n, split;
+
+  if(np == 0){
+    dir[0] = (uint64)list_alloc();
+    PTDUP_NUM(dir) = np = 1;
+    PTDUP_CURSOR(dir) = 0;
+  }
+
+  pi = PTDUP_CURSOR(dir) >> 16;
+  si = PTDUP_CURSOR(dir) & 0xffff;
+  if(pi >= np || si > (int)PTDUP_NUM((uint64*)dir[pi])
+     || ((prev = list_prev(dir, pi, si)) != 0x0 && va < ENT2VA(*prev))
+     || ((next = list_at(dir, pi, si)) != 0x0 && ENT2VA(*next) < va))
+    list_search(dir, va, &pi, &si);
+
+  pg = (uint64*)dir[pi];
+  n = (int)PTDUP_NUM(pg);
+  if(n == PTDUP_NENT){  // Split the full page, moving the entries from split to a new page.
+    if(np == PTDUP_NPAGE)
+      panic("list_insert: too many PTDS/PTED pages");
+    split = (si >= n / 2) ? si : n / 2;  // Appending moves nothing.
+    new = list_alloc();
+    memmove(new, &pg[split], (n - split) * sizeof(uint64));
+    PTDUP_NUM(new) = n - split;
+    PTDUP_NUM(pg) = n = split;
+    memmove(&dir[pi+2], &dir[pi+1], (np - pi - 1) * sizeof(uint64));
+    dir[pi+1] = (uint64)new;
+    PTDUP_NUM(dir) = ++np;
+    if(split == PTDUP_NENT){  // pg is still full.
+      pg = new;
+      n = (int)PTDUP_NUM(new);
+      pi++;
+      si = 0;
     }
   }
-  release(&idx_lock);
 
+  memmove(&pg[si+1], &pg[si], (n - si) * sizeof(uint64));
+  pg[si] = content;
+  PTDUP_NUM(pg) = n + 1;
+  PTDUP_CURSOR(dir) = ((uint64)pi << 16) | (si + 1);
+}
+
+// Erase the entries whose VA is in [va_start, va_end), and return the number of pages they map.
+// Pages of the list which become empty are freed.
+// *last is set to the last erased entry, or 0x0 if nothing is erased.
+static int list_erase(uint64 *dir, uint64 va_start, uint64 va_end, int is_ptds, uint64 *last){
+  int pi, si, ei, n, dsize = 0;
+  uint64 *pg;
+
+  *last = 0x0;
+  list_search(dir, va_start, &pi, &si);
+  while(pi < (int)PTDUP_NUM(dir)){
+    pg = (uint64*)dir[pi];
+    n = (int)PTDUP_NUM(pg);
+    for(ei = si; ei < n && ENT2VA(pg[ei]) < va_end; ei++){
+      dsize += is_ptds ? PTDS2SIZE(pg[ei]) : 1;
+      *last = pg[ei];
+    }
+    memmove(&pg[si], &pg[ei], (n - ei) * sizeof(uint64));
+    PTDUP_NUM(pg) = n - (ei - si);
+    if(PTDUP_NUM(pg) == 0){
+      kfree(pg);
+      memmove(&dir[pi], &dir[pi+1], ((int)PTDUP_NUM(dir) - pi - 1) * sizeof(uint64));
+      PTDUP_NUM(dir)--;
+    } else {
+      pi++;
+    }
+    if(ei < n)  // Reached an entry at va_end or higher.
+      break;
+    si = 0;
+  }
+  return dsize;
+}
+
+// The PTDS covering [va, va + size pages), cut out of the PTDS entry which covers va.
+static uint64 PTDS_part(uint64 entry, uint64 va, int size){
+  uint64 ppn = PTDS2PPN(entry), npages = (va - PTDS2VA(entry)) / PGSIZE;
+
+  ppn = PTDS2ORDER(entry) ? ppn + npages * 0x400 : ppn - npages * 0x400;
+  return VA2PTDS(va) | PPN2PTDS(ppn) | (entry & 0xE00) | size;  // Keep the copy-on-write, order and user bits.
+}
+
+
+// Duplicate L0_pagetable's PTDS or PTED.
+void L0_ptes_add(pagetable_t L2_pagetable, uint64 content, int flag){
+  int idx, is_locked = 1;
+
+  idx = ptdup_idx(L2_pagetable);
   if(idx < 0){
     panic("L0_ptes_add: No index corresponding L2_pagetable");
   }
@@ -258,109 +350,117 @@ void L0_ptes_add(pagetable_t L2_pagetable, uint64 content, int flag){
   }
 
   if(flag){  // Add a new PTDS entry.
-    header = ptdup_head[idx].l0_ptds;
+    list_insert(ptdup_head[idx].l0_ptds, content);
   } else {
-    header = ptdup_head[idx].l0_pted;
+    list_insert(ptdup_head[idx].l0_pted, content);
   }
-  if(header != 0x0)
-    PTDS_PTED_add(idx, header, content, is_locked);
+  if(!is_locked)
+    release(&ptdup_head[idx].lock);
 }
 
 
-// Delete a PTDS area. Not necessary deleting hole PTDS, paritial is OK.
-int PTDS_delete(pagetable_t L2_pagetable, uint64 *header, uint64 va_start, uint64 va_end){
-  uint64 *dnode, *next, target_va_start, target_va_end, size, new = 0x0;
-  int i, dsize = 0;
-
-  for(dnode = header, next = (uint64*)dnode[ENTRY_SIZE-1]; ; dnode = next, next = (uint64*)dnode[ENTRY_SIZE-1]){
-    for(i = 0; i < ENTRY_SIZE-1; i++){
-      target_va_start = PTDS2VA(dnode[i]);
-      size = PTDS2SIZE(dnode[i]);
-      target_va_end = target_va_start + size * PGSIZE - 1;
-      
-      // The case of deleting area and PTDS area matched.
-      if(va_start <= target_va_start && target_va_end <= va_end){
-        dsize += PTDS2SIZE(dnode[i]);
-        dnode[i] = 0x0;
-      }
+// Duplicate a single page mapped at va to pa with perm (see uvmlazy()).
+// If the page below va is recorded with the adjacent PA, the page joins it in a PTDS,
+// so that pages mapped one by one still make PTDSs.
+void ptdup_add_page(pagetable_t L2_pagetable, uint64 va, uint64 pa, int perm){
+  int idx, pi, si, size;
+  uint64 *dir, *entry, ppn = PA2PTE(pa), prev, below = va - PGSIZE;
 
-      // The case of deleting area back is shorter than PTDS area.
-      else if(va_start == target_va_start && va_end < target_va_end){
-        // Change start VA and size to truncate the beginning.
-        new = VA2PTDS((va_end + 1)) | PPN2PTDS((PTDS2PPN(dnode[i]) - size * PGSIZE)) | UB2PTDS(PTDS2UB(dnode[i])) | (PTDS2SIZE(dnode[i]) - size);
-        dnode[i] = new;
-        dsize += PTDS2SIZE(dnode[i]);
-      }
+  idx = ptdup_idx(L2_pagetable);
+  if(idx < 0)
+    panic("ptdup_add_page: No index corresponding L2_pagetable");
 
-      // The case of deleting area's beginning is shorter than PTDS area.
-      else if(target_va_start < va_start && target_va_end == va_end){
-        // Update size to truncate the back.
-        new = dnode[i] | ~(0x1ff);
-        new |= (dnode[i] & 0x1ff) - size;
-        dnode[i] = new;
-        dsize += PTDS2SIZE(size);
+  acquire(&ptdup_head[idx].lock);
+  if((perm & ~PTE_U) == (PTE_R|PTE_W|PTE_X) && PGSIZE <= va){  // PTDS restores R, W and X.
+    // Extend the PTDS ending at va.
+    dir = ptdup_head[idx].l0_ptds;
+    list_search(dir, va, &pi, &si);
+    entry = list_prev(dir, pi, si);
+    if(entry != 0x0){
+      size = PTDS2SIZE(*entry);
+      if(PTDS2VA(*entry) + size * PGSIZE == va && size < PTDS_MAXSIZE
+         && PTDS2COW(*entry) == 0 && PTDS2UB(*entry) == (perm & PTE_U)
+         && ppn == (PTDS2ORDER(*entry) ? PTDS2PPN(*entry) + size * 0x400 : PTDS2PPN(*entry) - size * 0x400)){
+        (*entry)++;
+        goto out;
       }
+    }
 
-      // The case of deleting area is midde of PTDS area.
-      else if(target_va_start < va_start && va_end < target_va_end){
-        uint64 upper, lower;
-        // Change start VA and size to truncate the beginning of "lower" PTDS.
-        lower = VA2PTDS((va_end + 1)) | PPN2PTDS((PTDS2PPN(dnode[i]) - size * PGSIZE)) | UB2PTDS(PTDS2UB(dnode[i])) | (PTDS2SIZE(dnode[i]) - size);
-        L0_ptes_add(L2_pagetable, lower, 1);
-        // Change size to truncate the back of "upper" PTDS.
-        upper = dnode[i] | ~(0x1ff);
-        upper |= target_va_start - va_start;  // Update size.
-        dnode[i] += size;
-      }
+    // Make a PTDS of the PTED of the page below and va.
+    dir = ptdup_head[idx].l0_pted;
+    list_search(dir, below, &pi, &si);
+    entry = list_at(dir, pi, si);
+    if(entry != 0x0 && PTED2VA(*entry) == below && PTED2FLAGS(*entry) == perm
+       && (PTED2PPN(*entry) + 0x400 == ppn || PTED2PPN(*entry) - 0x400 == ppn)){
+      list_erase(dir, below, va, 0, &prev);
+      list_insert(ptdup_head[idx].l0_ptds, VA2PTDS(below)|PPN2PTDS(PTED2PPN(prev))|ORDER2PTDS((uint64)(PTED2PPN(prev) < ppn))|UB2PTDS(perm)|2);
+      goto out;
     }
-    if(next == header)
-      break;
   }
+  list_insert(ptdup_head[idx].l0_pted, VA2PTED(va)|PPN2PTED(ppn)|perm);
 
-  return dsize;
+ out:
+  release(&ptdup_head[idx].lock);
 }
 
 
-// Delete a PTE duplication.
-int PTED_delete(uint64 *header, uint64 va_start, uint64 va_end){
-  uint64 *dnode, *next;
-  int i, dsize = 0;
- 
-  for(dnode = header, next = (uint64*)dnode[ENTRY_SIZE-1]; ; dnode = next, next = (uint64*)dnode[ENTRY_SIZE-1]){
-    for(i = 0; i < ENTRY_SIZE-1; i++){
-      if(va_start <= PTED2VA(dnode[i]) && PTED2VA(dnode[i]) < va_end){
-        dnode[i] = 0x0505050505050505;
-        dsize++;
-      }
+// Delete a PTDS area. Not necessary deleting whole PTDS, partial is OK.
+// Return the number of deleted pages.
+static int PTDS_delete(uint64 *dir, uint64 va_start, uint64 va_end){
+  uint64 *prev, last, start, end, rest = 0x0;
+  int pi, si, dsize;
+
+  // A PTDS starting below va_start may reach into the area: truncate its back.
+  list_search(dir, va_start, &pi, &si);
+  prev = list_prev(dir, pi, si);
+  if(prev != 0x0){
+    start = PTDS2VA(*prev);
+    end = start + PTDS2SIZE(*prev) * PGSIZE;
+    if(va_start < end){
+      if(va_end < end)  // The area is in the middle of the PTDS.
+        rest = PTDS_part(*prev, va_end, (end - va_end) / PGSIZE);
+      *prev = (*prev & ~0x1FFL) | ((va_start - start) / PGSIZE);
+    }
+  }
+
+  // Erase PTDSs starting in the area, but the back of the last one may be out of it.
+  dsize = list_erase(dir, va_start, va_end, 1, &last);
+  if(last != 0x0){
+    end = PTDS2VA(last) + PTDS2SIZE(last) * PGSIZE;
+    if(va_end < end){
+      rest = PTDS_part(last, va_end, (end - va_end) / PGSIZE);
+      dsize -= PTDS2SIZE(rest);
     }
-    if(next == header)
-      break;
   }
+  if(rest != 0x0)
+    list_insert(dir, rest);
+
   return dsize;
 }
 
 
+// Delete PTE duplications.
+// Return the number of deleted pages.
+static int PTED_delete(uint64 *dir, uint64 va_start, uint64 va_end){
+  uint64 last;
+
+  return list_erase(dir, va_start, va_end, 0, &last);
+}
+
+
 // Delete L0_pagetable entries duplications.
 void L0_ptes_delete(pagetable_t L2_pagetable, uint64 va_start, int sz){
-  int i, idx = -1, size = sz + 1;
+  int idx, size = sz + 1;
   uint64 va_end = va_start + size * PGSIZE;
 
-  acquire(&idx_lock);
-  for(i = 0; i < PTDUP_SIZE; i++){
-    if(idx_ptdup[i] == L2_pagetable){
-      idx = i;
-      break;
-    }
-  }
-  release(&idx_lock);
-
+  idx = ptdup_idx(L2_pagetable);
   // There is a case this function is called after PTDUP deletion.
-  if(idx > 0){
+  if(idx >= 0){
     acquire(&ptdup_head[idx].lock);
     if(ptdup_head[idx].l0_pted != 0x0)
       size -= PTED_delete(ptdup_head[idx].l0_pted, va_start, va_end);
     if(ptdup_head[idx].l0_ptds != 0x0)
-      size -= PTDS_delete(L2_pagetable, ptdup_head[idx].l0_ptds, va_start, va_end);
+      size -= PTDS_delete(ptdup_head[idx].l0_ptds, va_start, va_end);
     release(&ptdup_head[idx].lock);
   }
 
@@ -368,104 +468,217 @@ void L0_ptes_delete(pagetable_t L2_pagetable, uint64 va_start, int sz){
 }
 
 
-// Decompose PTDS to a PTDS and some PTEDs, or some PTEDs (no PTDS).
-static int PTDS_decompose_clear(pagetable_t L2_pagetable, int idx, uint64* page, int eidx, uint64 target_va){
-  uint64 content, target_entry = page[eidx];
-  uint64 start_va = PTDS2VA(target_entry), start_ppn = PTDS2PPN(target_entry), start_pa = PTE2PA(start_ppn);
-  int ptds_size = PTDS2SIZE(target_entry);
+// Clear PTE_U of PTDS or PTED flags to deal with uvmclear().
+// If the page is in a PTDS, take it out of the PTDS as a PTED.
+void L0_ptes_clear_user(pagetable_t L2_pagetable, uint64 target_va){
+  int idx, pi, si;
+  uint64 *dir, *entry, start, end, ptds, last;
 
-  if(ptds_size == 2){  // Not combined.
-    content = VA2PTED(start_va) | PPN2PTED(start_ppn) | PTE_W|PTE_X|PTE_R;
-    PTDS_PTED_add(idx, ptdup_head[idx].l0_pted, content, 1);  // User bit cleared PTE.
-    if(PTDS2ORDER(target_entry)){  // Continuous regions are ascending order.
-      content = VA2PTED((start_va + PGSIZE)) | PPN2PTED(PA2PTE((start_pa + PGSIZE))) | PTE_W|PTE_X|PTE_R|PTDS2UB(target_entry);
-    } else {
-      content = VA2PTED((start_va + PGSIZE)) | PPN2PTED(PA2PTE((start_pa - PGSIZE))) | PTE_W|PTE_X|PTE_R|PTDS2UB(target_entry);
-    }
-    PTDS_PTED_add(idx, ptdup_head[idx].l0_pted, content, 1);  // User bit cleared PTE.
-    PTDS_delete(L2_pagetable, ptdup_head[idx].l0_ptds, start_va, start_va + 2 * PGSIZE);
+  idx = ptdup_idx(L2_pagetable);
+  if(idx < 0){
+    printf("L0_ptes_clear_user: No corresponding PTDUP.\n");
+    return;
   }
 
-  else if(ptds_size > 2){  // Combined with other upper entry.
-    start_va = start_va + (ptds_size - 2) * PGSIZE;
-    start_pa = start_pa + (ptds_size - 2) * PGSIZE;
-    content = VA2PTED(start_va) | PPN2PTED(PA2PTE(start_pa)) | PTE_W|PTE_X|PTE_R;
-    PTDS_PTED_add(idx, ptdup_head[idx].l0_pted, content, 1);  // User bit cleared PTE.
-    if(PTDS2ORDER(target_entry)){
-      content = VA2PTED((start_va + PGSIZE)) | PPN2PTED(PA2PTE((start_pa + PGSIZE))) | PTE_W|PTE_X|PTE_R|PTDS2UB(target_entry);
-    } else {
-      content = VA2PTED((start_va + PGSIZE)) | PPN2PTED(PA2PTE((start_pa - PGSIZE))) | PTE_W|PTE_X|PTE_R|PTDS2UB(target_entry);
+  acquire(&ptdup_head[idx].lock);
+  // Search PTED list.
+  dir = ptdup_head[idx].l0_pted;
+  list_search(dir, target_va, &pi, &si);
+  entry = list_at(dir, pi, si);
+  if(entry != 0x0 && PTED2VA(*entry) == target_va){
+    *entry &= ~PTE_U;  // Clear user bit.
+    release(&ptdup_head[idx].lock);
+    return;
+  }
+
+  // Search PTDS list.
+  dir = ptdup_head[idx].l0_ptds;
+  list_search(dir, target_va + 1, &pi, &si);
+  entry = list_prev(dir, pi, si);  // The last PTDS starting at target_va or lower.
+  if(entry != 0x0){
+    ptds = *entry;
+    start = PTDS2VA(ptds);
+    end = start + PTDS2SIZE(ptds) * PGSIZE;
+    if(target_va < end){
+      list_erase(dir, start, start + 1, 1, &last);
+      if(start < target_va)
+        list_insert(dir, PTDS_part(ptds, start, (target_va - start) / PGSIZE));
+      if(target_va + PGSIZE < end)
+        list_insert(dir, PTDS_part(ptds, target_va + PGSIZE, (end - target_va) / PGSIZE - 1));
+      // User bit cleared PTE.
+      list_insert(ptdup_head[idx].l0_pted, VA2PTED(target_va) | PPN2PTED(PTDS2PPN(PTDS_part(ptds, target_va, 1))) | (PTDS2FLAGS(ptds) & ~PTE_U));
+      release(&ptdup_head[idx].lock);
+      return;
     }
-    PTDS_PTED_add(idx, ptdup_head[idx].l0_pted, content, 1);  // User bit cleared PTE.
-    target_entry = target_entry & ~0xFF;  // Clear size.
-    target_entry = target_entry | (ptds_size - 2);
-  } else {
-    printf("PTDS_decompose_clear: Invalid PTDS entry is passed.\n");
-    return 1;
   }
 
-  return 0;
+  release(&ptdup_head[idx].lock);
+  printf("L0_ptes_clear_user: Fail to clear User bit in PTDUP.\n");
 }
 
 
-// Clear PTE_U of PTDS or PTED flags to deal with uvmclear().
-// If necessary, take a PTDS to two PTEDs.
-void L0_ptes_clear_user(pagetable_t L2_pagetable, uint64 target_va){
-  int i, idx = -1;
-  uint64 va_start, va_end;
-  uint64 target_end_va = target_va + PGSIZE;
-  uint64 *header, *next, *p;
+// The number of pages for the entries of list below sz.
+static int list_pages_below(uint64 *dir, uint64 sz){
+  int pi, si, n;
 
-  acquire(&idx_lock);
-  for(i = 0; i < PTDUP_SIZE; i++){
-    if(idx_ptdup[i] == L2_pagetable){
-      idx = i;
+  list_search(dir, sz, &pi, &si);
+  n = si;
+  for(int i = 0; i < pi; i++)
+    n += PTDUP_NUM((uint64*)dir[i]);
+  return (n + PTDUP_NENT - 1) / PTDUP_NENT;
+}
+
+// Copy the entries of list from below sz to the empty list to, turning their pages copy-on-write in both.
+// The pages of to are taken from *spare (linked through their first word), allocated before the locks.
+static void list_clone(uint64 *from, uint64 *to, uint64 sz, int is_ptds, uint64 **spare){
+  uint64 *pg, *tpg = 0x0;
+
+  if(PTDUP_NUM(to) != 0)
+    panic("list_clone: not empty");
+  for(int pi = 0; pi < (int)PTDUP_NUM(from); pi++){
+    pg = (uint64*)from[pi];
+    for(int si = 0; si < (int)PTDUP_NUM(pg); si++){
+      if(sz <= ENT2VA(pg[si]))
+        goto out;
+      if(is_ptds)
+        pg[si] |= COW2PTDS(PTE_COW);
+      else if(pg[si] & PTE_W)
+        pg[si] = (pg[si] & ~PTE_W) | PTE_COW;
+      if(tpg == 0x0 || PTDUP_NUM(tpg) == PTDUP_NENT){
+        tpg = *spare;
+        *spare = (uint64*)tpg[0];
+        tpg[0] = 0;
+        to[PTDUP_NUM(to)++] = (uint64)tpg;
+      }
+      tpg[PTDUP_NUM(tpg)++] = pg[si];
+    }
+  }
+ out:
+  if(tpg != 0x0)  // The next insert is tried at the end.
+    PTDUP_CURSOR(to) = ((PTDUP_NUM(to) - 1) << 16) | PTDUP_NUM(tpg);
+}
+
+// Duplicate the PTDS/PTED entries of old's user memory [0, sz) to new,
+// as fork() shares the memory copy-on-write (see uvmcopy()).
+// kalloc() may sleep in the KMEM R.C.S., so the list pages of new are allocated
+// before the locks are taken, and counted again under the lock of old.
+void ptdup_clone(pagetable_t old, pagetable_t new, uint64 sz){
+  int oidx = ptdup_idx(old), nidx = ptdup_idx(new), n, nspare = 0;
+  uint64 *spare = 0x0, *pg;
+
+  if(oidx < 0 || nidx < 0)
+    panic("ptdup_clone: No index corresponding L2_pagetable");
+
+  for(;;){
+    acquire(&ptdup_head[oidx].lock);
+    n = list_pages_below(ptdup_head[oidx].l0_ptds, sz) + list_pages_below(ptdup_head[oidx].l0_pted, sz);
+    if(n <= nspare)
       break;
+    release(&ptdup_head[oidx].lock);
+    for(; nspare < n; nspare++){
+      pg = list_alloc();
+      pg[0] = (uint64)spare;
+      spare = pg;
     }
   }
-  release(&idx_lock);
-  if(idx < 0){
-    printf("L0_ptes_clear_user: No corresponding PTDUP.\n");
-    return;
+
+  acquire(&ptdup_head[nidx].lock);
+  list_clone(ptdup_head[oidx].l0_ptds, ptdup_head[nidx].l0_ptds, sz, 1, &spare);
+  list_clone(ptdup_head[oidx].l0_pted, ptdup_head[nidx].l0_pted, sz, 0, &spare);
+  release(&ptdup_head[nidx].lock);
+  release(&ptdup_head[oidx].lock);
+
+  while((pg = spare) != 0x0){
+    spare = (uint64*)pg[0];
+    kfree((void*)pg);
   }
+}
 
-  acquire(&ptdup_head[idx].lock);
-  // Search PTDS list.
-  if(ptdup_head[idx].l0_ptds != 0x0){
-    header = ptdup_head[idx].l0_ptds;
-    for(p = header, next = (uint64*)p[ENTRY_SIZE-1]; ; p = next, next = (uint64*)p[ENTRY_SIZE-1]){
-      for(i = 0; i < ENTRY_SIZE-1; i++){
-        va_start = PTDS2VA(p[i]);
-        va_end = target_va + PGSIZE - 1;    
-        if(va_start <= target_va && target_va <= va_end){
-          if(PTDS_decompose_clear(L2_pagetable, idx, p, i, target_va) != 0)
-            goto bad;
-          release(&ptdup_head[idx].lock);
-          return;
-        }
+
+// Whether the PTDS/PTED lists of ptdup_head[idx] map any page in [va_start, va_end).
+// This takes no lock, to be called from the recovery handler.
+int ptdup_mapped(int idx, uint64 va_start, uint64 va_end){
+  uint64 *entry;
+  int pi, si;
+
+  list_search(ptdup_head[idx].l0_pted, va_start, &pi, &si);
+  entry = list_at(ptdup_head[idx].l0_pted, pi, si);
+  if(entry != 0x0 && PTED2VA(*entry) < va_end)
+    return 1;
+
+  list_search(ptdup_head[idx].l0_ptds, va_start, &pi, &si);
+  entry = list_at(ptdup_head[idx].l0_ptds, pi, si);
+  if(entry != 0x0 && PTDS2VA(*entry) < va_end)
+    return 1;
+  entry = list_prev(ptdup_head[idx].l0_ptds, pi, si);  // A PTDS starting below va_start may reach into it.
+  return entry != 0x0 && va_start < PTDS2VA(*entry) + PTDS2SIZE(*entry) * PGSIZE;
+}
+
+
+// Copy out the memory space overhead of all PTDUPs: the number of processes,
+// and the bytes of L2/L1 duplications and of PTDS/PTED lists.
+// This takes no lock: a PTDUP being created or deleted meanwhile may be miscounted.
+uint64 sys_check_ptdup_overhead(void){
+  uint64 tables = 0, lists = 0, nproc = 0, uaddr, st[3];
+
+  if(argaddr(0, &uaddr) < 0)
+    return -1;
+
+  for(int idx = 0; idx < PTDUP_SIZE; idx++){
+    if(idx_ptdup[idx] != 0x0){
+      nproc++;
+      if(ptdup_head[idx].l2 != 0x0)
+        tables++;
+      if(ptdup_head[idx].l1 != 0x0){
+        tables++;
+        for(int i = 0; i < ENTRY_SIZE; i++)
+          if(ptdup_head[idx].l1[i] != 0x0)
+            tables++;
       }
-      if(next == header)
-        break;
+      if(ptdup_head[idx].l0_ptds != 0x0)
+        lists += 1 + PTDUP_NUM(ptdup_head[idx].l0_ptds);
+      if(ptdup_head[idx].l0_pted != 0x0)
+        lists += 1 + PTDUP_NUM(ptdup_head[idx].l0_pted);
     }
   }
-  
-  // Search PTED list.
-  if(ptdup_head[idx].l0_pted != 0x0){
-    header = ptdup_head[idx].l0_pted;
-    for(p = header, next = (uint64*)p[ENTRY_SIZE-1]; ; p = next, next = (uint64*)p[ENTRY_SIZE-1]){
-      for(i = 0; i < ENTRY_SIZE-1; i++){
-        if(target_va <= PTED2VA(p[i]) && PTED2VA(p[i]) <= target_end_va){
-          p[i] = p[i] & ~PTE_U;  // Clear user bit.
-          release(&ptdup_head[idx].lock);
-          return;
-        }
-      }
-      if(next == header)
-        break;
+  st[0] = nproc;
+  st[1] = tables * PGSIZE;
+  st[2] = lists * PGSIZE;
+  if(copyout(myproc()->pagetable, uaddr, (char*)st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
+
+// Record the page mapped at va to pa with perm. Pages must be recorded in VA order.
+// Pages contiguous in both VA and PA are gathered into a run to be recorded as a PTDS.
+void ptdup_run_add(pagetable_t L2_pagetable, struct ptdup_run *r, uint64 va, uint64 pa, int perm){
+  if(r->size > 0 && r->size < PTDS_MAXSIZE && r->perm == perm && va == r->va + r->size * PGSIZE
+     && (perm & (PTE_R|PTE_W|PTE_X)) == (PTE_R|PTE_W|PTE_X)){  // PTDS restores R, W and X.
+    if(r->size == 1 && (pa == r->pa + PGSIZE || pa == r->pa - PGSIZE)){
+      r->order = pa > r->pa;
+      r->size++;
+      return;
+    }
+    if(r->size > 1 && pa == (r->order ? r->pa + r->size * PGSIZE : r->pa - r->size * PGSIZE)){
+      r->size++;
+      return;
     }
   }
 
-bad:
-  release(&ptdup_head[idx].lock);
-  printf("L0_ptes_clear_user: Fail to clear User bit in PTDUP.\n");
+  ptdup_run_flush(L2_pagetable, r);
+  r->va = va;
+  r->pa = pa;
+  r->perm = perm;
+  r->order = 1;
+  r->size = 1;
+}
+
+// Record the pending run as a PTDS, or as a PTED if it is a single page.
+void ptdup_run_flush(pagetable_t L2_pagetable, struct ptdup_run *r){
+  if(r->size == 1)
+    L0_ptes_add(L2_pagetable, VA2PTED(r->va)|PPN2PTED(PA2PTE(r->pa))|r->perm, 0);  // Update PTED list.
+  else if(r->size > 1)
+    L0_ptes_add(L2_pagetable, VA2PTDS(r->va)|PPN2PTDS(PA2PTE(r->pa))|ORDER2PTDS(r->order)|UB2PTDS(r->perm)|r->size, 1);  // Update PTDS list.
+  r->size = 0;
 }
@@ -3,13 +3,14 @@
 /* PTDS: PageTable Data Segment
    Pagetable data segment's layout in 64 bit address length.
    63 ~ 38 -- Hole of virtual address at starting point (26 bits, because MAXVA is 256GB in xv6).
-   37 ~ 11 -- Part of PPN corresponding to VA (lower 27 bits, covered 512GB).
+   37 ~ 12 -- Part of PPN corresponding to VA (lower 26 bits, covered 256GB).
+   11      -- Copy-on-write bit (the pages are shared read-only by fork()).
    10      -- Order bit (ascending (1) or descending (0)).
    9       -- Represent User bit.
    8 ~  0  -- Number of pages which is managed by PTDS (MAX: 2^9-1 = 511 pages).
 
-   in PTDS, we keep only Userbit.
-   Because XWRV are must be 1 in user data, and we truncate dirty/global/access.
+   in PTDS, we keep only Userbit and Copy-on-write bit.
+   Because XRV are must be 1 in user data, W is 1 unless copy-on-write, and we truncate dirty/global/access.
 
    PTED: PageTable Entry Duplication
    PTED's layout in 64 bit address length.
@@ -20,26 +21,55 @@
 
 #define ARRAY_SIZE_64 (PGSIZE / sizeof(uint64))
 #define ENTRY_SIZE 512
+#define PTDUP_SIZE (NPROC+2)  // NPROC + extra space
+                              // The extra space is in the case of run recovery when kfree() in exec().
+                              // The case, it is difficult to identify and delete only the old pagetable in exec() in current implementation.
+                              // There may be some sophisticated way, but currently handle the case by this way.
 
 // Head of pagetable duplications for L2 & L1s.
+// With PTDUP_EXTENT, l2 and l1 are not allocated, and recovery_handler_pagetable()
+// rebuilds a broken page table of any level and the ones below it from the PTDS/PTED lists.
 struct ptdup_head {
   uint64 *l2;       // Address of level-2 page table's duplication.
   uint64 **l1;      // Address of page managing level-1's duplications address like page directory.
-  uint64 *l0_ptds;  // Address of top of pagetable data segment list(PTDS list) of level-0 pagetables.
-  uint64 *l0_pted;  // Address of top of other individual patetable entries of level-0 pagetables.
+  uint64 *l0_ptds;  // Address of directory of pagetable data segment list(PTDS list) of level-0 pagetables.
+  uint64 *l0_pted;  // Address of directory of other individual patetable entries of level-0 pagetables.
   struct spinlock lock;
 };
 
+/* PTDS/PTED list layout.
+   The first page of a list is its directory: slots 0 ~ 509 point to the pages holding entries
+   in VA order, slot 510 is the append cursor (page index << 16 | slot) and slot 511 is the number of pages.
+   Each page keeps its entries sorted by VA from slot 0, and the number of them in slot 511.
+*/
+#define PTDUP_NENT (ENTRY_SIZE - 1)   // Entries per list page.
+#define PTDUP_NPAGE (ENTRY_SIZE - 2)  // Pages per list.
+#define PTDUP_NUM(page) ((page)[ENTRY_SIZE - 1])
+#define PTDUP_CURSOR(dir) ((dir)[ENTRY_SIZE - 2])
+#define PTDS_MAXSIZE 0x1FF
+
+// Run of pages contiguous in VA and PA, being gathered into a PTDS.
+struct ptdup_run {
+  uint64 va;  // VA of the first page.
+  uint64 pa;  // PA of the first page.
+  int size;   // Number of pages, 0 if there is no pending run.
+  int order;  // Ascending (1) or descending (0) PA.
+  int perm;
+};
+
 // Extract contents from PTDS.
 #define PTDS2VA(entry) ((entry >> 26) & ~0xFFF)
 #define VA2PTDS(va) (va << 26)
-#define PTDS2PPN(entry) ((entry & 0x3FFFFFF800) >> 2)
+#define PTDS2PPN(entry) ((entry & 0x3FFFFFF000) >> 2)
 #define PPN2PTDS(ppn) ((ppn & ~0x3FF) << 2)
 #define UB2PTDS(perm) ((perm & 0x10) << 5)
 #define PTDS2UB(entry) ((entry >> 5) & 0x10)
 #define PTDS2SIZE(entry) (entry & 0x1FF)
 #define ORDER2PTDS(order) (order << 10)
 #define PTDS2ORDER(entry) ((entry >> 10) & 0x1)
+#define COW2PTDS(perm) ((perm & PTE_COW) << 3)
+#define PTDS2COW(entry) ((entry >> 3) & PTE_COW)
+#define PTDS2FLAGS(entry) (PTDS2UB(entry) | PTDS2COW(entry) | (PTDS2COW(entry) ? 0 : PTE_W) | PTE_X | PTE_R)
 
 // Extract from / Add contents to PTED.
 #define PTED2VA(entry) ((entry >> 26) & ~0xFFF)
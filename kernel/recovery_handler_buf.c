@@ -16,6 +16,7 @@
 #include "proc.h"
 #include "recovery_locking.h"
 #include "after-treatment.h"
+#include "funcid.h"
 
 
 extern struct mlist_header mlist;
@@ -29,72 +30,64 @@ extern void (*handler_for_mem_fault)(char*);  // Function which is called from N
 extern int recovery_mode;
 extern int dup_outstanding;
 
-extern uint64 bfree_start, bfree_end;
-extern uint64 brelse_start, brelse_end;
-extern uint64 commit_start, commit_end;
-extern uint64 dirlink_start, dirlink_end;
-extern uint64 end_op_start, end_op_end;
-extern uint64 exit_start, exit_end;
-extern uint64 fsinit_start, fsinit_end;
-extern uint64 install_trans_start, install_trans_end;
-extern uint64 iput_start, iput_end;
-extern uint64 log_write_start, log_write_end;
-extern uint64 readsb_start, readsb_end;
-extern uint64 sys_chdir_start, sys_chdir_end;
-extern uint64 sys_close_start, sys_close_end;
-extern uint64 sys_link_start, sys_link_end;
-extern uint64 sys_write_start, sys_write_end;
-extern uint64 virtio_disk_intr_start, virtio_disk_intr_end;
-extern uint64 write_head_start, write_head_end;
-extern uint64 write_log_start, write_log_end;
-
 extern void recover_from_log(void);
 
+// struct buf's After-Treatment rules.
+static const struct af_rule buf_rules[] = {
+  {FN_exit,             AF_ANY,       AF_ANY,  AF_STOP, PROCESS_KILL,    FN_NONE},
+  {FN_bfree,            AF_ANY,       AF_ANY,  AF_SET,  SYSCALL_FAIL,    FN_NONE},
+  {FN_dirlink,          AF_ANY,       AF_ANY,  AF_SET,  SYSCALL_FAIL,    FN_NONE},
+  {FN_iput,             AF_ANY,       AF_ANY,  AF_SET,  SYSCALL_FAIL,    FN_NONE},
+  {FN_log_write,        AF_ANY,       AF_ANY,  AF_SET,  SYSCALL_FAIL,    FN_NONE},
+  {FN_sys_link,         AF_ANY,       AF_ANY,  AF_SET,  SYSCALL_FAIL,    FN_NONE},
+  {FN_sys_write,        AF_ANY,       AF_ANY,  AF_SET,  SYSCALL_FAIL,    FN_NONE},
+  {FN_write_log,        AF_ANY,       AF_ANY,  AF_SET,  SYSCALL_FAIL,    FN_NONE},
+  {FN_virtio_disk_intr, AF_ANY,       AF_ANY,  AF_STOP, AF_TRAP,         FN_NONE},
+  {FN_sys_close,        CONSERVATIVE, AF_ANY,  AF_STOP, SYSCALL_SUCCESS, FN_NONE},
+  // The specified file is opened, but the fd can't be returned without User Cooperation.
+  {FN_install_trans,    AF_ANY,       ENABLE,  AF_SET,  SYSCALL_SUCCESS, FN_NONE},
+  {FN_install_trans,    AF_ANY,       DISABLE, AF_SET,  SYSCALL_FAIL,    FN_NONE},
+  {FN_write_head,       AF_ANY,       ENABLE,  AF_SET,  SYSCALL_SUCCESS, FN_NONE},
+  {FN_write_head,       AF_ANY,       DISABLE, AF_SET,  SYSCALL_FAIL,    FN_NONE},
+};
+static struct af_table buf_af = AF_TABLE(buf_rules);
+
+// Call stacks in which struct buf can't be recovered.
+static const struct af_rule buf_fail_stop_rules[] = {
+  {FN_brelse,     AF_ANY,       AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+  {FN_readsb,     AF_ANY,       AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+  {FN_fsinit,     AF_ANY,       AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+  {FN_end_op,     AF_ANY,       AF_ANY, AF_STOP, FAIL_STOP, FN_sys_chdir},
+  {FN_bfree,      CONSERVATIVE, AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+  {FN_dirlink,    CONSERVATIVE, AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+  {FN_iput,       CONSERVATIVE, AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+  {FN_log_write,  CONSERVATIVE, AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+  {FN_sys_link,   CONSERVATIVE, AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+  {FN_sys_write,  CONSERVATIVE, AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+  {FN_write_log,  CONSERVATIVE, AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+};
+static struct af_table buf_fail_stop_af = AF_TABLE(buf_fail_stop_rules);
+
 // Decide struct buf's After-Treatment policy.
 static int
-after_treatment_buf(uint64 *pcs, int pid, uint64 sp, uint64 s0)
+after_treatment_buf(int *fids, int pid, uint64 sp, uint64 s0)
 {
   int ret = is_enable_user_coop(pid) ? SYSCALL_REDO : SYSCALL_FAIL;
 
-  for(int i = 0; i < DEPTH; i++){
-    if(ISINSIDE(pcs[i], exit_start, exit_end)){
-      printf("end struct buf recovery: %d\n", get_ticks());
-      return PROCESS_KILL;
-    } else if(ISINSIDE(pcs[i], bfree_start, bfree_end) || ISINSIDE(pcs[i], dirlink_start, dirlink_end) ||
-              ISINSIDE(pcs[i], iput_start, iput_end) || ISINSIDE(pcs[i], log_write_start, log_write_end) ||
-              ISINSIDE(pcs[i], sys_link_start, sys_link_end) || ISINSIDE(pcs[i], sys_write_start, sys_write_end) ||
-              ISINSIDE(pcs[i], write_log_start, write_log_end)){
-      ret = SYSCALL_FAIL;
-    } else if(ISINSIDE(pcs[i], virtio_disk_intr_start, virtio_disk_intr_end)){
-      int trap = identify_nmi_occurred_trap(pid, sp, s0);
-
-      if(trap == USERTRAP){
-        printf("end struct buf recovery: %d\n", get_ticks());
-        return RETURN_TO_USER;
-      } else if(trap == KERNELTRAP){
-        printf("end struct buf recovery: %d\n", get_ticks());
-        return RETURN_TO_KERNEL;
-      }
-    } else if((recovery_mode == CONSERVATIVE && ISINSIDE(pcs[i], sys_close_start, sys_close_end))){ 
-      printf("end struct buf recovery: %d\n", get_ticks());
-      return SYSCALL_SUCCESS;
-    } else if(ISINSIDE(pcs[i], install_trans_start, install_trans_end) || ISINSIDE(pcs[i], write_head_start, write_head_end)){
-      if(is_enable_user_coop(pid)){
-        ret = SYSCALL_SUCCESS;
-      } else {
-        printf("CAUTION: the specified file is opened, but the fd can't be returned due to ECC-uncorrectable Error occurrence.\n");
-        ret = SYSCALL_FAIL;
-      }
+  ret = af_decide(&buf_af, fids, pid, sp, s0, ret);
+  for(int i = 0; i < DEPTH && ret == SYSCALL_FAIL; i++){
+    if((fids[i] == FN_install_trans || fids[i] == FN_write_head) && !is_enable_user_coop(pid)){
+      printf("CAUTION: the specified file is opened, but the fd can't be returned due to ECC-uncorrectable Error occurrence.\n");
+      break;
     }
   }
-
   printf("end struct buf recovery: %d, ret = %d\n", get_ticks(), ret);
   return ret;
 }
 
 // Solve inconsistencies between buf and log, inode,  or disk.
 static void
-solve_inconsistency_buf(uint64 pcs[], int pid, struct buf *broken)
+solve_inconsistency_buf(int *fids, int pid, struct buf *broken)
 {
   int nonum = 0, is_installing = 0, is_committing = 0;
 
@@ -121,10 +114,10 @@ solve_inconsistency_buf(uint64 pcs[], int pid, struct buf *broken)
 
   if(log->committing){
     for(int i = 0; i < DEPTH; i++){
-      if(ISINSIDE(pcs[i], install_trans_start, install_trans_end)){
+      if(fids[i] == FN_install_trans){
         is_installing = 1;
         break;
-      } else if (ISINSIDE(pcs[i], commit_start, commit_end)){  // this process was committing
+      } else if (fids[i] == FN_commit){  // this process was committing
         is_committing = 1;
         break;
       }
@@ -192,36 +185,6 @@ solve_inconsistency_buf(uint64 pcs[], int pid, struct buf *broken)
     pop_off();  // Decrement the noff of broken buf's sleeplock's spinlock.
 }
 
-static int
-check_fail_stop_cases(uint64 *pcs)
-{
-  int is_sys_chdir = 0, is_end_op = 0;
-
-  for(int i = 0; i < DEPTH; i++){
-    if(ISINSIDE(pcs[i], brelse_start, brelse_end) || ISINSIDE(pcs[i], readsb_start, readsb_end) ||
-       ISINSIDE(pcs[i], fsinit_start, fsinit_end))
-      return 1;
-    else if(ISINSIDE(pcs[i], sys_chdir_start, sys_chdir_end))
-      is_sys_chdir = 1;
-    else if(ISINSIDE(pcs[i], end_op_start, end_op_end))
-      is_end_op = 1;
-
-    if(recovery_mode == CONSERVATIVE){
-      if(ISINSIDE(pcs[i], bfree_start, bfree_end) || ISINSIDE(pcs[i], dirlink_start, dirlink_end) ||
-         ISINSIDE(pcs[i], iput_start, iput_end) || ISINSIDE(pcs[i], log_write_start, log_write_end) ||
-         ISINSIDE(pcs[i], sys_link_start, sys_link_end) || ISINSIDE(pcs[i], sys_write_start, sys_write_end) ||
-         ISINSIDE(pcs[i], write_log_start, write_log_end)){
-        return 1;
-      }
-    }
-  }
-
-  if(is_sys_chdir && is_end_op)
-    return 1;
-
-  return 0;
-}
-
 // struct buf's recovery handler.
 int
 recovery_handler_buf(void *address, int pid, uint64 sp, uint64 s0)
@@ -234,6 +197,7 @@ recovery_handler_buf(void *address, int pid, uint64 sp, uint64 s0)
   struct buf *broken = (struct buf*)address;
   struct buf *prev = 0, *next = 0;
   uint64 pcs[DEPTH];
+  int fids[DEPTH];
 
   // Search call stack & check Fail-Stop situation.
   if(s0 - sp > PGSIZE){
@@ -242,8 +206,9 @@ recovery_handler_buf(void *address, int pid, uint64 sp, uint64 s0)
   } else {
     getcallerpcs_top(pcs, sp, s0, DEPTH);
   }
+  pcs2funcids(pcs, fids, DEPTH);
   
-  if(check_fail_stop_cases(pcs) || new_buf == 0){
+  if(af_decide(&buf_fail_stop_af, fids, pid, sp, s0, 0) == FAIL_STOP || new_buf == 0){
     printf_without_pr("The context before the NMI meets Fail-Stop condition.\n");
     return FAIL_STOP;
   } else if(check_and_count_procs_in_rcs(RL_FLAG_BUF, broken) > 1){
@@ -312,12 +277,12 @@ recovery_handler_buf(void *address, int pid, uint64 sp, uint64 s0)
    */
   update_recovery_lock_idx(RL_FLAG_BUF, broken, new_buf);
   release_recovery_lock_buf(new_buf);
-  solve_inconsistency_buf(pcs, pid, broken);
+  solve_inconsistency_buf(fids, pid, broken);
 
   exit_rcs_after_recovery(pid, 0);
 
   /*
    * After-Treatment
    */
-  return after_treatment_buf(pcs, pid, sp, s0);
+  return after_treatment_buf(fids, pid, sp, s0);
 }
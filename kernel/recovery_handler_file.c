@@ -17,6 +17,7 @@
 #include "nmi.h"
 #include "recovery_locking.h"
 #include "after-treatment.h"
+#include "funcid.h"
 
 
 extern struct mlist_header mlist;
@@ -31,35 +32,27 @@ extern void (*handler_for_mem_fault)(char*);  // Function which is called from N
 extern int recovery_mode;
 extern int dup_outstanding;
 
-extern uint64 exit_start, exit_end;
-extern uint64 fork_start, fork_end;
-extern uint64 filealloc_start, filealloc_end;
-extern uint64 filewrite_start, filewrite_end;
-extern uint64 pipealloc_start, pipealloc_end;
-extern uint64 sys_close_start, sys_close_end;
-extern uint64 sys_open_start, sys_open_end;
-extern uint64 sys_write_start, sys_write_end;
 
+// Call stacks in which struct file can't be recovered.
+static const struct af_rule file_fail_stop_rules[] = {
+  {FN_sys_open,  AF_ANY,       AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+  {FN_fork,      CONSERVATIVE, AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+  {FN_pipealloc, CONSERVATIVE, AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+  {FN_sys_write, CONSERVATIVE, AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+};
+static struct af_table file_fail_stop_af = AF_TABLE(file_fail_stop_rules);
 
-// Check the conditions for Fail-Stop from the kernel stack.
-static int
-check_fail_stop(uint64 *pcs)
-{
-  for (int i = 0; i < DEPTH; i++) {
-    if (ISINSIDE(pcs[i], sys_open_start, sys_open_end))
-      return 1;
-    if (recovery_mode == CONSERVATIVE) {
-      if (ISINSIDE(pcs[i], fork_start, fork_end) || ISINSIDE(pcs[i], pipealloc_start, pipealloc_end)
-      || ISINSIDE(pcs[i], sys_write_start, sys_write_end))
-        return 1;
-    }
-  }
-  return 0;
-}
+// struct file's After-Treatment rules.
+static const struct af_rule file_rules[] = {
+  {FN_sys_close, AF_ANY, AF_ANY, AF_SET,  SYSCALL_SUCCESS,     FN_NONE},
+  {FN_exit,      AF_ANY, AF_ANY, AF_STOP, PROCESS_KILL,        FN_NONE},
+  {FN_sys_write, AF_ANY, ENABLE, AF_SET,  REOPEN_SYSCALL_FAIL, FN_NONE},
+};
+static struct af_table file_af = AF_TABLE(file_rules);
 
 // After-Treatment of struct file's recovery.
 static int
-after_treatment(uint64 *pcs, int num, struct proc *bp, struct inode *b_ip, uint64 pipe)
+after_treatment(int *fids, int num, struct proc *bp, struct inode *b_ip, uint64 pipe)
 {
   int uc_status = is_enable_user_coop(bp->pid);
   int ret = (uc_status == ENABLE) ? REOPEN_SYSCALL_REDO : SYSCALL_FAIL;
@@ -67,16 +60,7 @@ after_treatment(uint64 *pcs, int num, struct proc *bp, struct inode *b_ip, uint6
   if (pipe != 0x0)  // FD_PIPE file node is broken.
     ret = SYSCALL_FAIL;
 
-  for (int i = 0; i < DEPTH; i++) {
-    if (ISINSIDE(pcs[i], sys_close_start, sys_close_end)) {
-      ret = SYSCALL_SUCCESS;
-    } else if (ISINSIDE(pcs[i], exit_start, exit_end)) {
-      ret = PROCESS_KILL;
-      break;
-    } else if (uc_status == ENABLE && ISINSIDE(pcs[i], sys_write_start, sys_write_end)) {
-      ret = REOPEN_SYSCALL_FAIL;
-    } 
-  }
+  ret = af_decide(&file_af, fids, bp->pid, 0, 0, ret);
 
   if (!pipe && log->outstanding > 0)
     end_op();
@@ -105,6 +89,7 @@ recovery_handler_file(void* address, int pid, uint64 sp, uint64 s0)
   struct inode *ip, *b_ip = 0x0;
   struct proc *p, *bp = search_proc_from_pid(pid);
   uint64 pcs[DEPTH];
+  int fids[DEPTH];
 
   // Search call stack & check Fail-Stop situation.
   if (s0 - sp > PGSIZE) {  // In the case of invalid s0 or sp is passed.
@@ -112,8 +97,9 @@ recovery_handler_file(void* address, int pid, uint64 sp, uint64 s0)
   } else {
     getcallerpcs_top(pcs, sp, s0, DEPTH);
   }
+  pcs2funcids(pcs, fids, DEPTH);
  
-  if (check_fail_stop(pcs))
+  if (af_decide(&file_fail_stop_af, fids, pid, sp, s0, 0) == FAIL_STOP)
     return FAIL_STOP;
     
   push_off();
@@ -248,15 +234,11 @@ recovery_handler_file(void* address, int pid, uint64 sp, uint64 s0)
   if (holding(&old_ftable->lock))
     release(&old_ftable->lock);
   
-  // Delete old M-List nodes & Register new files to M-List.
-  for (fp = old_ftable->file; fp < old_ftable->file + NFILE; fp++)
-    delete_memobj((void*)fp, mlist.fil_list, 0x0);
+  // Move the M-List's array descriptor of files to the new ftable.
+  update_memobj_array(old_ftable->file, new_ftable->file, mlist.fil_list);
 
   recovery_handler_spinlock("ftable", &new_ftable->lock, &old_ftable->lock);
 
-  for (fp = new_ftable->file; fp < new_ftable->file + NFILE; fp++)
-    register_memobj((void*)fp, mlist.fil_list);
-
   // Release related locks.
   for (ip = &icache->inode[0]; ip < &icache->inode[NINODE]; ip++) {
     if (ip->lock.locked && ip->lock.pid == pid) {
@@ -292,5 +274,5 @@ recovery_handler_file(void* address, int pid, uint64 sp, uint64 s0)
   /*
    * After-Treatment
    */
-  return after_treatment(pcs, bfd_num, bp, b_ip, ((uint64)w_fp || (uint64)r_fp));
+  return after_treatment(fids, bfd_num, bp, b_ip, ((uint64)w_fp || (uint64)r_fp));
 }
\ No newline at end of file
@@ -17,6 +17,7 @@
 #include "nmi.h"
 #include "recovery_locking.h"
 #include "after-treatment.h"
+#include "funcid.h"
 
 
 extern struct mlist_header mlist;
@@ -30,21 +31,6 @@ extern void (*handler_for_mem_fault)(char*);  // Function which is called from N
 extern int recovery_mode;
 extern int dup_outstanding;
 
-extern uint64 create_start, create_end;
-extern uint64 exit_start, exit_end;
-extern uint64 idup_start, idup_end;
-extern uint64 iput_start, iput_end;
-extern uint64 iupdate_start, iupdate_end;
-extern uint64 sys_chdir_start, sys_chdir_end;
-extern uint64 sys_close_start, sys_close_end;
-extern uint64 sys_fstat_start, sys_fstat_end;
-extern uint64 sys_link_start, sys_link_end;
-extern uint64 sys_open_start, sys_open_end;
-extern uint64 sys_read_start, sys_read_end;
-extern uint64 sys_unlink_start, sys_unlink_end;
-extern uint64 sys_write_start, sys_write_end;
-extern uint64 writei_start, writei_end;
-
 static int
 lockingsleep(struct sleeplock *lk)
 {
@@ -56,23 +42,44 @@ lockingsleep(struct sleeplock *lk)
   return res;
 }
 
+// Call stacks in which struct inode can't be recovered in Conservative mode.
+static const struct af_rule inode_fail_stop_rules[] = {
+  {FN_create,     CONSERVATIVE, AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+  {FN_idup,       CONSERVATIVE, AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+  {FN_iput,       CONSERVATIVE, AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+  {FN_iupdate,    CONSERVATIVE, AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+  {FN_sys_link,   CONSERVATIVE, AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+  {FN_sys_open,   CONSERVATIVE, AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+  {FN_sys_unlink, CONSERVATIVE, AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+  {FN_writei,     CONSERVATIVE, AF_ANY, AF_STOP, FAIL_STOP, FN_NONE},
+};
+static struct af_table inode_fail_stop_af = AF_TABLE(inode_fail_stop_rules);
+
+// struct inode's After-Treatment rules.
+static const struct af_rule inode_rules[] = {
+  {FN_sys_close,  AF_ANY, AF_ANY,  AF_SET,  SYSCALL_SUCCESS,     FN_NONE},
+  {FN_sys_unlink, AF_ANY, ENABLE,  AF_SET,  REOPEN_SYSCALL_REDO, FN_NONE},
+  {FN_sys_chdir,  AF_ANY, ENABLE,  AF_SET,  REOPEN_SYSCALL_REDO, FN_NONE},
+  {FN_sys_chdir,  AF_ANY, DISABLE, AF_SET,  SYSCALL_FAIL,        FN_NONE},
+  {FN_sys_fstat,  AF_ANY, ENABLE,  AF_SET,  REOPEN_SYSCALL_REDO, FN_NONE},
+  {FN_sys_fstat,  AF_ANY, DISABLE, AF_SET,  SYSCALL_FAIL,        FN_NONE},
+  {FN_sys_link,   AF_ANY, ENABLE,  AF_SET,  REOPEN_SYSCALL_REDO, FN_NONE},
+  {FN_sys_link,   AF_ANY, DISABLE, AF_SET,  SYSCALL_FAIL,        FN_NONE},
+  {FN_sys_read,   AF_ANY, ENABLE,  AF_SET,  REOPEN_SYSCALL_REDO, FN_NONE},
+  {FN_sys_read,   AF_ANY, DISABLE, AF_SET,  SYSCALL_FAIL,        FN_NONE},
+  {FN_idup,       AF_ANY, AF_ANY,  AF_STOP, PROCESS_KILL,        FN_NONE},
+};
+static struct af_table inode_af = AF_TABLE(inode_rules);
+
 // Check the conditions for Fail-Stop from the kernel stack.
 static int
-check_fail_stop(struct inode *broken, struct icache *old_icache, uint64 *pcs)
+check_fail_stop(struct inode *broken, struct icache *old_icache, int *fids)
 {
   int i, is_tdev = 0, is_root = 0;
   struct inode *ip;
 
-  if(recovery_mode == CONSERVATIVE){
-    for(int i = 0; i < DEPTH; i++){
-      if(ISINSIDE(pcs[i], create_start, create_end) || ISINSIDE(pcs[i], idup_start, idup_end) ||
-         ISINSIDE(pcs[i], iput_start, iput_end) || ISINSIDE(pcs[i], iupdate_start, iupdate_end) ||
-         ISINSIDE(pcs[i], sys_link_start, sys_link_end) || ISINSIDE(pcs[i], sys_open_start, sys_open_end) ||
-         ISINSIDE(pcs[i], sys_unlink_start, sys_unlink_end) || ISINSIDE(pcs[i], writei_start, writei_end)){
-        return 1;
-      }
-    }
-  }
+  if(af_decide(&inode_fail_stop_af, fids, 0, 0, 0, 0) == FAIL_STOP)
+    return 1;
 
   // If there are no T_DEVICE in icache, conclude T_DEVICE's inode is broken,
   // or if there are no ROOTINO in icache, conclude ROOTINO is broken.
@@ -166,25 +173,15 @@ solve_inconsistency_inode(void *broken, int b_idx, int pid, struct icache *old,
 
 // After-Treatment in inode recovery.
 static int
-after_treatment_inode(uint64 *pcs, int pid, struct file *fp)
+after_treatment_inode(int *fids, int pid, struct file *fp)
 {
   int uc_status = is_enable_user_coop(pid);
   int ret = (uc_status == ENABLE) ? SYSCALL_REDO : SYSCALL_FAIL;
 
-  for (int i = 0; i < DEPTH; i++) {
-    if (ISINSIDE(pcs[i], sys_close_start, sys_close_end)) {
-      ret = SYSCALL_SUCCESS;
-    } else if (ISINSIDE(pcs[i], sys_unlink_start, sys_unlink_end)) {
-      if(uc_status){
-        ret = (fp != 0) ? REOPEN_SYSCALL_REDO : SYSCALL_REDO;
-      }
-    } else if (ISINSIDE(pcs[i], sys_chdir_start, sys_chdir_end) || ISINSIDE(pcs[i], sys_fstat_start, sys_fstat_end) ||
-               ISINSIDE(pcs[i], sys_link_start, sys_link_end) || ISINSIDE(pcs[i], sys_read_start, sys_read_end)) {
-      ret = (uc_status == ENABLE) ? REOPEN_SYSCALL_REDO : SYSCALL_FAIL;
-    } else if (ISINSIDE(pcs[i], idup_start, idup_end)) {
-      ret = PROCESS_KILL;
-      break;
-    }
+  ret = af_decide(&inode_af, fids, pid, 0, 0, ret);
+  for (int i = 0; i < DEPTH && ret == REOPEN_SYSCALL_REDO && fp == 0x0; i++) {
+    if (fids[i] == FN_sys_unlink)
+      ret = SYSCALL_REDO;  // sys_unlink() has no file to re-open.
   }
 
   printf("end struct inode recovery: %d\n", get_ticks());
@@ -205,6 +202,7 @@ recovery_handler_inode(void* address, int pid, uint64 sp, uint64 s0)
   struct inode *ip, *broken = (struct inode*)address, *old_ip, *new_ip;
   struct proc *p;
   uint64 pcs[DEPTH];
+  int fids[DEPTH];
 
   // Search call stack and check Fail-Stop cases.
   if(sp == 0x0 || s0 - sp > PGSIZE){  // In the case of invalid s0 or sp is passed.
@@ -213,8 +211,9 @@ recovery_handler_inode(void* address, int pid, uint64 sp, uint64 s0)
   } else {
     getcallerpcs_top(pcs, sp, s0, DEPTH);
   }
+  pcs2funcids(pcs, fids, DEPTH);
 
-  if(check_fail_stop(broken, old_icache, pcs))
+  if(check_fail_stop(broken, old_icache, fids))
     return FAIL_STOP;
 
   for(i = 0, ip = &old_icache->inode[0]; ip < &old_icache->inode[0] + NINODE; i++, ip++){
@@ -241,12 +240,12 @@ recovery_handler_inode(void* address, int pid, uint64 sp, uint64 s0)
   new_icache->inode[b_idx].type  = new_icache->inode[b_idx].major = new_icache->inode[b_idx].minor = new_icache->inode[b_idx].nlink = 0;
   new_icache->inode[b_idx].size  = 0;
 
-  // Delete old M-List nodes & Register new inodes to M-List.
+  // Move the M-List's array descriptor of inodes to the new icache.
+  update_memobj_array(old_icache->inode, new_icache->inode, mlist.ino_list);
+
   for(i = 0; i < NINODE; i++){
     old_ip = &old_icache->inode[i];
     new_ip = &new_icache->inode[i];
-    delete_memobj((void*)old_ip, mlist.ino_list, 0x0);
-    register_memobj((void*)new_ip, mlist.ino_list);
 
     if(old_ip == broken){
       recovery_handler_sleeplock("inode", &new_ip->lock, (void*)old_ip, sizeof(struct inode));
@@ -296,5 +295,5 @@ recovery_handler_inode(void* address, int pid, uint64 sp, uint64 s0)
   /*
    * After-Treatment
    */
-  return after_treatment_inode(pcs, pid, b_fp);
+  return after_treatment_inode(fids, pid, b_fp);
 }
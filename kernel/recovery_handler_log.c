@@ -17,6 +17,7 @@
 #include "nmi.h"
 #include "recovery_locking.h"
 #include "after-treatment.h"
+#include "funcid.h"
 
 
 extern int recovery_mode;
@@ -31,29 +32,23 @@ extern struct logheader dup_lhdr;
 extern struct proc proc[];
 extern void (*handler_for_mem_fault)(char*);  // Function which is called from NMI handler.
 
-extern uint64 create_start, create_end;
-extern uint64 begin_op_start, begin_op_end;
-extern uint64 end_op_start, end_op_end;
-extern uint64 exit_start, exit_end;
-extern uint64 fileclose_start, fileclose_end;
-extern uint64 log_write_start, log_write_end;
-extern uint64 sys_chdir_start, sys_chdir_end;
-extern uint64 sys_write_start, sys_write_end;
 
+// struct log's After-Treatment rules.
+static const struct af_rule log_rules[] = {
+  {FN_exit, AF_ANY, AF_ANY, AF_SET, PROCESS_KILL, FN_NONE},
+};
+static struct af_table log_af = AF_TABLE(log_rules);
 
 // After-Treatment of struct log's recovery.
 static int
-after_treatment_log(uint64 *pcs, struct proc *p)
+after_treatment_log(int *fids, struct proc *p)
 {
   int uc_status = is_enable_user_coop(p->pid);
   int ret = (uc_status == ENABLE) ? SYSCALL_REDO : SYSCALL_FAIL;
 
-  for(int i = 0; i < DEPTH; i++){
-    if(ISINSIDE(pcs[i], exit_start, exit_end)){
-      p->cwd->ref++;  // Prevent inode->ref from being decremented one more time.
-      ret = PROCESS_KILL;
-    }
-  }
+  ret = af_decide(&log_af, fids, p->pid, 0, 0, ret);
+  if(ret == PROCESS_KILL)
+    p->cwd->ref++;  // Prevent inode->ref from being decremented one more time.
   release_recovery_lock(RL_FLAG_LOG);
 
   printf("end struct log recovery: %d\n", get_ticks());
@@ -72,32 +67,34 @@ recovery_handler_log(void* address, int pid, uint64 sp, uint64 s0)
   struct proc *p = search_proc_from_pid(pid);
   struct superblock sb;
   uint64 pcs[DEPTH];
+  int fids[DEPTH];
 
   if (sp == 0x0 || s0 - sp > PGSIZE) {
     getcallerpcs_bottom(pcs, sp, p->kstack, DEPTH);
   } else {
     getcallerpcs_top(pcs, sp, s0, DEPTH);
   }
+  pcs2funcids(pcs, fids, DEPTH);
 
   for (i = 0; i < DEPTH; i++) {
-    if(ISINSIDE(pcs[i], log_write_start, log_write_end)){
+    if(fids[i] == FN_log_write){
       if(recovery_mode == CONSERVATIVE)
         return FAIL_STOP;
       is_log_write = 1;
-    } else if(ISINSIDE(pcs[i], begin_op_start, begin_op_end)){
+    } else if(fids[i] == FN_begin_op){
       is_begin_op = 1;
-    } else if(ISINSIDE(pcs[i], end_op_start, end_op_end)){
+    } else if(fids[i] == FN_end_op){
       is_end_op = 1;
-    } else if(ISINSIDE(pcs[i], sys_chdir_start, sys_chdir_end)){
+    } else if(fids[i] == FN_sys_chdir){
       is_chdir = 1;
-    } else if(ISINSIDE(pcs[i], end_op_start, end_op_end) && is_chdir){
+    } else if(fids[i] == FN_end_op && is_chdir){
       printf("end struct log recovery: %d\n", get_ticks());
       return FAIL_STOP;
     }
 
     if(recovery_mode == CONSERVATIVE){
-      if(ISINSIDE(pcs[i], create_start, create_end) || (ISINSIDE(pcs[i], fileclose_start, fileclose_end) && is_begin_op) ||
-         ISINSIDE(pcs[i], sys_write_start, sys_write_end)){
+      if(fids[i] == FN_create || (fids[i] == FN_fileclose && is_begin_op) ||
+         fids[i] == FN_sys_write){
         return FAIL_STOP;
       }
     }
@@ -192,6 +189,6 @@ recovery_handler_log(void* address, int pid, uint64 sp, uint64 s0)
   /*
    * After-Treatment
    */
-  return after_treatment_log(pcs, p);
+  return after_treatment_log(fids, p);
 }
 
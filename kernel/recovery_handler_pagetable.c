@@ -11,6 +11,7 @@
 #include "log.h"
 #include "nmi.h"
 #include "after-treatment.h"
+#include "funcid.h"
 
 #define ENTRY_SIZE 512
 
@@ -19,47 +20,23 @@ extern struct log *log;
 extern struct ptdup_head ptdup_head[];
 extern pagetable_t idx_ptdup[];
 extern struct proc *proc;
+extern struct page_desc page_descs[];
 extern int recovery_mode;
 extern int dup_outstanding;
 
-extern uint64 begin_op_start, begin_op_end;
-extern uint64 clockintr_start, clockintr_end;
-extern uint64 consoleintr_start, consoleintr_end;
-extern uint64 freeproc_start, freeproc_end;
-extern uint64 kerneltrap_start, kerneltrap_end;
-extern uint64 kernelvec_start, kernelvec_end;
-extern uint64 kvminit_start, kvminit_end;
-extern uint64 nmivec_start, nmivec_end;
-extern uint64 pipewrite_start, pipewrite_end;
-extern uint64 sys_chdir_start, sys_chdir_end;
-extern uint64 sys_write_start, sys_write_end;
-extern uint64 uvmalloc_start, uvmalloc_end;
-extern uint64 uvmcopy_start, uvmcopy_end;
-extern uint64 uvmunmap_start, uvmunmap_end;
-extern uint64 virtio_disk_intr_start, virtio_disk_intr_end;
-extern uint64 walk_start, walk_end;
-extern uint64 writei_start, writei_end;
-
-// Search call stack & decide termination of this recovery handler
-static int
-check_all_fail_stop_cases(uint64 *pcs, int ret)
-{
-  for(int i = 0; i < DEPTH; i++){
-    if(ISINSIDE(pcs[i], freeproc_start, freeproc_end) || ISINSIDE(pcs[i], uvmunmap_start, uvmunmap_end)){
-      return FAIL_STOP;
-    } else if(recovery_mode == CONSERVATIVE && (ISINSIDE(pcs[i], uvmalloc_start, uvmalloc_end) ||
-              ISINSIDE(pcs[i], uvmcopy_start, uvmcopy_end) || ISINSIDE(pcs[i], sys_write_start, sys_write_end))){
-      return FAIL_STOP;
-    } else if(ISINSIDE(pcs[i], uvmalloc_start, uvmalloc_end)){
-      return PROCESS_KILL;
-    }
-  }
-
-  return ret;
-}
+// Call stacks which decide termination of this recovery handler before recovering.
+static const struct af_rule pagetable_fail_stop_rules[] = {
+  {FN_freeproc,  AF_ANY,       AF_ANY, AF_STOP, FAIL_STOP,    FN_NONE},
+  {FN_uvmunmap,  AF_ANY,       AF_ANY, AF_STOP, FAIL_STOP,    FN_NONE},
+  {FN_uvmalloc,  CONSERVATIVE, AF_ANY, AF_STOP, FAIL_STOP,    FN_NONE},
+  {FN_uvmcopy,   CONSERVATIVE, AF_ANY, AF_STOP, FAIL_STOP,    FN_NONE},
+  {FN_sys_write, CONSERVATIVE, AF_ANY, AF_STOP, FAIL_STOP,    FN_NONE},
+  {FN_uvmalloc,  AF_ANY,       AF_ANY, AF_STOP, PROCESS_KILL, FN_NONE},
+};
+static struct af_table pagetable_fail_stop_af = AF_TABLE(pagetable_fail_stop_rules);
 
 static int
-after_treatment_user_pagetable(uint64* pcs, int pid, uint64 sp, uint64 s0, int ret)
+after_treatment_user_pagetable(int *fids, int pid, uint64 sp, uint64 s0, int ret)
 { 
   if(ret == FAIL_STOP)
     return ret;
@@ -67,7 +44,7 @@ after_treatment_user_pagetable(uint64* pcs, int pid, uint64 sp, uint64 s0, int r
   int trap = identify_nmi_occurred_trap(pid, sp, s0);
 
   for(int i = 0; i < DEPTH; i++){
-    if(ISINSIDE(pcs[i], consoleintr_start, consoleintr_end) || ISINSIDE(pcs[i], clockintr_start, clockintr_end)){
+    if(fids[i] == FN_consoleintr || fids[i] == FN_clockintr){
       if(trap == USERTRAP){
         ret = PROCESS_KILL;
         break;
@@ -75,7 +52,7 @@ after_treatment_user_pagetable(uint64* pcs, int pid, uint64 sp, uint64 s0, int r
         ret = RETURN_TO_KERNEL;
         break;
       }
-    } else if(ISINSIDE(pcs[i], virtio_disk_intr_start, virtio_disk_intr_end)){
+    } else if(fids[i] == FN_virtio_disk_intr){
       if(trap == USERTRAP){
         ret = PROCESS_KILL;
         break;
@@ -83,8 +60,8 @@ after_treatment_user_pagetable(uint64* pcs, int pid, uint64 sp, uint64 s0, int r
         ret = FAIL_STOP;
         break;
       }
-    } else if(ISINSIDE(pcs[i], kernelvec_start, kernelvec_end) || ISINSIDE(pcs[i], nmivec_start, nmivec_end)){  // In the case of which the NMI is occurred in kerneltrap().
-      if(ISINSIDE(pcs[i+1], kerneltrap_start, kerneltrap_end)){
+    } else if(fids[i] == FN_kernelvec || fids[i] == FN_nmivec){  // In the case of which the NMI is occurred in kerneltrap().
+      if(fids[i+1] == FN_kerneltrap){
         ret = FAIL_STOP;
         break;
       }
@@ -97,6 +74,7 @@ after_treatment_user_pagetable(uint64* pcs, int pid, uint64 sp, uint64 s0, int r
 
 
 
+#ifndef PTDUP_EXTENT
 // Recovery L2_pagetable by using PTDUP.
 static int
 recovery_L2(int idx, void *address, pagetable_t new, struct proc *bp)
@@ -113,11 +91,8 @@ recovery_L2(int idx, void *address, pagetable_t new, struct proc *bp)
   bp->pagetable = new;  // Switching old pointer to new one.
   register_ptb_mlist(bp->pid, (uint64)new, 2);  // Register new pagetable to M-List.
 
-  for(int i = 0; i <= NPROC; i++){
-    if(idx_ptdup[i] == (pagetable_t)address){
-      idx_ptdup[i] = new;  // Update pagetable duplication index.
-    }
-  }
+  idx_ptdup[idx] = new;  // Update pagetable duplication index.
+  pa2desc(new)->ptdup = idx;
 
   return res;
 }
@@ -173,55 +148,44 @@ recovery_L1(int idx, void *address, pagetable_t new, struct proc *bp)
 
   return ret;
 }
+#endif
 
 
 // Reconstruct L0 pagetable from PageTable Direct Segment(PTDS)
 static int
 reconst_from_PTDS(int idx, pagetable_t new, uint64 sva)
 {
-  int num, res = 0, size;
-  uint64 start_va, eva = sva + 0x200000;
-  uint64 *p, *header = ptdup_head[idx].l0_ptds, ppn;
-
-  for(p = header; ; p = (uint64*)p[ENTRY_SIZE-1]){
-    for(int i = 0; i < ENTRY_SIZE-1; i++){
-      if(p[i] == 0x0 || p[i] == 0x0505050505050505)
-        continue;
-
+  int res = 0, size;
+  uint64 va, start_va, eva = sva + 0x200000;
+  uint64 *p, *dir = ptdup_head[idx].l0_ptds, ppn;
+
+  // PTDSs are sorted by their starting VA, so stop at the first one beyond the L0_pagetable.
+  for(int pi = 0; pi < (int)PTDUP_NUM(dir); pi++){
+    p = (uint64*)dir[pi];
+    for(int i = 0; i < (int)PTDUP_NUM(p); i++){
       start_va = PTDS2VA(p[i]);
+      if(eva <= start_va)
+        return res;
+      size = PTDS2SIZE(p[i]);
+      if(start_va + size * PGSIZE <= sva)
+        continue;
 
-      if(sva <= start_va && start_va <= eva){
-        // Reconstruct L0_pagetable's entries.
-        ppn = PTDS2PPN(p[i]);
-        num = PX(0, PTDS2VA(p[i]));
-        size = PTDS2SIZE(p[i]);
-        
-        if(PTDS2ORDER(p[i])){
-          for(int j = 0; j < size; j++, num++, ppn += 0x400){
-            if(new[num]){
-              printf("reconst_from_PTDS: Not an empty entry (initializing is failed): %d, %p\n", num, new[num]);
-              res = -1;
-            } else {
-              // Restore PPN, User, eXecutable, Writable, Readable and Valid flags, but other flags don't.
-              // Because these four flags is common among User pages.
-              new[num] = ppn | PTDS2UB(p[i]) | PTE_D | PTE_X | PTE_W | PTE_R | PTE_V;
-            }
-          }
-        } else if(!PTDS2ORDER(p[i])){
-          for(int j = 0; j < size; j++, num++, ppn -= 0x400){
-            if(new[num]){
-              printf("reconst_from_PTDS: Not an empty entry (initializing is failed): %d, %p\n", num, new[num]);
-              res = -1;
-            } else {
-              new[num] = ppn | PTDS2UB(p[i]) | PTE_D | PTE_X | PTE_W | PTE_R | PTE_V;
-            }
-          }
+      // Reconstruct L0_pagetable's entries, only of the part of the PTDS in the L0_pagetable.
+      ppn = PTDS2PPN(p[i]);
+      for(int j = 0; j < size; j++, ppn = PTDS2ORDER(p[i]) ? ppn + 0x400 : ppn - 0x400){
+        va = start_va + j * PGSIZE;
+        if(va < sva || eva <= va)
+          continue;
+        if(new[PX(0, va)]){
+          printf("reconst_from_PTDS: Not an empty entry (initializing is failed): %d, %p\n", PX(0, va), new[PX(0, va)]);
+          res = -1;
+        } else {
+          // Restore PPN, User, Copy-on-write, eXecutable, Writable, Readable and Valid flags, but other flags don't.
+          // Because these flags is common among User pages, but Writable is cleared for copy-on-write.
+          new[PX(0, va)] = ppn | PTDS2FLAGS(p[i]) | PTE_D | PTE_V;
         }
       }
     }
-
-    if((uint64*)p[ENTRY_SIZE-1] == header)
-      break;
   }
 
   return res;
@@ -233,34 +197,191 @@ static int
 reconst_from_PTED(int idx, pagetable_t new, uint64 sva)
 {
   uint64 va, eva = sva + 0x200000;
-  uint64 *p, *header = ptdup_head[idx].l0_pted;
+  uint64 *p, *dir = ptdup_head[idx].l0_pted;
   int res = 0;
 
-  for(p = header; ; p = (uint64*)p[ENTRY_SIZE-1]){
-    for(int i = 0; i < ENTRY_SIZE-1; i++){
-      if(p[i] == 0x0 || p[i] == 0x0505050505050505)
+  // PTEDs are sorted by VA.
+  for(int pi = 0; pi < (int)PTDUP_NUM(dir); pi++){
+    p = (uint64*)dir[pi];
+    for(int i = 0; i < (int)PTDUP_NUM(p); i++){
+      va = PTED2VA(p[i]);
+      if(eva <= va)
+        return res;
+      if(va < sva)
         continue;
 
-      va = PTED2VA(p[i]);
+      if(new[PX(0, va)]){
+        printf("reconst_from_PTED: Not Empty entry (Overwriting): %d, %p, %p, %d\n", PX(0, va), new[PX(0, va)], p[i], i);
+        res = -1;
+      } else { // Reconstruct L0_pagetable's entries.
+        new[PX(0, va)] = PTED2PPN(p[i]) | PTE_D | PTED2FLAGS(p[i]) | PTE_V;
+      }
+    }
+  }
 
-      if(sva <= va && va < eva){
-        if(new[PX(0, va)]){
-          printf("reconst_from_PTED: Not Empty entry (Overwriting): %d, %p, %p, %d\n", PX(0, va), new[PX(0, va)], p[i], i);
-          res = -1;
-        } else { // Reconstruct L0_pagetable's entries.
-          new[PX(0, va)] = PTED2PPN(p[i]) | PTE_D | PTED2FLAGS(p[i]) | PTE_V;
-        }
+  return res;
+}
+
+
+#ifdef PTDUP_EXTENT
+// Rebuild pagetable of the level mapping from va by the PTDS and PTED lists,
+// allocating the page tables below it anew.
+static int
+rebuild_from_lists(int idx, pagetable_t pagetable, int level, uint64 va, struct proc *bp)
+{
+  uint64 span = 1L << PXSHIFT(level);  // Size mapped by an entry.
+  pagetable_t child;
+
+  if(level == 0)
+    return (reconst_from_PTDS(idx, pagetable, va) || reconst_from_PTED(idx, pagetable, va)) ? -1 : 0;
+
+  for(int i = 0; i < ENTRY_SIZE && va + i * span < MAXVA; i++){
+    if(!ptdup_mapped(idx, va + i * span, va + (i + 1) * span))
+      continue;
+    if((child = (pagetable_t)kalloc()) == 0x0)
+      return -1;  // The caller frees what has been rebuilt and kills the process.
+    memset(child, 0, PGSIZE);
+    pagetable[i] = PA2PTE(child) | PTE_V;
+    register_ptb_mlist(bp->pid, (uint64)child, level - 1);
+    if(rebuild_from_lists(idx, child, level - 1, va + i * span, bp) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+
+// Free pagetable of the level built by rebuild_from_lists() and the page tables below it,
+// but not the user pages which they map.
+static void
+free_rebuilt(pagetable_t pagetable, int level)
+{
+  if(level > 0){
+    for(int i = 0; i < ENTRY_SIZE; i++)
+      if(pagetable[i] & PTE_V)
+        free_rebuilt((pagetable_t)PTE2PA(pagetable[i]), level - 1);
+  }
+  delete_ptb_mlist((uint64)pagetable);
+  kfree((void*)pagetable);
+}
+
+
+// Find the entry pointing to the broken L1/L0_pagetable at address in the page table of bp,
+// and the VA it maps from. The broken page itself is not read.
+static pte_t*
+find_broken_entry(struct proc *bp, int level, void *address, uint64 *va)
+{
+  pagetable_t L1_pagetable;
+
+  for(int i = 0; i < ENTRY_SIZE; i++){
+    if((bp->pagetable[i] & PTE_V) == 0)
+      continue;
+    if(level == 1){
+      if((uint64)address == PTE2PA(bp->pagetable[i])){
+        *va = (uint64)i << PXSHIFT(2);
+        return &bp->pagetable[i];
       }
+      continue;
     }
 
-    if((uint64*)p[ENTRY_SIZE-1] == header)
-      break;
+    L1_pagetable = (pagetable_t)PTE2PA(bp->pagetable[i]);
+    for(int j = 0; j < ENTRY_SIZE; j++){
+      if((L1_pagetable[j] & PTE_V) && (uint64)address == PTE2PA(L1_pagetable[j])){
+        *va = ((uint64)i << PXSHIFT(2)) | ((uint64)j << PXSHIFT(1));
+        return &L1_pagetable[j];
+      }
+    }
   }
+  return 0x0;
+}
 
-  return res;
+
+// Whether pagetable of the L2_pagetable is reachable from it.
+static int
+is_reachable_ptb(pagetable_t L2_pagetable, uint64 pagetable)
+{
+  pagetable_t L1_pagetable;
+
+  for(int i = 0; i < ENTRY_SIZE; i++){
+    if((L2_pagetable[i] & PTE_V) == 0)
+      continue;
+    if(PTE2PA(L2_pagetable[i]) == pagetable)
+      return 1;
+    L1_pagetable = (pagetable_t)PTE2PA(L2_pagetable[i]);
+    for(int j = 0; j < ENTRY_SIZE; j++)
+      if((L1_pagetable[j] & PTE_V) && PTE2PA(L1_pagetable[j]) == pagetable)
+        return 1;
+  }
+  return 0;
 }
 
 
+// Free the page tables below the broken one at address, which can't be reached after rebuilding.
+// They are found by the page descriptors, as the pages of bp lower than level
+// which no page table of bp (including the one being built by exec()) reaches.
+static void
+free_unreachable_ptbs(struct proc *bp, void *address, int level)
+{
+  uint64 pa;
+  int i, reachable;
+
+  for(int k = 0; k < NPAGEDESC; k++){
+    if(page_descs[k].state != PG_PTB || page_descs[k].pid != bp->pid || page_descs[k].level >= level)
+      continue;
+    pa = KERNBASE + (uint64)k * PGSIZE;
+    if(pa == (uint64)address)
+      continue;
+
+    reachable = 0;
+    for(i = 0; i < PTDUP_SIZE && !reachable; i++){
+      if(idx_ptdup[i] != 0x0 && pa2desc(idx_ptdup[i])->pid == bp->pid)
+        reachable = is_reachable_ptb(idx_ptdup[i], pa);
+    }
+    if(!reachable){
+      delete_ptb_mlist(pa);
+      kfree((void*)pa);
+    }
+  }
+}
+
+
+// Recovery a page table of any level by rebuilding it from the PTDS and PTED lists.
+static int
+recovery_from_lists(int level, int idx, void *address, pagetable_t new, struct proc *bp)
+{
+  int ret = (is_enable_user_coop(bp->pid)) ? SYSCALL_REDO : SYSCALL_FAIL;
+  pte_t *pte = 0x0;
+  uint64 va = 0x0;
+
+  if(level < 2 && (pte = find_broken_entry(bp, level, address, &va)) == 0x0){
+    printf("recovery_from_lists: can't find the broken pagetable (pid: %d, addr: %p).\n", bp->pid, address);
+    kfree((void*)new);
+    return (recovery_mode == CONSERVATIVE) ? FAIL_STOP : PROCESS_KILL;
+  }
+
+  if(rebuild_from_lists(idx, new, level, va, bp) < 0){
+    printf("recovery_from_lists: reconstruction pagetable is failed (pid: %d, addr: %p).\n", bp->pid, address);
+    free_rebuilt(new, level);
+    return PROCESS_KILL;
+  }
+
+  // Switch the broken pagetable to new.
+  register_ptb_mlist(bp->pid, (uint64)new, level);
+  if(level == 2){
+    bp->pagetable = new;
+    idx_ptdup[idx] = new;  // Update pagetable duplication index.
+    pa2desc(new)->ptdup = idx;
+  } else {
+    *pte = PA2PTE(new) | PTE_V;
+  }
+
+  if(level > 0)
+    free_unreachable_ptbs(bp, address, level);
+  return ret;
+}
+#endif
+
+
+#ifndef PTDUP_EXTENT
 // Recovery L0_pagetable by using PTDS & PTED.
 static int
 recovery_L0(int idx, void *address, pagetable_t new, struct proc *bp)
@@ -310,6 +431,7 @@ recovery_L0(int idx, void *address, pagetable_t new, struct proc *bp)
 
   return ret;
 }
+#endif
 
 
 // Recovery handler of all layers page tables.
@@ -323,17 +445,23 @@ recovery_handler_pagetable(int level, int idx, struct proc *bp, void *address, u
   int pid = bp->pid;
   pagetable_t new = (pagetable_t)kalloc();
   uint64 pcs[DEPTH];
+  int fids[DEPTH];
 
   // Search call stack & check Fail-Stop situation.
   if(sp == 0x0 || s0 - sp > PGSIZE)  // In the case of invalid s0 or sp is passed.
     getcallerpcs_bottom(pcs, sp, bp->kstack, DEPTH);
   else
     getcallerpcs_top(pcs, sp, s0, DEPTH);
+  pcs2funcids(pcs, fids, DEPTH);
 
-  if((ret = check_all_fail_stop_cases(pcs, ret)) == FAIL_STOP)
+  if((ret = af_decide(&pagetable_fail_stop_af, fids, pid, sp, s0, ret)) == FAIL_STOP)
     goto ret;
 
+#ifdef PTDUP_EXTENT
+  if(ptdup_head[idx].l0_pted == 0x0){  // PTDTP is not ready.
+#else
   if(ptdup_head[idx].l2 == 0x0){  // PTDTP is not ready.
+#endif
     kfree(new);
     new = 0x0;
 
@@ -351,6 +479,14 @@ recovery_handler_pagetable(int level, int idx, struct proc *bp, void *address, u
   new = memset(new, 0, PGSIZE);  // Fill allocated page with 0.
 
   // Reconstruct & switching broken pagetable to new.
+#ifdef PTDUP_EXTENT
+  if(level < 0 || level > 2){
+    printf("recovery_handler_pagetable: Invalid pagetable level(%d) was passed (pid: %d, addr :%p).\n", level, bp->pid, address);
+    ret = -1;
+  } else {
+    ret = recovery_from_lists(level, idx, address, new, bp);
+  }
+#else
   switch(level){
     case 2:
       recovery_L2(idx, address, new, bp);
@@ -370,6 +506,7 @@ recovery_handler_pagetable(int level, int idx, struct proc *bp, void *address, u
       ret = -1;
       break;
   }
+#endif
 
 
 ret:
@@ -397,5 +534,5 @@ ret:
   check_all_locks(myproc()->pid);
 
   exit_rcs_after_recovery(pid, 0);
-  return after_treatment_user_pagetable(pcs, pid, sp, s0, ret);
+  return after_treatment_user_pagetable(fids, pid, sp, s0, ret);
 }
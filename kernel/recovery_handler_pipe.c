@@ -14,6 +14,7 @@
 #include "nmi.h"
 #include "recovery_locking.h"
 #include "after-treatment.h"
+#include "funcid.h"
 
 
 extern int recovery_mode;
@@ -23,10 +24,14 @@ extern struct ftable *ftable;
 extern struct proc proc[];
 extern void (*handler_for_mem_fault)(char*);  // Function which is called from NMI handler.
 
-extern uint64 exit_start, exit_end;
-extern uint64 sys_close_start, sys_close_end;
-extern uint64 sys_pipe_start, sys_pipe_end;
 
+// struct pipe's After-Treatment rules.
+static const struct af_rule pipe_rules[] = {
+  {FN_exit,      AF_ANY, AF_ANY, AF_SET, PROCESS_KILL,    FN_NONE},
+  {FN_sys_close, AF_ANY, AF_ANY, AF_SET, SYSCALL_SUCCESS, FN_NONE},
+  {FN_sys_pipe,  AF_ANY, ENABLE, AF_SET, SYSCALL_REDO,    FN_NONE},
+};
+static struct af_table pipe_af = AF_TABLE(pipe_rules);
 
 // Determine the way of termination of recovery handler.
 static int
@@ -34,6 +39,7 @@ after_treatment_pipe(uint64 sp, uint64 s0, int pid, struct pipe *new, struct fil
 {
   int ret = SYSCALL_FAIL;
   uint64 pcs[DEPTH];
+  int fids[DEPTH];
 
   // Search call stack & check Fail-Stop situation.
   if(sp == 0x0 || s0 - sp > PGSIZE){  // In the case of invalid s0 or sp is passed.
@@ -41,20 +47,13 @@ after_treatment_pipe(uint64 sp, uint64 s0, int pid, struct pipe *new, struct fil
   } else {
     getcallerpcs_top(pcs, sp, s0, DEPTH);
   }
+  pcs2funcids(pcs, fids, DEPTH);
 
-  for(int i = 0; i < DEPTH; i++){
-    if(ISINSIDE(pcs[i], exit_start, exit_end)){
-      ret = PROCESS_KILL;
-      if (file != 0x0 && file->ref == 0) {
-        acquire(&ftable->lock);
-        file->ref++;
-        release(&ftable->lock);
-      }
-    } else if(ISINSIDE(pcs[i], sys_close_start, sys_close_end)){
-      ret = SYSCALL_SUCCESS;
-    } else if(is_enable_user_coop(pid) && ISINSIDE(pcs[i], sys_pipe_start, sys_pipe_end)){
-      ret = SYSCALL_REDO;
-    }
+  ret = af_decide(&pipe_af, fids, pid, sp, s0, ret);
+  if(ret == PROCESS_KILL && file != 0x0 && file->ref == 0){
+    acquire(&ftable->lock);
+    file->ref++;
+    release(&ftable->lock);
   }
   if(holding(&new->lock))
     release(&new->lock);
@@ -87,6 +86,8 @@ int recovery_handler_pipe(void* address, int pid, uint64 sp, uint64 s0){
 
   delete_memobj((void*)address, mlist.pip_list, 0x0);
   register_memobj((void*)new, mlist.pip_list);
+  set_page_state(address, PG_ISOLATED);
+  set_page_state(new, PG_PIPE);
 
   /*
    * Solve-Inconsistency
@@ -16,8 +16,10 @@
 #include "log.h"
 #include "recovery_locking.h"
 #include "after-treatment.h"
+#include "funcid.h"
 
 extern struct mlist_header mlist;
+extern struct page_desc page_descs[];
 extern char data[];
 extern pagetable_t *idx_ptdup;
 extern struct kmem *kmem;
@@ -28,24 +30,27 @@ extern struct ftable *ftable;
 extern struct spinlock idx_lock;
 extern int recovery_mode;
 
-extern uint64 allocproc_start, allocproc_end;
-extern uint64 exit_start, exit_end;
-extern uint64 freeproc_start, freeproc_end;
-extern uint64 kvminit_start, kvminit_end;
-extern uint64 procinit_start, procinit_end;
-extern uint64 pipealloc_start, pipealloc_end;
-extern uint64 sys_close_start, sys_close_end;
-extern uint64 sys_exec_start, sys_exec_end;
-extern uint64 sys_sbrk_start, sys_sbrk_end;
-extern uint64 uvmalloc_start, uvmalloc_end;
-extern uint64 uvmcopy_start, uvmcopy_end;
-extern uint64 uvmunmap_start, uvmunmap_end;
 
+// struct kmem & run's After-Treatment rules.
+static const struct af_rule kmem_rules[] = {
+  {FN_freeproc,  AF_ANY,       AF_ANY, AF_STOP, FAIL_STOP,       FN_NONE},
+  {FN_kvminit,   AF_ANY,       AF_ANY, AF_STOP, FAIL_STOP,       FN_NONE},
+  {FN_procinit,  AF_ANY,       AF_ANY, AF_STOP, FAIL_STOP,       FN_NONE},
+  {FN_uvmunmap,  AF_ANY,       AF_ANY, AF_STOP, FAIL_STOP,       FN_NONE},
+  {FN_sys_exec,  CONSERVATIVE, AF_ANY, AF_STOP, FAIL_STOP,       FN_NONE},
+  {FN_uvmalloc,  CONSERVATIVE, AF_ANY, AF_STOP, FAIL_STOP,       FN_NONE},
+  {FN_uvmcopy,   CONSERVATIVE, AF_ANY, AF_STOP, FAIL_STOP,       FN_NONE},
+  {FN_exit,      AF_ANY,       AF_ANY, AF_SET,  PROCESS_KILL,    FN_NONE},
+  {FN_uvmalloc,  AF_ANY,       AF_ANY, AF_SET,  PROCESS_KILL,    FN_NONE},
+  {FN_sys_close, AF_ANY,       AF_ANY, AF_SET,  SYSCALL_SUCCESS, FN_NONE},
+};
+static struct af_table kmem_af = AF_TABLE(kmem_rules);
 
 // struct kmem & run's After-Treatments.
 static int after_treatment(int pid, uint64 sp, uint64 s0){
   int i, ret = (is_enable_user_coop(pid)) ? SYSCALL_REDO : SYSCALL_FAIL;
   uint64 pcs[DEPTH];
+  int fids[DEPTH];
 
   if(sp == 0x0 || s0 - sp > PGSIZE){
     struct proc *p = search_proc_from_pid(pid);
@@ -53,10 +58,14 @@ static int after_treatment(int pid, uint64 sp, uint64 s0){
   } else {
     getcallerpcs_top(pcs, sp, s0, DEPTH);
   }
+  pcs2funcids(pcs, fids, DEPTH);
 
   // Check After-Treatment conditions.
+  // The side effects below are also done before Fail-Stop.
+  ret = af_decide(&kmem_af, fids, pid, sp, s0, ret);
+
   for(i = 0; i < DEPTH; i++){
-    if(pipealloc_start < pcs[i] && pcs[i] < pipealloc_end){
+    if(fids[i] == FN_pipealloc){
       // If pipealloc() exists, cancel pipe operation & close the files.
       for(struct file *fp = ftable->file; fp < ftable->file + NFILE; fp++){
         if(fp->type == FD_PIPE)
@@ -64,22 +73,7 @@ static int after_treatment(int pid, uint64 sp, uint64 s0){
       }
     }
 
-    if(ISINSIDE(pcs[i], freeproc_start, freeproc_end) || ISINSIDE(pcs[i], kvminit_start, kvminit_end)
-    || ISINSIDE(pcs[i], procinit_start, procinit_end) || ISINSIDE(pcs[i], uvmunmap_start, uvmunmap_end))
-      return FAIL_STOP;
-
-    if(recovery_mode == CONSERVATIVE)
-      if(ISINSIDE(pcs[i], sys_exec_start, sys_exec_end) || ISINSIDE(pcs[i], uvmalloc_start, uvmalloc_end)
-      || ISINSIDE(pcs[i], uvmcopy_start, uvmcopy_end))
-        return FAIL_STOP;
-
-    if(ISINSIDE(pcs[i], exit_start, exit_end) || ISINSIDE(pcs[i], uvmalloc_start, uvmalloc_end))
-      ret = PROCESS_KILL;
-
-    if(ISINSIDE(pcs[i], sys_close_start, sys_close_end))
-      ret = SYSCALL_SUCCESS;
-
-    if(ISINSIDE(pcs[i], sys_sbrk_start, sys_sbrk_end)){
+    if(fids[i] == FN_sys_sbrk){
       if(log->outstanding){
         acquire(&log->lock);
         if(log->outstanding > 1)
@@ -89,6 +83,8 @@ static int after_treatment(int pid, uint64 sp, uint64 s0){
       }
     }
   }
+  if(ret == FAIL_STOP)
+    return FAIL_STOP;
 
   // Check transaction conditions.
   if(check_and_handle_trans_pagetable(pid) > 0 && ret == SYSCALL_FAIL){
@@ -109,22 +105,73 @@ static int after_treatment(int pid, uint64 sp, uint64 s0){
 }
 
 
+// Rebuild the Free-List from the pages marked as free in page_descs[].
+// The list is in descending order of address as kinit() makes it.
+// The number of its pages is stored in *n.
+static struct run*
+rebuild_freelist(int *n)
+{
+  struct run *freelist = 0x0, *r;
+
+  *n = 0;
+  for(int i = 0; i < NPAGEDESC; i++){
+    if(page_descs[i].state != PG_FREE)
+      continue;
+    r = (struct run*)(KERNBASE + (uint64)i * PGSIZE);
+    r->next = freelist;
+    freelist = r;
+    (*n)++;
+  }
+  return freelist;
+}
+
+// Rebuild the per-CPU page caches of k from the pages marked as cached in page_descs[].
+static void
+rebuild_mags(struct kmem *k)
+{
+  struct run *r;
+  struct kmag *m;
+
+  for(int i = 0; i < NCPU; i++){
+    k->mag[i].head = 0x0;
+    k->mag[i].n = 0;
+  }
+  for(int i = 0; i < NPAGEDESC; i++){
+    if(page_descs[i].state != PG_CACHED)
+      continue;
+    r = (struct run*)(KERNBASE + (uint64)i * PGSIZE);
+    m = &k->mag[page_descs[i].level];
+    r->next = m->head;
+    m->head = r;
+    m->n++;
+  }
+}
+
+
 int recovery_handler_kmem(void* broken, int pid, uint64 sp, uint64 s0){
   printf("start struct kmem recovery: %d\n", get_ticks());
   acquire_recovery_lock(RL_FLAG_KMEM);
 
-  struct kmem *new = (struct kmem*)mlist.run_list->next->addr;
+  int nfree;
+  struct run *freelist = rebuild_freelist(&nfree);
+  struct kmem *new = (struct kmem*)freelist;
 
   // Internal Surgery
   // In recovery_handler_kmem, we can't use kalloc() and my_kalloc().
   // So we have to allocate new page with our own hands.
   if(!new)
     panic("recovery_handler_kmem: memory page allocation failed.");
-  delete_memobj((void*)new, mlist.run_list, 0x0);
+  freelist = freelist->next;
+  nfree--;
+  set_page_state(new, PG_KOBJ);
 
   recovery_handler_spinlock("kmem", &new->lock, broken);
+  for(int i = 0; i < NCPU; i++)
+    initlock(&new->mag[i].lock, "kmag");
   acquire(&new->lock);
-  new->freelist = (struct run*)mlist.run_list->next->next->addr;  // Assign address of run_list's node instead of broken kmem.
+  new->freelist = freelist;  // The Free-List is rebuilt instead of the broken kmem's one.
+  new->nfree = nfree;
+  rebuild_mags(new);         // So are the per-CPU page caches.
 
   delete_memobj(broken, mlist.kmm_list, 0x0);
   if(__sync_lock_test_and_set(&kmem, new));  // Assign new kmem pointer to kmem in atomic.
@@ -140,36 +187,22 @@ int recovery_handler_kmem(void* broken, int pid, uint64 sp, uint64 s0){
 
 int recovery_handler_run(void *broken, int pid, uint64 sp, uint64 s0){
   printf("start struct run recovery: %d\n", get_ticks());
-  struct mlist_node *bdnode, *dnode = 0;
-  struct run *r = 0x0;
   acquire_recovery_lock(RL_FLAG_KMEM);
 
   // Internal Surgery
-  // Identify the previous run node of the broken node.
-  for(bdnode = mlist.run_list; bdnode->next != mlist.run_list; bdnode = bdnode->next){
-    if(bdnode->next->addr == broken){
-      dnode = bdnode->next;
-      bdnode->next = dnode->next;
-
-      if(bdnode != mlist.run_list){
-        r = (struct run*)bdnode->addr;
-        r->next = (struct run*)dnode->next->addr;
-      } else {
-        r = (struct run*)bdnode->next->addr;
-        r->next = (struct run*)bdnode->next->next->addr;
-      }
-
-      dnode->addr = (void*)0x1010101;
-      dnode->next = (void*)0x1010101;
-      break;
-    }
-  }
-
-  // kmem->lock is already acquired because when memory error in run is discovered,
-  // the process wants to alloc a page and has to acquire kmem->lock.
-  kmem->freelist = r;
+  // Isolate the broken page and rebuild the Free-List and the per-CPU page caches without it,
+  // since the broken run may be in either of them.
+  // kmem->lock may be already acquired because when memory error in run is discovered,
+  // the process may be moving pages between the Free-List and its page cache.
+  set_page_state(broken, PG_ISOLATED);
+  kmem->freelist = rebuild_freelist(&kmem->nfree);
+  rebuild_mags(kmem);
   if(holding(&kmem->lock))
     release(&kmem->lock);
+  for(int i = 0; i < NCPU; i++){
+    if(holding(&kmem->mag[i].lock))
+      release(&kmem->mag[i].lock);
+  }
   printf("strcut run recovery completes.\n");
 
   // After-Treatment
@@ -16,6 +16,7 @@
 #include "console.h"
 #include "recovery_locking.h"
 #include "after-treatment.h"
+#include "funcid.h"
 
 
 extern struct mlist_header mlist;
@@ -26,27 +27,27 @@ extern struct icache *icache;
 extern struct pr *pr;
 extern int recovery_mode;
 
-extern uint64 consoleintr_start, consoleintr_end;
-extern uint64 kerneltrap_start, kerneltrap_end;
-extern uint64 panic_start, panic_end;
+// struct cons's and pr's After-Treatment rules.
+static const struct af_rule cons_rules[] = {
+  {FN_consoleintr, AF_ANY, AF_ANY, AF_SET, AF_TRAP, FN_NONE},
+};
+static struct af_table cons_af = AF_TABLE(cons_rules);
+
+static const struct af_rule pr_rules[] = {
+  {FN_panic,       AF_ANY, AF_ANY, AF_SET, FAIL_STOP, FN_NONE},
+  {FN_consoleintr, AF_ANY, AF_ANY, AF_SET, AF_TRAP,   FN_NONE},
+};
+static struct af_table pr_af = AF_TABLE(pr_rules);
 
 /*
  * struct cons's recovery handling.
  */
 static int
-after_treatment_cons(uint64 *pcs, int pid, uint64 sp, uint64 s0)
+after_treatment_cons(int *fids, int pid, uint64 sp, uint64 s0)
 {
   int ret = (is_enable_user_coop(pid) == ENABLE) ? SYSCALL_REDO : SYSCALL_FAIL;
 
-  for(int i = 0; i < DEPTH; i++){
-    if(ISINSIDE(pcs[i], consoleintr_start, consoleintr_end)){
-      int trap = identify_nmi_occurred_trap(pid, sp, s0);
-      if(trap == USERTRAP)
-        ret = RETURN_TO_USER;
-      else if(trap == KERNELTRAP)
-        ret = RETURN_TO_KERNEL;
-    }
-  }
+  ret = af_decide(&cons_af, fids, pid, sp, s0, ret);
   release_recovery_lock(RL_FLAG_CONS);  // Invalidate R.C.S.
 
   if(ret == RETURN_TO_KERNEL)
@@ -66,6 +67,8 @@ recovery_handler_cons(void* address, int pid, uint64 sp, uint64 s0)
   acquire_recovery_lock(RL_FLAG_CONS);  // Validate R.C.S.
 
   uint64 pcs[DEPTH];
+
+  int fids[DEPTH];
   struct cons *new = (struct cons*)my_kalloc(0, 0);
 
   if(check_and_count_procs_in_rcs(RL_FLAG_CONS, 0x0) > 1){
@@ -82,6 +85,7 @@ recovery_handler_cons(void* address, int pid, uint64 sp, uint64 s0)
   } else {
     getcallerpcs_top(pcs, sp, s0, DEPTH);
   }
+  pcs2funcids(pcs, fids, DEPTH);
 
   delete_memobj(address, mlist.con_list, 0x0);  // Delete broken node from address list.
   register_memobj(new, mlist.con_list);  // Register new node to address list.
@@ -94,7 +98,7 @@ recovery_handler_cons(void* address, int pid, uint64 sp, uint64 s0)
   while(mycpu()->noff > 1)
     pop_off();  // Decrement noff of broken spinlock in old cons.
   printf("struct cons recovery is completed.(%p)\n", cons);
-  return after_treatment_cons(pcs, pid, sp, s0);
+  return after_treatment_cons(fids, pid, sp, s0);
 }
 
 /*
@@ -139,22 +143,13 @@ recovery_handler_devsw(void* address, int pid)
  * struct pr's recovery handling.
  */
 static int
-after_treatment_pr(uint64 *pcs, int pid, uint64 sp, uint64 s0)
+after_treatment_pr(int *fids, int pid, uint64 sp, uint64 s0)
 {
-  int ret = PROCESS_KILL;
+  int ret = af_decide(&pr_af, fids, pid, sp, s0, PROCESS_KILL);
 
   for(int i = 0; i < DEPTH; i++){
-    if(ISINSIDE(pcs[i], panic_start, panic_end)){
-      pr->locking = 0;
-      ret = FAIL_STOP;
-    }
-    else if(ISINSIDE(pcs[i], consoleintr_start, consoleintr_end)){
-      int trap = identify_nmi_occurred_trap(pid, sp, s0);
-      if(trap == USERTRAP)
-        ret =  RETURN_TO_USER;
-      else if(trap == KERNELTRAP)
-        ret = RETURN_TO_KERNEL;
-    }
+    if(fids[i] == FN_panic)
+      pr->locking = 0;  // Let panic() print, even if the policy is decided by an outer frame.
   }
 
   if(ret == RETURN_TO_KERNEL)
@@ -173,6 +168,8 @@ recovery_handler_pr(void* address, int pid, uint64 sp, uint64 s0)
   acquire_recovery_lock(RL_FLAG_PR);  // Validate R.C.S.
 
   uint64 pcs[DEPTH];
+
+  int fids[DEPTH];
   struct pr *new_pr = (struct pr*)my_kalloc(0, 0);
 
   if(check_and_count_procs_in_rcs(RL_FLAG_PR, 0x0) > 1){
@@ -189,6 +186,7 @@ recovery_handler_pr(void* address, int pid, uint64 sp, uint64 s0)
   } else {
     getcallerpcs_top(pcs, sp, s0, DEPTH);
   }
+  pcs2funcids(pcs, fids, DEPTH);
 
   delete_memobj(address, mlist.pr_list, 0x0);  // Delete broken node from address list.
   register_memobj(new_pr, mlist.pr_list);  // Register new node to address list.
@@ -201,5 +199,5 @@ recovery_handler_pr(void* address, int pid, uint64 sp, uint64 s0)
   while(mycpu()->noff > 1) pop_off(); 
 
   release_recovery_lock(RL_FLAG_PR);  // Invalidate R.C.S.
-  return after_treatment_pr(pcs, pid, sp, s0);
+  return after_treatment_pr(fids, pid, sp, s0);
 }
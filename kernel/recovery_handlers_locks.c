@@ -10,14 +10,13 @@
 #include "memlayout.h"
 #include "nmi.h"
 #include "after-treatment.h"
+#include "funcid.h"
 
 extern int recovery_mode;
 extern struct mlist_header mlist;
 extern struct spinlock *pid_lock;
 extern struct spinlock *tickslock;
 
-extern uint64 clockintr_start, clockintr_end;
-
 extern void (*handler_for_mem_fault)(char*);  // Function which is called from NMI handler.
 
 /*
@@ -78,11 +77,18 @@ recovery_handler_pid_lock(void* broken, int pid)
 /*
  * Timer Interrupt
  */
+static const struct af_rule tickslock_rules[] = {
+  {FN_clockintr, AF_ANY, AF_ANY, AF_STOP, AF_TRAP, FN_NONE},
+};
+static struct af_table tickslock_af = AF_TABLE(tickslock_rules);
+
 static int
 after_treatment_tickslock(int pid, uint64 sp, uint64 s0)
 {
+  int ret;
   struct proc *p;
   uint64 pcs[DEPTH];
+  int fids[DEPTH];
 
   // Search call stack.
   if(sp == 0x0 || s0 - sp > PGSIZE){
@@ -91,23 +97,13 @@ after_treatment_tickslock(int pid, uint64 sp, uint64 s0)
   } else {
     getcallerpcs_top(pcs, sp, s0, DEPTH);
   }
+  pcs2funcids(pcs, fids, DEPTH);
 
-  for(int i = 0; i < DEPTH; i++){
-    if(ISINSIDE(pcs[i], clockintr_start, clockintr_end)){
-      int trap = identify_nmi_occurred_trap(pid, sp, s0);
-
-      if(trap == USERTRAP){
-        printf("end recovery_handler_ticklock: %d\n", get_ticks());
-        return RETURN_TO_USER;
-      } else if(trap == KERNELTRAP){
-        printf("end recovery_handler_ticklock: %d\n", get_ticks());
-        return RETURN_TO_KERNEL;
-      }
-    }
-  }
+  ret = (is_enable_user_coop(pid) == ENABLE) ? SYSCALL_REDO : SYSCALL_FAIL;
+  ret = af_decide(&tickslock_af, fids, pid, sp, s0, ret);
 
   printf("end recovery_handler_ticklock: %d\n", get_ticks());
-  return (is_enable_user_coop(pid) == ENABLE) ? SYSCALL_REDO : SYSCALL_FAIL;
+  return ret;
 }
 
 int
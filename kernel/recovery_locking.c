@@ -18,15 +18,15 @@
 extern struct bcache bcache;
 extern struct ftable *ftable;
 extern struct icache *icache;
-extern struct nmi_info *nmi_queue;
 extern struct proc proc[];
-extern struct spinlock nmi_queue_lock;
 
 struct recovery_lock recovery_locks[RL_NFLAGS];
+struct rcs_cpu rcs_cpus[NCPU];  // Per-CPU R.C.S counts.
+int rl_held;  // The number of Recovery Locks held now. 0 lets R.C.S entrances skip the recovery locks.
 struct recovery_lock_idx buf_idx[NBUF];  // Index of struct buf nodes to flag, Read-Only.
-struct recovery_lock_idx file_idx[NFILE];  // Index of struct file nodes to flag, Read-Only.
-struct recovery_lock_idx inode_idx[NINODE];  // Index of struct inode nodes to flag, Read-Only.
-struct proc_rcs_info rcs_infos[NPROC];   // R.C.S informations of each procs.
+int buf_replaced;  // The number of buf_idx[] entries whose buf was replaced out of bcache.buf[].
+struct file *file_base;    // ftable->file[] which file flags are derived from.
+struct inode *inode_base;  // icache->inode[] which inode flags are derived from.
 
 
 int
@@ -42,14 +42,18 @@ locking(struct spinlock *lk)
 }
 
 void
-init_rcs_infos(int pid)
+init_rcs_infos(struct proc *p)
 {
-  for(int i = 0; i < NPROC; i++){
-    if(rcs_infos[i].pid == 0){
-      rcs_infos[i].pid = pid;
-      break;
-    }
-  }
+  memset(&p->rcs, 0, sizeof(p->rcs));
+}
+
+// R.C.S nesting history of the process pid.
+static struct proc_rcs_info*
+search_rcs_info(int pid)
+{
+  struct proc *p = search_proc_from_pid(pid);
+
+  return p ? &p->rcs : 0x0;
 }
 
 void
@@ -59,36 +63,39 @@ init_recovery_lock_idx(void)
 
   for(i = 0; i < NBUF; i++){
     buf_idx[i].addr = (void*)&bcache.buf[i];
-    buf_idx[i].flag = LAST_FLAG_WO_IDX + i + 1;
-  }
-
-  for(i = 0; i < NFILE; i++){
-    file_idx[i].addr = (void*)&ftable->file[i];
-    file_idx[i].flag = LAST_FLAG_WO_IDX + NBUF + i;
-  }
-
-  for(i = 0; i < NINODE; i++){
-    inode_idx[i].addr = (void*)&icache->inode[i];
-    inode_idx[i].flag = LAST_FLAG_WO_IDX + NBUF + NFILE + i;
+    buf_idx[i].flag = RL_FLAG_BUF_IDX(i);
   }
+  buf_replaced = 0;
+  file_base = ftable->file;
+  inode_base = icache->inode;
 }
 
 void
 init_recovery_locks(void)
 {
   for(int i = 0; i < RL_NFLAGS; i++){
-    recovery_locks[i].num = 0;
     recovery_locks[i].exception = 0;
+    recovery_locks[i].seq = 0;
     initlock(&recovery_locks[i].lock, "Recovery Lock");
     initlock(&recovery_locks[i].lk, "Recovery Lock's lock");
   }
 }
 
+// Return the flag of the node addr, from its index in its table.
+// Only a buf which recovery replaced out of bcache.buf[] needs buf_idx[] to be searched.
 static int
 search_recovery_idx(int flag, void *addr)
 {
+  struct buf *b = (struct buf*)addr;
+  struct file *f = (struct file*)addr;
+  struct inode *ip = (struct inode*)addr;
+
   switch(flag){
     case RL_FLAG_BUF:
+      if(bcache.buf <= b && b < bcache.buf + NBUF && buf_idx[b - bcache.buf].addr == addr)
+        return RL_FLAG_BUF_IDX(b - bcache.buf);
+      if(buf_replaced == 0)
+        break;
       for(int i = 0; i < NBUF; i++){
         if(buf_idx[i].addr == addr){
           return buf_idx[i].flag;
@@ -96,18 +103,12 @@ search_recovery_idx(int flag, void *addr)
       }
       break;
     case RL_FLAG_FILE:
-      for(int i = 0; i < NFILE; i++){
-        if(file_idx[i].addr == addr){
-          return file_idx[i].flag;
-        }
-      }
+      if(file_base <= f && f < file_base + NFILE && (char*)f == (char*)&file_base[f - file_base])
+        return RL_FLAG_FILE_IDX(f - file_base);
       break;
     case RL_FLAG_INODE:
-      for(int i = 0; i < NINODE; i++){
-        if(inode_idx[i].addr == addr){
-          return inode_idx[i].flag;
-        }
-      }
+      if(inode_base <= ip && ip < inode_base + NINODE && (char*)ip == (char*)&inode_base[ip - inode_base])
+        return RL_FLAG_INODE_IDX(ip - inode_base);
       break;
     default:
       printf("search_recovery_idx: Passed invalid Recovery-Locking flag (%d).\n", flag);
@@ -121,99 +122,59 @@ search_recovery_idx(int flag, void *addr)
  * Recovery Critical Section history
  */
 static void
-add_rcs_history(int pid, int flag)
+add_rcs_history(struct proc *p, int flag)
 {
-  int i, idx = -1;
-
-  for(i = 0; i < NPROC; i++){
-    if(rcs_infos[i].pid == pid){
-      idx = i;
-      break; 
-    }
-  }
+  struct proc_rcs_info *info = &p->rcs;
 
-  if(idx < 0){
-    panic_without_pr("add_rcs_history: No corresponding R.C.S info history");
-  }
-
-  for(i = 0; i < RCS_INFO_HISTORY_SIZE; i++){
-    if(rcs_infos[idx].history_idx[i] == 0){
-      rcs_infos[idx].history_idx[i] = flag;
+  for(int i = 0; i < RCS_INFO_HISTORY_SIZE; i++){
+    if(info->history_idx[i] == 0){
+      info->history_idx[i] = flag;
       break;
     }
   }
 }
 
 static void
-del_rcs_history(int pid, int flag)
+del_rcs_history(struct proc *p, int flag)
 {
-  int i, idx = -1;
-
-  for(i = 0; i < NPROC; i++){
-    if(rcs_infos[i].pid == pid){
-      idx = i;
-      break; 
-    }
-  }
-
-  if(idx < 0)
-    panic_without_pr("del_rcs_history: No corresponding R.C.S info history");
+  int i;
+  struct proc_rcs_info *info = &p->rcs;
 
   for(i = RCS_INFO_HISTORY_SIZE-1; i >= 0; i--){
-    if(rcs_infos[idx].history_idx[i] == flag){
-      rcs_infos[idx].history_idx[i] = 0;
+    if(info->history_idx[i] == flag){
+      info->history_idx[i] = 0;
       break;
     }
   }
   
   for(i = 0; i < RCS_INFO_HISTORY_SIZE-1; i++){
-    if(rcs_infos[idx].history_idx[i] == 0){
-       if(rcs_infos[idx].history_idx[i+1] == 0)
+    if(info->history_idx[i] == 0){
+       if(info->history_idx[i+1] == 0)
           break;
-       rcs_infos[idx].history_idx[i] = rcs_infos[idx].history_idx[i+1];
-       rcs_infos[idx].history_idx[i+1] = 0;
+       info->history_idx[i] = info->history_idx[i+1];
+       info->history_idx[i+1] = 0;
     }
   }
-  rcs_infos[idx].history_idx[i] = 0;
+  info->history_idx[i] = 0;
 }
 
 void
-free_rcs_history(int pid)
+free_rcs_history(struct proc *p)
 {
-  int i, idx = -1;
-
-  for(i = 0; i < NPROC; i++){
-    if(rcs_infos[i].pid == pid){
-      idx = i;
-      break; 
-    }
-  }
-  if (idx < 0)
-    return;   // panic is not appropriate in the case of allocproc() in fork().
-
   // Clear all R.C.S nestings, but any histories must not remain.
-  for(i = 0; i < RCS_INFO_HISTORY_SIZE; i++){
-    rcs_infos[idx].history_idx[i] = 0;
-  }
-  rcs_infos[idx].pid = 0;
+  memset(&p->rcs, 0, sizeof(p->rcs));
 }
 
 int
 search_rcs_history(int pid, int flag)
 {
-  int idx = -1;
+  struct proc_rcs_info *info = search_rcs_info(pid);
 
-  for(int i = 0; i < NPROC; i++){
-    if(rcs_infos[i].pid == pid){
-      idx = i;
-      break;
-    }
-  }
-  if(idx < 0)
+  if(info == 0x0)
     panic_without_pr("search_rcs_history: No corresponding R.C.S info history");
 
   for(int i = 0; i < RCS_INFO_HISTORY_SIZE; i++){
-    if(rcs_infos[idx].history_idx[i] == flag){
+    if(info->history_idx[i] == flag){
       return 1;  // Found.
     }
   }
@@ -221,14 +182,62 @@ search_rcs_history(int pid, int flag)
   return 0;
 }
 
+/*
+ * Recovery Critical Section counts
+ */
+// Add n to this CPU's count of the flag's R.C.S.
+static void
+rcs_count(int flag, int n)
+{
+  push_off();
+  __sync_fetch_and_add(&rcs_cpus[cpuid()].num[flag], n);
+  pop_off();
+}
+
+// The number of processes in the flag's R.C.S.
+static int
+rcs_num(int flag)
+{
+  int n = 0;
+
+  for(int i = 0; i < NCPU; i++)
+    n += rcs_cpus[i].num[flag];
+  return n;
+}
+
 /*
  * Recovery Critical Section entrance/exit API
  */
+// Slow path of the entrance: wait for the recovery process to release the Recovery Lock.
+// The caller has been counted in the R.C.S.
+static void
+enter_rcs_slow(struct recovery_lock *rlk, int flag, int exception)
+{
+  acquire(&rlk->lk);
+  while(locking(&rlk->lock)){
+    rcs_count(flag, -1);  // Not in the R.C.S while waiting.
+    if(exception == ICACHE_FORK)
+      panic("Avoids deadlock occurrence");
+    sleep(rlk, &rlk->lk);
+    rcs_count(flag, 1);
+    __sync_synchronize();
+  }
+
+  if(exception)
+    rlk->exception = exception;
+  release(&rlk->lk);
+}
+
 // Entrance function of recovery-locking critical section.
+// The entrance is counted first and the Recovery Locks are checked after it, and the recovery process
+// counts the processes in the R.C.S after acquiring the Recovery Lock (acquire_recovery_lock()).
+// So either the recovery process sees this process, or this process sees the lock and waits.
 void
 enter_recovery_critical_section(int flag, int exception)
 {
+  int recovering;
   struct recovery_lock *rlk;
+  struct proc *p = myproc();
 
   if (flag < 0 || RL_FLAG_MAX < flag) {
     panic_without_pr("enter_recovery_critical_section: Invalid recovery-locking flag.");
@@ -238,24 +247,19 @@ enter_recovery_critical_section(int flag, int exception)
   }
 
   rlk = &recovery_locks[flag];
-  if(!holding(&rlk->lock)){  // All processes except recovery process have to go through the inspection.
-    acquire(&rlk->lk);
-    while(locking(&rlk->lock)){
-      if(exception == ICACHE_FORK)
-        panic("Avoids deadlock occurrence");
-      sleep(rlk, &rlk->lk);
-    }
-    
-    // Enter recovery-locking critical section.
-    if(__sync_lock_test_and_set(&rlk->num, rlk->num + 1));  // Replace num atomically.
-    
-    if(exception)
-      rlk->exception = exception;
-    release(&rlk->lk);
+  push_off();
+  recovering = holding(&rlk->lock);
+  pop_off();
+
+  if(!recovering){  // All processes except recovery process have to go through the inspection.
+    rcs_count(flag, 1);  // Enter recovery-locking critical section.
+    __sync_synchronize();
+    if(rl_held || exception)
+      enter_rcs_slow(rlk, flag, exception);
   }
 
-  if(myproc()){  // Avoid NULL pointer access during boot time.
-    add_rcs_history(myproc()->pid, flag);  // Record as in the R.C.S.
+  if(p){  // Avoid NULL pointer access during boot time.
+    add_rcs_history(p, flag);  // Record as in the R.C.S.
   }
 }
 
@@ -274,6 +278,37 @@ enter_recovery_critical_section_nodes(int f, void *addr)
   enter_recovery_critical_section(flag, 0);
 }
 
+// Enter the node's R.C.S unless another process is recovering the node (or has replaced it).
+// Returns 0 if entered. Otherwise returns -1 without panic, and the caller
+// waits for the recovery by wait_recovery_nodes() and reads the nodes again.
+int
+try_enter_recovery_critical_section_nodes(int f, void *addr)
+{
+  int flag = search_recovery_idx(f, addr);
+
+  if(flag < 0 || (locking(&recovery_locks[flag].lock) && !holding(&recovery_locks[flag].lock)))
+    return -1;
+  enter_recovery_critical_section(flag, 0);
+  return 0;
+}
+
+// Sleep until the recovery process releases the Recovery Lock of the node addr, as enter_rcs_slow() does.
+// The caller must not hold any spinlock.
+void
+wait_recovery_nodes(int f, void *addr)
+{
+  int flag = search_recovery_idx(f, addr);
+  struct recovery_lock *rlk;
+
+  if(flag < 0)
+    return;  // The node has been replaced by its recovery.
+  rlk = &recovery_locks[flag];
+  acquire(&rlk->lk);
+  while(locking(&rlk->lock))
+    sleep(rlk, &rlk->lk);
+  release(&rlk->lk);
+}
+
 // Exit function of recovery-locking critical section.
 // Exit is free because there are no needs for waiting the recovery process.
 void
@@ -289,16 +324,17 @@ exit_recovery_critical_section(int flag, int exception)
   }
 
   // Exit recovery-locking critical section.
-  rlk = &recovery_locks[flag];
-  acquire(&rlk->lk);
-
-  if(__sync_lock_test_and_set(&rlk->num, rlk->num-1));  // Replace num atomically.
-  if(rlk->exception == exception)
-    rlk->exception = 0;
-  release(&rlk->lk);
+  rcs_count(flag, -1);
+  if(exception){
+    rlk = &recovery_locks[flag];
+    acquire(&rlk->lk);
+    if(rlk->exception == exception)
+      rlk->exception = 0;
+    release(&rlk->lk);
+  }
 
   if(myproc()){
-    del_rcs_history(myproc()->pid, flag);  // Remove the record.
+    del_rcs_history(myproc(), flag);  // Remove the record.
   }
 }
 
@@ -316,27 +352,18 @@ exit_recovery_critical_section_nodes(int flag, void *addr)
 static void
 exit_recovery_critical_section_all(int pid)
 {
-  int i, idx = -1, flag = -1;
-  struct recovery_lock *rlk;
+  int i, flag = -1;
+  struct proc_rcs_info *info = search_rcs_info(pid);
 
-  for(i = 0; i < NPROC; i++){
-    if(rcs_infos[i].pid == pid){
-      idx = i;
-      break; 
-    }
-  }
-  if(idx < 0)
+  if(info == 0x0)
     panic_without_pr("exit_recovery_critical_section_all: No corresponding R.C.S nesting history");
 
   // Exit from every R.C.S.
   for(i = 0; i < RCS_INFO_HISTORY_SIZE; i++){
-    flag = rcs_infos[idx].history_idx[i];
-
-    rlk = &recovery_locks[flag];
-    acquire(&rlk->lk);
-    if(__sync_lock_test_and_set(&rlk->num, rlk->num-1));
-    release(&rlk->lk);
-    rcs_infos[idx].history_idx[i] = 0;
+    flag = info->history_idx[i];
+    if(flag != 0)
+      rcs_count(flag, -1);
+    info->history_idx[i] = 0;
   }
 }
 
@@ -361,6 +388,38 @@ exit_rcs_after_recovery(int pid, int intr)
   } 
 }
 
+/*
+ * Read path of buf, file, inode nodes.
+ * A reader doesn't enter the node's R.C.S, so it makes no shared writes.
+ * It records the node's recovery epoch before reading and re-validates it after.
+ */
+// Return the recovery epoch of the node addr to be passed to retry_rcs_read_nodes().
+uint
+begin_rcs_read_nodes(int f, void *addr)
+{
+  int flag = search_recovery_idx(f, addr);
+  uint seq;
+
+  if(flag < 0)
+    return 1;  // The node was replaced, so the read has to be retried.
+  seq = recovery_locks[flag].seq;
+  __sync_synchronize();
+  return seq;
+}
+
+// Return 1 if the node addr was under recovery at begin_rcs_read_nodes() or has been recovered since.
+// Then the values read may be broken, and the reader has to read them again as a writer,
+// by entering the R.C.S.
+int
+retry_rcs_read_nodes(int f, void *addr, uint seq)
+{
+  int flag;
+
+  __sync_synchronize();
+  flag = search_recovery_idx(f, addr);
+  return flag < 0 || (seq & 1) || recovery_locks[flag].seq != seq;
+}
+
 /*
  * Recovery-Locking mechanism.
  */
@@ -371,6 +430,8 @@ acquire_recovery_lock(int flag)
     panic_without_pr("Invalid recovery_locks flag");
 
   acquire(&recovery_locks[flag].lock);
+  __sync_fetch_and_add(&rl_held, 1);  // Make R.C.S entrances take the slow path.
+  __sync_fetch_and_add(&recovery_locks[flag].seq, 1);  // Odd: invalidate the readers.
 }
 
 void
@@ -411,8 +472,14 @@ release_recovery_lock(int flag)
 {
   if(flag < 0 || RL_FLAG_MAX < flag)
     panic_without_pr("Invalid recovery_locks flag");
+  __sync_fetch_and_add(&recovery_locks[flag].seq, 1);
+  __sync_fetch_and_sub(&rl_held, 1);
   release(&recovery_locks[flag].lock);
+
+  // Hold lk so that the wakeup isn't lost between a waiter's check of the lock and its sleep().
+  acquire(&recovery_locks[flag].lk);
   wakeup(&recovery_locks[flag]);
+  release(&recovery_locks[flag].lk);
 }
 
 // This update function is only called in the recovery handlers.
@@ -423,20 +490,18 @@ update_recovery_lock_idx(int flag, void *broken, void *new){
       for(int i = 0; i < NBUF; i++){
         if(buf_idx[i].addr == broken){
           buf_idx[i].addr = new;
+          if(broken == (void*)&bcache.buf[i])
+            __sync_fetch_and_add(&buf_replaced, 1);
         }
       }
       break;
 
     case RL_FLAG_FILE:
-      for(int i = 0; i < NFILE; i++){
-        file_idx[i].addr = (void*)&ftable->file[i];
-      }
+      file_base = ftable->file;  // The flags follow the new ftable.
       break;
 
     case RL_FLAG_INODE:
-      for(int i = 0; i < NINODE; i++){
-        inode_idx[i].addr = (void*)&icache->inode[i];
-      }
+      inode_base = icache->inode;
       break;
 
     default:
@@ -496,7 +561,7 @@ check_and_count_procs_in_rcs(int flag, void *addr)
   if(RL_FLAG_BUF <= flag && addr != 0x0)
     flag = search_recovery_idx(flag, addr);
 
-  return recovery_locks[flag].num;
+  return rcs_num(flag);
 }
 
 static int
@@ -527,20 +592,13 @@ check_proc_waiting_rcs_icache(void *broken, int pid)
 static int
 check_proc_in_target_rcs(int pid, int flag)
 {
-  int i, idx = -1;
+  struct proc_rcs_info *info = search_rcs_info(pid);
 
-  for(i = 0; i < NPROC; i++){
-    if(rcs_infos[i].pid == pid){
-      idx = i;
-      break; 
-    }
-  }
-
-  if(idx < 0)
+  if(info == 0x0)
     panic_without_pr("check_proc_in_target_rcs: No corresponding R.C.S info history");
 
-  for(i = 0; i < RCS_INFO_HISTORY_SIZE; i++){
-    if(rcs_infos[idx].history_idx[i] == flag){
+  for(int i = 0; i < RCS_INFO_HISTORY_SIZE; i++){
+    if(info->history_idx[i] == flag){
       return 1;
     }
   }
@@ -552,14 +610,14 @@ static int
 check_waiting_procs_in_nmi_queue(int flag)
 {
   int np = 0;  // Number of waiting proc in NMI Shepherding.
+  int pids[NMI_QUEUE_SIZE+1], n;
 
-  if(nmi_queue == 0x0)
+  n = nmi_queue_pids(pids);
+  if(n == 0)
     panic_without_pr("check_waiting_procs_in_nmi_queue: The NMI Queue is not valid");
 
-  for(int i = 0; i < NMI_QUEUE_SIZE; i++){
-    if(nmi_queue[i].addr == 0x0)
-      continue;
-    if(check_proc_in_target_rcs(nmi_queue[i].pid, flag)){
+  for(int i = 0; i < n; i++){
+    if(check_proc_in_target_rcs(pids[i], flag)){
       np++;
     }
   }
@@ -631,7 +689,7 @@ check_proc_in_log_commit(int pid)
     release(&rlk->lk);
     return 0;  // No other processes are in log R.C.S, so no needs for identify recovery process was committing or not.
   }
-  else if(rlk->num >= 0){
+  else if(rcs_num(RL_FLAG_LOG) >= 0){
     return rlk->exception && LOG_COMMIT;
   }
   else {
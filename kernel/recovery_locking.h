@@ -10,17 +10,24 @@
 #define RL_FLAG_FILE   0xa
 #define RL_FLAG_INODE  0xb
 
-#define LAST_FLAG_WO_IDX 8
-#define RL_NFLAGS        8 + NBUF + NFILE + NINODE + 1  // The number of flags for the recovery-locking mechanism.
-#define RL_FLAG_MAX      RL_NFLAGS
+// Recovery domains: the set of RL_FLAGs which a recovery touches.
+// Recoveries with disjoint domains run on their harts in parallel.
+#define RL_DOMAIN(flag)  (1 << (flag))
+#define RL_DOMAIN_PROC   (1 << 12)    // Process table, pagetables and their locks.
+#define RL_DOMAIN_ALL    0xffffffff  // Replacing kmem/devsw or an unknown memobj.
+
+#define LAST_FLAG_WO_IDX RL_FLAG_INODE
+// Flags of each node, derived from the node's index in its table.
+#define RL_FLAG_BUF_IDX(i)   (LAST_FLAG_WO_IDX + 1 + (i))
+#define RL_FLAG_FILE_IDX(i)  (RL_FLAG_BUF_IDX(NBUF) + (i))
+#define RL_FLAG_INODE_IDX(i) (RL_FLAG_FILE_IDX(NFILE) + (i))
+#define RL_NFLAGS        RL_FLAG_INODE_IDX(NINODE)  // The number of flags for the recovery-locking mechanism.
+#define RL_FLAG_MAX      (RL_NFLAGS - 1)
 
 // Exception Flags
 #define LOG_COMMIT  1  // In the commit() in log.c
 #define ICACHE_FORK 2  // In the fork() in proc.c (deadlock can occur, more sophisticated way is needed)
 
-// R.C.S info
-#define RCS_INFO_HISTORY_SIZE 5
-
 // R.C.S exit flag of hardware interrupt cases.
 #define CONSINTR_CONS 1
 #define CONSINTR_PR   2
@@ -35,14 +42,16 @@ struct recovery_lock_idx{
 
 // Recovery-locking infomation.
 struct recovery_lock{
-  int num;         // The number of processes which in the recovery-locking critical section.
   int exception;   // Indicate some process are in excepting section (ex. begin_op() in log.c)
+  uint seq;        // Recovery epoch, odd while the recovery process holds the Recovery Lock.
   struct spinlock lock;  // Recovery Lock
   struct spinlock lk;    // Recovery Lock's lock
 };
 
-// Infomation about Recovery Critical Section nesting of each process.
-struct proc_rcs_info{
-  int pid;
-  int history_idx[RCS_INFO_HISTORY_SIZE];  // R.C.S nesting history recording RL_FLAG.
-};
+// Per-CPU counts of the processes which entered each recovery-locking critical section.
+// A process may exit on another CPU, so one count can be negative,
+// but the sum of all CPUs' counts is the number of processes in the R.C.S.
+struct rcs_cpu{
+  int num[RL_NFLAGS];
+} __attribute__((aligned(64)));
+
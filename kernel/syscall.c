@@ -115,6 +115,8 @@ extern uint64 sys_check_reserved_fd_all(void);
 extern uint64 sys_enable_user_coop(void);
 extern uint64 sys_disable_user_coop(void);
 extern uint64 sys_pick_fd(void);
+extern uint64 sys_mlistbench(void);
+extern uint64 sys_check_ptdup_overhead(void);
 
 
 static uint64 (*syscalls[])(void) = {
@@ -146,6 +148,9 @@ static uint64 (*syscalls[])(void) = {
 [SYS_enable_user_coop] sys_enable_user_coop,
 [SYS_disable_user_coop] sys_disable_user_coop,
 [SYS_pick_fd] sys_pick_fd,
+[SYS_mlistbench] sys_mlistbench,
+[SYS_check_memory_space_overhead] sys_check_memory_space_overhead,
+[SYS_check_ptdup_overhead] sys_check_ptdup_overhead,
 };
 
 void
@@ -29,3 +29,6 @@
 #define SYS_enable_user_coop 28
 #define SYS_disable_user_coop 29
 #define SYS_pick_fd 30
+#define SYS_mlistbench 31
+#define SYS_check_memory_space_overhead 32
+#define SYS_check_ptdup_overhead 33
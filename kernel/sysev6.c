@@ -20,11 +20,11 @@
 
 
 extern struct ftable *ftable;
+extern struct proc proc[];
 extern int recovery_mode;  // Recovery mode in recovery handlers and mlist_tracker.
 
-struct open_arg_table oa_table[NPROC];
+struct open_arg_table oa_table[NPROC];  // Indexed by the process's slot in proc[].
 int dup_offset[NFILE];  // Duplication of struct file's offset.
-struct spinlock oa_table_lock;
 
 
 /* Switch recovery mode.
@@ -52,32 +52,27 @@ int sys_change_recovery_mode(void){
 /*
  * Recording some values (path, omode, offset) to perform Re-Open.
  */
+// The open_arg_table of p, or 0x0 if p doesn't have it.
+static struct open_arg_table*
+search_open_arg_table(struct proc *p)
+{
+  struct open_arg_table *oat = &oa_table[p - proc];
+
+  return (oat->pid == p->pid) ? oat : 0x0;
+}
+
 // Record arguments.
 void
 rec_open_args(int fd, char *path, int omode)
 {
-  int pid = myproc()->pid;
-  struct open_arg_table *oat = 0x0;
-
-  acquire(&oa_table_lock);
+  struct proc *p = myproc();
+  struct open_arg_table *oat = &oa_table[p - proc];
 
-  for (int i = 0; i < NPROC; i++) {
-    if (oat == 0x0 && oa_table[i].pid == 0) {
-      oat = &oa_table[i];  // Memorize empty slot.
-    } else if (oa_table[i].pid == pid) {
-      oat = &oa_table[i];
-      break;
-    }
+  if (oat->pid != p->pid) {  // Not used yet, or left by the previous process in this slot.
+    memset(oat, 0, sizeof(struct open_arg_table));
+    oat->pid = p->pid;
   }
 
-  release(&oa_table_lock);
-  
-  if (oat->pid == 0) {
-    oat->pid = pid;
-  } else if (oat == 0x0) {
-    panic("No empty open argument table");
-  }
- 
   strncpy(oat->args[fd].path, path, strlen(path));
   oat->args[fd].omode = omode;
 }
@@ -86,17 +81,7 @@ rec_open_args(int fd, char *path, int omode)
 void
 del_open_args(int fd)
 {
-  int pid = myproc()->pid;
-  struct open_arg_table *oat = 0x0;
-
-  acquire(&oa_table_lock);
-  for (int i = 0; i < NPROC; i++) {
-    if (oa_table[i].pid == pid) {
-      oat = &oa_table[i];
-      break;
-    }
-  }
-  release(&oa_table_lock);
+  struct open_arg_table *oat = search_open_arg_table(myproc());
 
   if (oat == 0x0) {
     panic("Invalid file descriptor was passed.");
@@ -110,18 +95,9 @@ void
 copy_open_args(int to, struct file *f)
 {
   struct proc *p = myproc();
-  struct open_arg_table *oat = 0x0;
+  struct open_arg_table *oat = search_open_arg_table(p);
   int from = -1;
 
-  acquire(&oa_table_lock);
-  for (int i = 0; i < NPROC; i++) {
-    if (oa_table[i].pid == p->pid) {
-      oat = &oa_table[i];
-      break;
-    }
-  }
-  release(&oa_table_lock);
- 
   for (from = 0; from < NOFILE; from++) {
     if (p->ofile[from] == f) {
       break;
@@ -140,20 +116,13 @@ copy_open_args(int to, struct file *f)
 void
 free_open_arg_table(void)
 {
-  int pid = myproc()->pid;
-
-  acquire(&oa_table_lock);
+  struct open_arg_table *oat = search_open_arg_table(myproc());
 
-  for(int i = 0; i < NPROC; i++){
-    if(oa_table[i].pid == pid){
-      memset(&oa_table[i], 0, sizeof(struct open_arg_table));
-      release(&oa_table_lock);
-      return;
-    }
+  if(oat != 0x0){
+    memset(oat, 0, sizeof(struct open_arg_table));
+    return;
   }
 
-  release(&oa_table_lock);
-
   // Note that this function can be called in duplicate 
   // when Ev6 recovers in the context of exit() due to After-Treatment choice (i.e. Process Kill).
   printf("\nCAUTION: No corresponding open_arg_table to free due to recovery or inappropriate open_arg_table creation. It is recommended to confirm the cause.\n\n");
@@ -163,29 +132,14 @@ free_open_arg_table(void)
 void
 copy_open_arg_table(struct proc *fp, struct proc *tp)
 {
-  struct open_arg_table *from = 0x0, *to = 0x0;
-
-  acquire(&oa_table_lock);
-
-  for (int i = 0; i < NPROC; i++) {
-    if (to == 0x0 && oa_table[i].pid == 0) {
-      to = &oa_table[i];  // Memorize empty slot for the fork destination proc.
-    } else if(oa_table[i].pid == fp->pid) {
-      from = &oa_table[i];
-    }
-
-    if (to != 0x0 && from != 0x0) {  // Both are found.
-      break;
-    }
-  }
+  struct open_arg_table *from = search_open_arg_table(fp), *to = &oa_table[tp - proc];
 
-  if (to == 0x0 || from == 0x0) {
+  if (from == 0x0) {
     panic("copy_open_arg_table: copy destination/source table was not found.");
   }
 
   memmove(to, from, sizeof(struct open_arg_table));
   to->pid = tp->pid;
-  release(&oa_table_lock);
 }
 
 // Update duplicated offset.
@@ -268,13 +222,8 @@ sys_reopen(void)
   char path[MAXPATH];
   int nextfd, ret = 0;
   struct file *f;
-  struct open_arg_table *oat = 0x0;
   struct proc *p = myproc();
-
-  for(int i = 0; i < NPROC; i++){
-    if(p->pid == oa_table[i].pid)
-      oat = &oa_table[i];
-  }
+  struct open_arg_table *oat = search_open_arg_table(p);
 
   enter_recovery_critical_section(RL_FLAG_FTABLE, 0);
   enter_recovery_critical_section(RL_FLAG_ICACHE, 0);
@@ -349,21 +298,12 @@ uint64
 sys_pick_fd(void)
 {
   char path[MAXPATH];
-  int omode, n, pid = myproc()->pid;
-  struct open_arg_table *oat = 0x0;
+  int omode, n;
+  struct open_arg_table *oat = search_open_arg_table(myproc());
 
   if ((n = argstr(0, path, MAXPATH)) < 0 || argint(1, &omode) < 0)
     return -1;
 
-  acquire(&oa_table_lock);
-  for (int i = 0; i < NPROC; i++) {
-    if (oa_table[i].pid == pid) {
-      oat = &oa_table[i];
-      break;
-    }
-  }
-  release(&oa_table_lock);
-  
   if (oat == 0x0) {
     panic("No empty open argument table");
   }
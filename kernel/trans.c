@@ -18,12 +18,9 @@
 #include "ptdup.h"
 #include "trans.h"
 
-int log_outstanding;             // Logging outstanding value.
-struct logheader log_logheader;  // Logging logheader.
-struct trans_info_array trans_info_array;
-struct run *log_run;             // Logging run pointer.
+struct log_undo log_undo;        // Undo record of the log transaction.
+struct trans_info boot_trans;    // Transaction flags before the first process.
 
-extern int nextpid;
 extern int dup_outstanding;
 extern struct log *log;
 extern struct kmem *kmem;
@@ -32,80 +29,53 @@ extern struct mlist_header mlist;
 
 
 void init_trans_info(void){
-  initlock(&trans_info_array.lock, "transaction");
-  trans_info_array.recovering = 0;
-
-  for(int i = 0; i <= NPROC; i++){
-    trans_info_array.array[i].pid = 0;
-    trans_info_array.array[i].pagetable_ntrans = 0;
-    trans_info_array.array[i].log_ntrans = 0;
-    trans_info_array.array[i].run_ntrans = 0;
-  }
+  memset(&boot_trans, 0, sizeof(boot_trans));
 }
 
-void register_trans_info(int pid){
-  acquire(&trans_info_array.lock);
-  for(int i = 0; i <= NPROC; i++){
-    if(trans_info_array.array[i].pid == 0){
-      trans_info_array.array[i].pid = pid;
-      break;
-    }
-  }
-  release(&trans_info_array.lock);
+void register_trans_info(struct proc *p){
+  memset(&p->trans, 0, sizeof(p->trans));
 }
 
-void delete_trans_info(int pid){
-  acquire(&trans_info_array.lock);
-  for(int i = 0; i <= NPROC; i++){
-    if(trans_info_array.array[i].pid == pid)
-      trans_info_array.array[i].pid = 0;  // Mark unused.
-  }
-  release(&trans_info_array.lock);
+void delete_trans_info(struct proc *p){
+  memset(&p->trans, 0, sizeof(p->trans));
 }
 
-// Search corresponding trans_info with pid and return corresponding index of the array.
-static int search_trans_info(int pid){
-  int ret = -1;  // -1 means fail to find.
+// The transaction flags of the current process, or of the boot context before any process runs.
+static struct trans_info* mytrans(void){
+  struct proc *p = myproc();
 
-  acquire(&trans_info_array.lock);
-  for(int i = 0; i <= NPROC; i++){
-    if(trans_info_array.array[i].pid == pid)
-      ret = i;
-  }
-  release(&trans_info_array.lock);
-  return ret;
+  return p ? &p->trans : &boot_trans;
 }
 
 // Transaction entering functions are below.
 // Entrance function of log transaction. log->lock must be hold.
-void enter_trans_log(void){
-  int idx = 0;
-  if(nextpid > 2){
-    idx = search_trans_info(myproc()->pid);
-  }
-  struct trans_info *ti = &trans_info_array.array[idx];
+// slot is the index of log->lh.block[] to be modified. Slots at or above log->lh.n
+// are rolled back by restoring n, so -1 can be passed for them.
+void enter_trans_log(int slot){
+  struct trans_info *ti = mytrans();
 
   if(ti->log_ntrans < 0)
     panic("enter_trans_log: invalid ntrans value");
 
-  log_logheader = log->lh;
-  log_outstanding = log->outstanding;
+  if(slot >= log->lh.n)
+    slot = -1;
+  log_undo.slot = slot;
+  if(slot >= 0)
+    log_undo.old = log->lh.block[slot];
+  log_undo.n = log->lh.n;
+  log_undo.outstanding = log->outstanding;
   ti->log_ntrans++;  // Enter transaction.
 }
 
 // Exit function of log transaction. log->lock must be hold.
 void exit_trans_log(void){
-  int idx = 0;
-  if(nextpid > 2){
-    idx = search_trans_info(myproc()->pid);
-  }
-  struct trans_info *ti = &trans_info_array.array[idx];
+  struct trans_info *ti = mytrans();
 
   if(ti->log_ntrans < 1)
     panic("exit_trans_log: invalid ntrans value");
 
   ti->log_ntrans--;  // Exit transaction.
-  log_outstanding = -1;
+  log_undo.outstanding = -1;
 }
 
 /* We think that complete/sophisticated transaction for page tables will be challenging,
@@ -114,37 +84,21 @@ void exit_trans_log(void){
  * when any NMIs occur during the transaction (in 2022.07.15).
  */
 void enter_trans_pagetable(void){
-  int idx = -1;
-  if(nextpid > 2){
-    idx = search_trans_info(myproc()->pid);
-  } else
-    idx = 0;
-
-  if(idx < 0){
-    printf("enter_trans_info: No corresponding trans_info.\n");
-    return;
-  }
-  if(trans_info_array.array[idx].pagetable_ntrans < 0)
+  struct trans_info *ti = mytrans();
+
+  if(ti->pagetable_ntrans < 0)
     panic("enter_trans_pagetable: invalid ntrans value");
 
-  trans_info_array.array[idx].pagetable_ntrans++;  // Enter transaction.
+  ti->pagetable_ntrans++;  // Enter transaction.
 }
 
 void exit_trans_pagetable(void){
-  int idx;
-  if(nextpid > 2){
-    idx = search_trans_info(myproc()->pid);
-  } else
-    idx = 0;
-
-  if(idx < 0){
-    printf("enter_trans_info: No corresponding trans_info.\n");
-    return;
-  }
-  if(trans_info_array.array[idx].pagetable_ntrans < 1)
+  struct trans_info *ti = mytrans();
+
+  if(ti->pagetable_ntrans < 1)
     panic("exit_trans_pagetable: invalid ntrans value");
 
-  trans_info_array.array[idx].pagetable_ntrans--;  // Exit transaction.
+  ti->pagetable_ntrans--;  // Exit transaction.
 }
 
 // For struct run.
@@ -152,45 +106,49 @@ void exit_trans_pagetable(void){
  * for recovering struct kmem failure due to ECC-uncorrectable errors
  * by adding the logging run to the Free-List.
  * In kalloc(), the run (empty page) doesn't allocate yet due to interrupted by the error.
- * In kfree(), the run was already unused but wasn't added to the Free-List due to the error.
+ * In kfree(), the run was already unused but wasn't added to the per-CPU page cache due to the error.
  */
 void enter_trans_run(struct run *addr){
-  int idx = 0;
-  struct trans_info *ti;
-  if(nextpid > 2){
-    idx = search_trans_info(myproc()->pid);
-  }
-  ti = &trans_info_array.array[idx];
+  struct trans_info *ti = mytrans();
 
   if(ti->run_ntrans < 0)
     panic("enter_trans_run: invalid ntrans value");
 
-  log_run = addr;
+  ti->log_run = addr;
   ti->run_ntrans++;  // Enter transaction.
 }
 
 void exit_trans_run(void){
-  int idx = 0;
-  struct trans_info *ti;
-  if (nextpid > 2){
-    idx = search_trans_info(myproc()->pid);
-  }
-  ti = &trans_info_array.array[idx];
+  struct trans_info *ti = mytrans();
 
   if (ti->run_ntrans < 1) {
     panic("exit_trans_run: invalid ntrans value");
   }
 
   ti->run_ntrans--;  // Exit transaction.
-  log_run = (struct run*)0x0;
+  ti->log_run = (struct run*)0x0;
 }
 
 
 // Transaction handlers when the transaction is interrupted by NMI due to ECC-uncorrectable errors 
 // and related functions.
+// Roll lh back to the beginning of the log transaction.
+static void undo_logheader(struct logheader *lh){
+  if(log_undo.slot >= 0)
+    lh->block[log_undo.slot] = log_undo.old;
+  lh->n = log_undo.n;
+}
+
+// The transaction flags of process pid, or of the boot context.
+static struct trans_info* pid_trans(int pid){
+  struct proc *p = search_proc_from_pid(pid);
+
+  return p ? &p->trans : &boot_trans;
+}
+
 static int check_inside_trans(int target, int pid){
-  int res = 0, idx = search_trans_info(pid);
-  struct trans_info *ti = &trans_info_array.array[idx];
+  int res = 0;
+  struct trans_info *ti = pid_trans(pid);
 
   switch(target){
     case TRANS_LOG:
@@ -215,9 +173,9 @@ int check_and_handle_trans_log(int pid){
   int ntrans = check_inside_trans(TRANS_LOG, pid);
 
   if(ntrans > 0){  // Inside of transaction.
-    log->lh = log_logheader;
-    dup_lhdr = log->lh;
-    dup_outstanding = log_outstanding;
+    undo_logheader(&log->lh);
+    undo_logheader(&dup_lhdr);
+    dup_outstanding = log_undo.outstanding;
     return 0;
   }
   else if(ntrans < 0){  // Fail in checking.
@@ -232,9 +190,9 @@ int check_and_handle_trans_logheader(int pid){
   int ntrans = check_inside_trans(TRANS_LOG, pid);
 
   if(ntrans > 0){  // Inside of transaction.
-    dup_lhdr = log_logheader;
-    if(log_outstanding >= 0)
-      dup_outstanding = log_outstanding;
+    undo_logheader(&dup_lhdr);
+    if(log_undo.outstanding >= 0)
+      dup_outstanding = log_undo.outstanding;
     return 0;
   }
   else if(ntrans < 0){  // Fail in checking.
@@ -262,12 +220,18 @@ int check_and_handle_trans_pagetable(int pid){
 // This is for struct kmem, so kmem must be already recovered.
 void check_and_handle_trans_run(int pid){
   int ntrans = check_inside_trans(TRANS_RUN, pid);
+  struct run *log_run = pid_trans(pid)->log_run;
 
   if (ntrans > 0 && (void*)kmem != (void*)log_run) {  // inside of transaction
     acquire(&kmem->lock);
-    log_run->next = kmem->freelist;
-    kmem->freelist = log_run;
-    register_memobj(log_run, mlist.run_list);
+    // The Free-List and the per-CPU page caches are rebuilt from page_descs[] by recovery_handler_kmem(),
+    // so log_run is already linked if its page is marked as free or cached.
+    if(!PG_RUN(pa2desc(log_run)->state)){
+      set_page_state(log_run, PG_FREE);
+      log_run->next = kmem->freelist;
+      kmem->freelist = log_run;
+      kmem->nfree++;
+    }
     release(&kmem->lock);
     exit_trans_run();
   } else if (ntrans < 0) {  // invalid ntrans value
@@ -1,19 +1,15 @@
 // Transactions to protect updating gap between real data structures and meta-data.
 // In FS, for managing copy & switching from old icache/ftable to new one.
 
-// The flags for judging in/out of transaction codes.
-struct trans_info{
-  int pid;
-  int pagetable_ntrans;  // Depth of transaction nesting.
-  int log_ntrans;
-  int run_ntrans;
-};
+// The flags for judging in/out of transaction codes are in struct proc (struct trans_info).
 
-// For managing transaction flags of all of the processes.
-struct trans_info_array{
-  int recovering;
-  struct spinlock lock;
-  struct trans_info array[NPROC+1];
+// Undo record of a log transaction: only the members of struct log which it modifies.
+// A log transaction modifies at most one slot of log->lh.block[] and log->lh.n.
+struct log_undo{
+  int slot;         // Index of the modified log->lh.block[], -1 if no slot below n is modified.
+  uint old;         // log->lh.block[slot] before the transaction.
+  int n;            // log->lh.n before the transaction.
+  int outstanding;  // log->outstanding before the transaction, -1 outside of transactions.
 };
 
 // Signs to identify updated member of struct log.
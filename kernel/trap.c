@@ -70,6 +70,10 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if(r_scause() == 15 && uvmcow(p->pagetable, r_stval()) == 0){
+    // store page fault on a copy-on-write page, which is now writable.
+  } else if((r_scause() == 13 || r_scause() == 15) && uvmlazy(p, r_stval()) == 0){
+    // page fault on memory reserved by sbrk(), which is now mapped.
   } else {
     printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -79,15 +79,13 @@ kvminithart()
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
 {
-  pagetable_t L2_pagetable = pagetable, L1_pagetable = 0x0;
+  pagetable_t L2_pagetable = pagetable;
 
   if(va >= MAXVA)
     panic("walk");
 
   for(int level = 2; level > 0; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
-    if(level == 1)
-	    L1_pagetable = pagetable;
 
     if(*pte & PTE_V) {
       pagetable = (pagetable_t)PTE2PA(*pte);
@@ -100,13 +98,16 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
       *pte = PA2PTE(pagetable) | PTE_V;
 
       if(nextpid > 2){
-        register_ptb_mlist(myproc()->pid, (uint64)pagetable, level-1);  // For user page tables.
+        // For user page tables, owned by the process of L2_pagetable (not myproc() in fork()).
+        register_ptb_mlist(pa2desc(L2_pagetable)->pid, (uint64)pagetable, level-1);
       }
 
+#ifndef PTDUP_EXTENT
 	    if(level == 2 && nextpid > 2)
-		    ptdup_create_l1(L2_pagetable, pagetable, *pte);  // Create new L1 duplication.
+		    ptdup_create_l1(L2_pagetable, PX(2, va), *pte);  // Create new L1 duplication.
 	    else if(level == 1 && nextpid > 2)
-        ptdup_update(L2_pagetable, L1_pagetable, (uint64)*pte, PX(1, va));
+        ptdup_update(L2_pagetable, PX(2, va), (uint64)*pte, PX(1, va));
+#endif
       exit_trans_pagetable();
     }
   }
@@ -115,17 +116,22 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
 
 // Look up a virtual address, return the physical address,
 // or 0 if not mapped.
+// A page of the current process which sbrk() reserved is
+// mapped here by uvmlazy(), for copyin() and copyout().
 // Can only be used to look up user pages.
 uint64
 walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   uint64 pa;
+  struct proc *p = myproc();
 
   if(va >= MAXVA)
     return 0;
 
   pte = walk(pagetable, va, 0);
+  if((pte == 0 || (*pte & PTE_V) == 0) && p != 0 && p->pagetable == pagetable && uvmlazy(p, va) == 0)
+    pte = walk(pagetable, va, 0);
   if(pte == 0)
     return 0;
 
@@ -194,29 +200,41 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
-// Remove mappings from a page table. The mappings in
-// the given range must exist. Optionally free the
-// physical memory.
+// The end of the range around va which has no L0 page table,
+// when walk(pagetable, va, 0) fails: up to the next 1GB if
+// the L1 page table is missing too, or else the next 2MB.
+static uint64
+unmapped_end(pagetable_t pagetable, uint64 va)
+{
+  uint64 size = 1L << PXSHIFT((pagetable[PX(2, va)] & PTE_V) ? 1 : 2);
+
+  return (va + size) & ~(size - 1);
+}
+
+// Remove mappings from a page table. Pages in the
+// given range which sbrk() reserved but nobody touched
+// are not mapped yet, and skipped, a whole missing page
+// table at a time. Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 size, int do_free)
 {
   uint64 a, last;
   pte_t *pte;
   uint64 pa = 0x0;
-  int darea_size = 0;
+  int darea_size;
 
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
+  darea_size = (last - a) / PGSIZE;
 
   enter_trans_pagetable();
-  for(;;){
+  for(; a <= last; a += PGSIZE){
     if((pte = walk(pagetable, a, 0)) == 0){
-      panic("uvmunmap: walk");
-    }
-
-    if((*pte & PTE_V) == 0){
-      panic("uvmunmap: not mapped");
+      a = unmapped_end(pagetable, a) - PGSIZE;
+      continue;
     }
+    if((*pte & PTE_V) == 0)
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
@@ -224,11 +242,6 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 size, int do_free)
       kfree((void*)pa);
     }
     *pte = 0;
-    if(a == last)
-      break;
-    a += PGSIZE;
-    pa += PGSIZE;
-    darea_size++;
   }
 
   L0_ptes_delete(pagetable, va, darea_size);
@@ -260,6 +273,7 @@ uvminit(pagetable_t pagetable, uchar *src, uint sz)
     panic("inituvm: more than a page");
   mem = kalloc();
   memset(mem, 0, PGSIZE);
+  set_page_state(mem, PG_USER);
   enter_trans_pagetable();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   L0_ptes_add(pagetable, VA2PTED(0)|PPN2PTED(PA2PTE(mem))|PTE_W|PTE_R|PTE_X|PTE_U, 0);
@@ -274,10 +288,7 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
   char *mem = 0x0;
   uint64 a;
-  int ptds_size = 0;   // PTDS size counter.
-  int order = 0;       // PTDS ascending/descending order flag.
-  uint64 bmem = 0x0;   // Before mem's address.
-  uint64 entry = 0x0;  // Contents of a PTDS entry.
+  struct ptdup_run run = {0};  // Pages being gathered into a PTDS.
 
   if(newsz < oldsz)
     return oldsz;
@@ -293,44 +304,16 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
       return 0;
     }
     memset(mem, 0, PGSIZE);
+    set_page_state(mem, PG_USER);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
       exit_trans_pagetable();
       return 0;
     }
-
-	  if(ptds_size == 0)
-	    entry = entry | PPN2PTDS(PA2PTE(mem)) | VA2PTDS(a);  // Record start PA, start VA to PTDS/PTED.
-	  if(bmem - (uint64)mem == PGSIZE){  // Descending order.
-      order = 0;
-	    ptds_size++;
-    }
-    else if((uint64)mem - bmem == PGSIZE){  // Ascending order.
-      order = 1;
-	    ptds_size++;
-    }
-    else if(bmem == 0x0)  // The first entry.
-	    ptds_size++;
-
-    else if(bmem - (uint64)mem != PGSIZE && (uint64)mem - bmem != PGSIZE){
-      if(ptds_size > 1)
-        L0_ptes_add(pagetable, entry|ORDER2PTDS(order)|UB2PTDS(PTE_U)|ptds_size, 1);  // Update PTDS list.
-      else
-        L0_ptes_add(pagetable, PPN2PTDS(PA2PTE(mem)) | VA2PTDS(a) |PTE_W|PTE_X|PTE_R|PTE_U, 0);  // Update PTED list. Not PTDS.
-      if(a == oldsz + PGSIZE)  // Register the first mapping.
-        L0_ptes_add(pagetable, PPN2PTDS(PA2PTE(bmem)) | VA2PTDS(oldsz) |PTE_W|PTE_X|PTE_R|PTE_U, 0);  // Update PTED list. Not PTDS.
-	    ptds_size = 0;
-      entry = 0x0;
-      order = 0;
-    }
-    bmem = (uint64)mem;
+    ptdup_run_add(pagetable, &run, a, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U);
   }
-
-  if(ptds_size > 1)
-    L0_ptes_add(pagetable, entry|ORDER2PTDS(order)|UB2PTDS(PTE_U)|ptds_size, 1);  // Update PTDS list.
-  else if(entry != 0x0)
-    L0_ptes_add(pagetable, entry|PTE_W|PTE_X|PTE_R|PTE_U, 0);  // Update PTED list. Not PTDS.
+  ptdup_run_flush(pagetable, &run);
   exit_trans_pagetable();
 
   return newsz;
@@ -372,9 +355,8 @@ freewalk(pagetable_t pagetable, int level)
       panic("freewalk: leaf");
     }
   }
-  kfree((void*)pagetable);
-
   delete_ptb_mlist((uint64)pagetable);
+  kfree((void*)pagetable);
   exit_trans_pagetable();
 }
 
@@ -389,82 +371,134 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// The physical memory is not copied, but shared
+// copy-on-write: writable pages turn read-only with
+// PTE_COW in both, and are copied by uvmcow() when
+// either writes them.
+// The page tables are walked once per L0 page table, and the
+// child's PTDS/PTED lists are cloned from the parent's at once.
+// No PTDUP lock is held across the copy: walk() and ptdup_clone()
+// allocate with kalloc(), which may sleep in the KMEM R.C.S.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+{
+  pte_t *pte, *npte;
+  pagetable_t l0 = 0x0, nl0 = 0x0;  // L0 page tables of the parent and the child.
+  uint64 i;
+
+  enter_trans_pagetable();
+  for(i = 0; i < sz; i += PGSIZE){
+    // Pages which sbrk() reserved but nobody touched are left to uvmlazy() in the child too,
+    // skipping a whole missing page table at a time.
+    if(PX(0, i) == 0){  // Into the next L0 page tables.
+      if((pte = walk(old, i, 0)) == 0){
+        i = unmapped_end(old, i) - PGSIZE;
+        continue;
+      }
+      l0 = pte - PX(0, i);
+      nl0 = 0x0;
+    }
+    if((l0[PX(0, i)] & PTE_V) == 0)
+      continue;
+    if(nl0 == 0x0){
+      if((npte = walk(new, i, 1)) == 0)
+        goto err;
+      nl0 = npte - PX(0, i);
+    }
+    pte = &l0[PX(0, i)];
+    npte = &nl0[PX(0, i)];
+    if(*npte & PTE_V)
+      panic("uvmcopy: remap");
+
+    if(*pte & PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
+    kdup((void*)PTE2PA(*pte));
+    *npte = *pte;
+  }
+  ptdup_clone(old, new, sz);  // Turn the parent's PTDUP copy-on-write, and copy it to the child.
+  exit_trans_pagetable();
+  return 0;
+
+ err:
+  exit_trans_pagetable();
+  uvmunmap(new, 0, i, 1);
+  return -1;
+}
+
+// Map a zeroed page at va, which sbrk() reserved but nobody
+// touched yet. The page is mapped and registered to PTDUP in a
+// transaction of the single page.
+// Returns 0 on success, -1 if va is out of the process's memory
+// or already mapped, or memory runs out.
+int
+uvmlazy(struct proc *p, uint64 va)
 {
   pte_t *pte;
-  uint64 pa, i;
-  uint flags;
   char *mem;
-  int ptds_size = 0;   // Size of PTDS covers.
-  int order = 0;
-  uint64 bmem = 0x0;
-  uint64 entry = 0x0;  // Contents of a PTDS entry.
+
+  if(va >= p->sz)
+    return -1;
+  va = PGROUNDDOWN(va);
+  if((pte = walk(p->pagetable, va, 0)) != 0 && (*pte & PTE_V))
+    return -1;
+  if((mem = kalloc()) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);
+  set_page_state(mem, PG_USER);
 
   enter_trans_pagetable();
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+    kfree(mem);
+    exit_trans_pagetable();
+    return -1;
+  }
+  ptdup_add_page(p->pagetable, va, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U);
+  exit_trans_pagetable();
+  return 0;
+}
 
-    pa = PTE2PA(*pte);
-    flags = PTE_FLAGS(*pte);
+// Give the copy-on-write page at va a writable copy of its own,
+// or make the page itself writable if no other page table shares it.
+// PTDUP takes the page out of its PTDS or PTED as a new PTED.
+// Returns 0 on success, -1 if va is not a copy-on-write user page
+// or memory runs out.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
 
+  if(va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+
+  enter_trans_pagetable();
+  if(krefs((void*)pa) == 1){
+    mem = (char*)pa;
+  } else {
     if((mem = kalloc()) == 0){
       exit_trans_pagetable();
-      goto err;
+      return -1;
     }
-
     memmove(mem, (char*)pa, PGSIZE);
-
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      exit_trans_pagetable();
-      goto err;
-    }
-
-    if(ptds_size == 0)
-      entry = entry | PPN2PTDS(PA2PTE(mem)) | VA2PTDS(i);  // Record start PA, start VA to PTDS/PTED.
-	  if(bmem - (uint64)mem == PGSIZE){  // Descending order.
-      order = 0;
-	    ptds_size++;
-    }
-    else if((uint64)mem - bmem == PGSIZE){  // Ascending order.
-      order = 1;
-      ptds_size++;
-    }
-    else if(bmem == 0x0)  // The first entry.
-      ptds_size++;
-
-    else if(bmem - (uint64)mem != PGSIZE && (uint64)mem - bmem != PGSIZE){
-      if(ptds_size > 1)
-        L0_ptes_add(new, entry|ORDER2PTDS(order)|UB2PTDS(PTE_U)|ptds_size, 1);  // Update PTDS list.
-      else
-        L0_ptes_add(new, PPN2PTDS(PA2PTE(mem))|VA2PTDS(i)|PTE_W|PTE_X|PTE_R|PTE_U, 0);  // Update PTED list. Not PTDS.
-      if(i == PGSIZE)  // Register the first mapping.
-        L0_ptes_add(new, PPN2PTDS(PA2PTE(bmem))|VA2PTDS(0)|PTE_W|PTE_X|PTE_R|PTE_U, 0);  // Update PTED list. Not PTDS.
-	    ptds_size = 0;
-      entry = 0x0;
-      order = 0;
-    }
-    bmem = (uint64)mem;
+    set_page_state(mem, PG_USER);
+    kfree((void*)pa);  // Drop this page table's reference.
   }
+  *pte = PA2PTE(mem) | flags;
 
-  if(ptds_size > 1)
-    L0_ptes_add(new, entry|ORDER2PTDS(order)|UB2PTDS(PTE_U)|ptds_size, 1);  // Update PTDS list.
-  else if(entry != 0x0)
-    L0_ptes_add(new, entry|PTE_W|PTE_X|PTE_R|PTE_U, 0);  // Update PTED list. Not PTDS.
+  L0_ptes_delete(pagetable, va, 0);
+  L0_ptes_add(pagetable, VA2PTED(va)|PPN2PTED(PA2PTE(mem))|(flags & (PTE_R|PTE_W|PTE_X|PTE_U)), 0);
   exit_trans_pagetable();
   return 0;
-
- err:
-  uvmunmap(new, 0, i, 1);
-  return -1;
 }
 
 // mark a PTE invalid for user access.
@@ -490,9 +524,15 @@ int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
+  pte_t *pte;
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
+    if(va0 >= MAXVA)
+      return -1;
+    pte = walk(pagetable, va0, 0);
+    if(pte != 0 && (*pte & PTE_COW) && uvmcow(pagetable, va0) < 0)
+      return -1;
     pa0 = walkaddr(pagetable, va0);
     if(pa0 == 0)
       return -1;
@@ -0,0 +1,19 @@
+#include "kernel/types.h"
+#include "user/user.h"
+
+// Compare M-List index lookups with sequential M-List walks.
+int main(int argc, char *argv[]){
+  uint64 t[2];
+
+  printf("objects\tindex\tlist (timer cycles per 1000 lookups)\n");
+  for(int n = 16; n <= 4096; n *= 2){
+    if(mlistbench(n, t) < 0){
+      printf("mlistbench: failed with %d objects\n", n);
+      exit(1);
+    }
+    printf("%d\t%d\t%d\n", n, (int)t[0], (int)t[1]);
+  }
+  printf("M-List memory overhead: %d bytes\n", check_memory_space_overhead());
+
+  exit(0);
+}
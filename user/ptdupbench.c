@@ -0,0 +1,79 @@
+#include "kernel/types.h"
+#include "user/user.h"
+
+// Report the PTDUP memory overhead per process and the fork()/exec() latency,
+// to compare the PTDUP modes (build with and without PTDUP_EXTENT=1).
+int main(int argc, char *argv[]){
+  enum { NCHILD=32, N=50 };
+  char *args[] = { "echo", 0 };
+  int fds[2], n, start;
+  uint64 before[3], after[3];  // processes, L2/L1 duplications and PTDS/PTED lists (bytes).
+  char c;
+
+  // Park children on a pipe, and see how much PTDUP grows.
+  if(pipe(fds) != 0){
+    printf("ptdupbench: pipe() failed\n");
+    exit(1);
+  }
+  if(check_ptdup_overhead(before) < 0){
+    printf("ptdupbench: check_ptdup_overhead() failed\n");
+    exit(1);
+  }
+  for(n = 0; n < NCHILD; n++){
+    int pid = fork();
+    if(pid < 0)
+      break;
+    if(pid == 0){
+      close(fds[1]);
+      read(fds[0], &c, 1);  // until the parent closes the write end.
+      exit(0);
+    }
+  }
+  if(check_ptdup_overhead(after) < 0){
+    printf("ptdupbench: check_ptdup_overhead() failed\n");
+    exit(1);
+  }
+  close(fds[1]);
+  close(fds[0]);
+  for(int i = 0; i < n; i++)
+    wait(0);
+  if(n == 0){
+    printf("ptdupbench: no fork at all\n");
+    exit(1);
+  }
+  printf("PTDUP overhead: %d processes, L2/L1 duplications %d, PTDS/PTED lists %d (bytes)\n",
+         (int)after[0], (int)after[1], (int)after[2]);
+  printf("PTDUP overhead: %d bytes per process\n",
+         (int)((after[1] + after[2] - before[1] - before[2]) / n));
+
+  start = uptime();
+  for(int i = 0; i < N; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("ptdupbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0)
+      exit(0);
+    wait(0);
+  }
+  printf("%d fork(): %d ticks\n", N, uptime() - start);
+
+  start = uptime();
+  for(int i = 0; i < N; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("ptdupbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      close(1);  // keep echo quiet.
+      exec("echo", args);
+      exit(1);
+    }
+    wait(0);
+  }
+  printf("%d fork() and exec(): %d ticks\n", N, uptime() - start);
+
+  exit(0);
+}
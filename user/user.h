@@ -41,6 +41,9 @@ int atoi(const char*);
 
 // Ev6 system call
 void change_recovery_mode(int);
+int mlistbench(int, uint64*);
+int check_memory_space_overhead(void);
+int check_ptdup_overhead(uint64*);
 
 // Userland Cooperation
 int enable_user_coop(void);
@@ -600,6 +600,169 @@ forkforkfork(char *s)
   sleep(10); // one second
 }
 
+// fill the process table: park children on a pipe until fork() fails.
+// nearly NPROC of them must fit, pid lookups must still miss a pid
+// that doesn't exist, and wait() must reap every child and then fail.
+void
+forkmany(char *s)
+{
+  enum { USED=8 };  // init, sh, usertests and its children for the test.
+  int fds[2], n, pid, last = 0;
+  char c;
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+
+  for(n = 0; n < NPROC; n++){
+    pid = fork();
+    if(pid < 0)
+      break;
+    if(pid == 0){
+      close(fds[1]);
+      read(fds[0], &c, 1);  // until the parent closes the write end.
+      exit(0);
+    }
+    last = pid;
+  }
+  if(n < NPROC - USED){
+    printf("%s: only %d children out of %d procs\n", s, n, NPROC);
+    close(fds[1]);
+    while(wait(0) >= 0)
+      ;
+    exit(1);
+  }
+  if(kill(last + 100000) != -1){
+    printf("%s: kill of a missing pid succeeded\n", s);
+    exit(1);
+  }
+
+  close(fds[1]);
+  for(int i = 0; i < n; i++){
+    if(wait(0) < 0){
+      printf("%s: wait stopped early after %d of %d children\n", s, i, n);
+      exit(1);
+    }
+  }
+  if(wait(0) != -1){
+    printf("%s: wait got too many\n", s);
+    exit(1);
+  }
+}
+
+// fork() of parents from 16KB to 4MB. fork() shares the parent's
+// memory copy-on-write and builds the child's page table duplications
+// (PTDUP) in a single pass. the child must see every page of the
+// parent, and its writes must not reach the parent.
+void
+forksize(char *s)
+{
+  enum { N=4 };
+  char *base = sbrk(0);
+  int xstatus;
+
+  for(int sz = 16*1024; sz <= 4*1024*1024; sz *= 4){
+    if(sbrk(base + sz - (char*)sbrk(0)) == (char*)0xffffffffffffffffL){
+      printf("%s: sbrk to %d bytes failed\n", s, sz);
+      exit(1);
+    }
+    for(int i = 0; i < sz; i += PGSIZE)
+      base[i] = (char)(i / PGSIZE);
+    for(int n = 0; n < N; n++){
+      int pid = fork();
+      if(pid < 0){
+        printf("%s: fork failed\n", s);
+        exit(1);
+      }
+      if(pid == 0){
+        for(int i = 0; i < sz; i += PGSIZE){
+          if(base[i] != (char)(i / PGSIZE))
+            exit(1);
+          base[i] = -1;
+        }
+        exit(0);
+      }
+      wait(&xstatus);
+      if(xstatus != 0){
+        printf("%s: child of a %dKB parent saw wrong contents\n", s, sz / 1024);
+        exit(1);
+      }
+    }
+    for(int i = 0; i < sz; i += PGSIZE){
+      if(base[i] != (char)(i / PGSIZE)){
+        printf("%s: child's write reached the %dKB parent\n", s, sz / 1024);
+        exit(1);
+      }
+    }
+  }
+  sbrk(base - (char*)sbrk(0));
+}
+
+// copy-on-write fork(). the child writes to the shared memory both
+// by stores and by the kernel's copyout() in read(), and the parent
+// doesn't see the writes. the parent takes more than half of the
+// memory, so fork() succeeds only if the memory is shared.
+void
+cowfork(char *s)
+{
+  enum { SZ=80*1024*1024 };
+  int fds[2], pid, xstatus;
+  char *a;
+
+  a = sbrk(SZ);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < SZ; i += PGSIZE)
+    a[i] = 1;
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], "x", 1) != 1){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(int i = 0; i < SZ; i += 64*PGSIZE)
+      a[i] = 2;
+    if(read(fds[0], a + PGSIZE + 1, 1) != 1){
+      printf("%s: read into a shared page failed\n", s);
+      exit(1);
+    }
+    if(a[0] != 2 || a[PGSIZE] != 1 || a[PGSIZE + 1] != 'x'){
+      printf("%s: child sees wrong contents\n", s);
+      exit(1);
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+
+  for(int i = 0; i < SZ; i += PGSIZE){
+    if(a[i] != 1){
+      printf("%s: parent sees the child's write at %d\n", s, i);
+      exit(1);
+    }
+  }
+  if(a[PGSIZE + 1] != 0){
+    printf("%s: parent sees the child's read\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  sbrk(-SZ);
+}
+
 // regression test. does reparent() violate the parent-then-child
 // locking order when giving away a child to init, so that exit()
 // deadlocks against init's wait()? also used to trigger a "panic:
@@ -1799,6 +1962,156 @@ sbrkarg(char *s)
   } 
 }
 
+// grow and shrink the heap a page at a time. each page is recorded in
+// the kernel's PTDS/PTED lists on its first touch and erased by sbrk().
+// the pages must keep their contents while mapped, and a page grown
+// again after the shrink must be a fresh zero page.
+void
+sbrkmany(char *s)
+{
+  enum { N=4096 };
+  char *base, *a;
+
+  base = sbrk(0);
+  for(int i = 0; i < N; i++){
+    a = sbrk(PGSIZE);
+    if(a == (char*)0xffffffffffffffffL){
+      printf("%s: sbrk failed at page %d\n", s, i);
+      exit(1);
+    }
+    *a = i;
+  }
+
+  for(int i = 0; i < N; i += 511){
+    if(base[i*PGSIZE] != (char)i){
+      printf("%s: page %d lost its contents\n", s, i);
+      exit(1);
+    }
+  }
+
+  for(int i = 0; i < N; i++){
+    if(sbrk(-PGSIZE) == (char*)0xffffffffffffffffL){
+      printf("%s: sbrk shrink failed at page %d\n", s, i);
+      exit(1);
+    }
+  }
+  if(sbrk(0) != base){
+    printf("%s: sbrk did not shrink back\n", s);
+    exit(1);
+  }
+
+  for(int i = 0; i < N; i += 511){
+    a = sbrk(511*PGSIZE);
+    if(a == (char*)0xffffffffffffffffL){
+      printf("%s: sbrk regrow failed at page %d\n", s, i);
+      exit(1);
+    }
+    if(*a != 0){
+      printf("%s: page %d kept its old contents after the shrink\n", s, i);
+      exit(1);
+    }
+  }
+  sbrk(base - (char*)sbrk(0));
+}
+
+// sbrk() only reserves memory, and a page is allocated on its first
+// touch, by the process or by the kernel in read() and write().
+void
+sbrklazy(char *s)
+{
+  enum { BIG=64*1024*1024 };  // twice of it is more than the physical memory.
+  char *a, *p;
+  int fds[2];
+
+  // each sbrk() is no more than the free memory, and only a few pages are touched.
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL || sbrk(BIG) != a + BIG){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+
+  for(p = a; p < a + 2 * BIG; p += BIG / 32)
+    *p = 1;
+  if(a[BIG / 64] != 0 || a[2 * BIG - 1] != 0){
+    printf("%s: untouched memory isn't zero\n", s);
+    exit(1);
+  }
+
+  // write() from and read() into untouched pages.
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  p = a + BIG / 2 + 3 * PGSIZE;
+  if(write(fds[1], p, 1) != 1 || read(fds[0], p + BIG / 4, 1) != 1){
+    printf("%s: write() or read() of untouched memory failed\n", s);
+    exit(1);
+  }
+  if(p[BIG / 4] != 0){
+    printf("%s: read() got wrong data\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  if(sbrk(-2 * BIG) != a + 2 * BIG || sbrk(0) != a){
+    printf("%s: sbrk could not deallocate\n", s);
+    exit(1);
+  }
+}
+
+// concurrent kalloc()/kfree() on several CPUs go through the per-CPU page caches.
+void
+kallocpar(char *s)
+{
+  enum { NCHILD=4, N=20, NPG=64 };
+  char *a;
+  int i, j, k, pid, xstatus;
+
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(j = 0; j < N; j++){
+        a = sbrk(NPG * PGSIZE);
+        if(a == (char*)0xffffffffffffffffL){
+          printf("%s: sbrk failed\n", s);
+          exit(1);
+        }
+        for(k = 0; k < NPG; k++)
+          a[k * PGSIZE] = i + j + k;
+        for(k = 0; k < NPG; k++){
+          if(a[k * PGSIZE] != (char)(i + j + k)){
+            printf("%s: page %d has wrong data\n", s, k);
+            exit(1);
+          }
+        }
+        sbrk(-NPG * PGSIZE);
+      }
+      exit(0);
+    }
+  }
+
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+
+  // the pages freed by the children are allocatable again.
+  a = sbrk(4 * NPG * PGSIZE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 4 * NPG; i++)
+    a[i * PGSIZE] = 1;
+  sbrk(-4 * NPG * PGSIZE);
+}
+
 void
 validatetest(char *s)
 {
@@ -2096,7 +2409,7 @@ run(void f(char *), char *s, int count) {
   int pid;
   int xstatus;
 
-  printf("test %s (%d/46): ", s, count);
+  printf("test %s (%d/52): ", s, count);
   if((pid = fork()) < 0) {
     printf("runtest: fork error\n");
     exit(1);
@@ -2137,6 +2450,9 @@ main(int argc, char *argv[])
     {twochildren, "twochildren"},
     {forkfork, "forkfork"},
     {forkforkfork, "forkforkfork"},
+    {forkmany, "forkmany"},
+    {forksize, "forksize"},
+    {cowfork, "cowfork"},
     {argptest, "argptest"},
     {createdelete, "createdelete"},
     {linkunlink, "linkunlink"},
@@ -2155,6 +2471,9 @@ main(int argc, char *argv[])
     {kernmem, "kernmem"},
     {sbrkfail, "sbrkfail"},
     {sbrkarg, "sbrkarg"},
+    {sbrkmany, "sbrkmany"},
+    {sbrklazy, "sbrklazy"},
+    {kallocpar, "kallocpar"},
     {validatetest, "validatetest"},
     {stacktest, "stacktest"},
     {opentest, "opentest"},
@@ -36,3 +36,13 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("change_recovery_mode");
+entry("enable_user_coop");
+entry("disable_user_coop");
+entry("check_reserved_fd");
+entry("check_reserved_fd_all");
+entry("reopen");
+entry("pick_fd");
+entry("mlistbench");
+entry("check_memory_space_overhead");
+entry("check_ptdup_overhead");